@@ -29,6 +29,16 @@ long floppy_write_blocks(fd_dev_t *fd, void *buf, u_long block, int count)
 	return fd_sync_request(&req);
 }
 
+/* Start the transfer IO, in FD_SECTSIZ blocks, on the drive FD. */
+bool floppy_submit_io(fd_dev_t *fd, blkio_t *io)
+{
+	if((io->block + io->nblocks) > fd->total_blocks)
+		return FALSE;
+	fd_async_io(fd, io->write ? FD_CMD_WRITE : FD_CMD_READ,
+		io->block, io);
+	return TRUE;
+}
+
 #define FACTOR (FS_BLKSIZ / FD_SECTSIZ)
 
 long floppy_read_block(void *fd, blkno block, void *buf, int count)
@@ -45,6 +55,20 @@ long floppy_write_block(void *fd, blkno block, void *buf, int count)
 }
 
 
+long floppy_read_block_v(void *fd, blkno block, void **bufs, int count)
+{
+	return fd_sync_vector((fd_dev_t *)fd, FD_CMD_READ, block * FACTOR,
+		bufs, count, FACTOR) ? 1 : -E_IO;
+}
+
+
+long floppy_write_block_v(void *fd, blkno block, void **bufs, int count)
+{
+	return fd_sync_vector((fd_dev_t *)fd, FD_CMD_WRITE, block * FACTOR,
+		bufs, count, FACTOR) ? 1 : -E_IO;
+}
+
+
 long floppy_test_media(void *f)
 {
 #if 1
@@ -88,6 +112,8 @@ bool floppy_add_dev(fd_dev_t *fd)
 		dev->name = fd->name;
 		dev->read_blocks = floppy_read_block;
 		dev->write_blocks = floppy_write_block;
+		dev->read_blocks_v = floppy_read_block_v;
+		dev->write_blocks_v = floppy_write_block_v;
 		dev->test_media = floppy_test_media;
 		dev->user_data = fd;
 		if(fs->add_device(dev)) {
@@ -32,7 +32,7 @@ extern char *track_buf;
 extern struct DmaBuf DMAbuf;
 extern fd_dev_t fd_devs[2];
 extern void (*fd_intr)(void);
-extern list_t fd_reqs;
+extern blkqueue_t fd_queue;
 extern blkreq_t *current_req;
 #define FAKE_REQ ((blkreq_t *)0xFD00FD00)
 
@@ -44,6 +44,9 @@ extern bool int_timer_flag;
 /* Request handling */
 void do_request(blkreq_t *req);
 int fd_sync_request(blkreq_t *req);
+void fd_async_io(fd_dev_t *fd, int command, u_long block, blkio_t *io);
+bool fd_sync_vector(fd_dev_t *fd, int command, u_long block, void **bufs,
+		    int count, int per_buf);
 void fd_end_request(int i);
 void handle_error(const char *from);
 void timer_intr(void *);
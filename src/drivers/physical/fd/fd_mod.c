@@ -19,6 +19,7 @@ struct fd_module fd_module =
 	floppy_read_blocks, floppy_write_blocks,
 	floppy_mount_partition, floppy_mkfs_partition,
 	floppy_force_seek,
+	floppy_submit_io,
 };
 
 static bool fd_init(void)
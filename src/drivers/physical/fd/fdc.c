@@ -436,7 +436,7 @@ void read_intr(void)
 	 * Disadvantage is then all retries then to entire request.
 	 * Let's try a new request...
 	 */
-	prepend_node(&fd_reqs, &current_req->node);
+	blkq_requeue(&fd_queue, current_req);
 	current_req = NULL;
 	do_request(NULL);
 }
@@ -17,10 +17,11 @@ fd_dev_t fd_devs[2];
 /* The function to dispatch the next IRQ to (or NULL). */
 void (*fd_intr)(void);
 
-/* The list of FD requests, the first element is the request to process
-   after the current one completes. Note that any access to this structure
-   must only take place with interrupts masked. */
-list_t fd_reqs;
+/* The queue of FD requests waiting for the current one to complete.
+   Note that any access to this structure must only take place with
+   interrupts masked. Requests aren't merged since each read command
+   transfers a whole track through the DMA buffer anyway. */
+blkqueue_t fd_queue;
 
 /* The request currently being processed, or NULL. Same warning applies
    about interrupts as above. */
@@ -35,6 +36,8 @@ struct timer_req timer;
 
 END_REQUEST_FUN(current_req)
 SYNC_REQUEST_FUN(do_request)
+SYNC_VECTOR_FUN(do_request)
+ASYNC_IO_FUN(do_request)
 
 
 /* IRQ dispatcher. */
@@ -59,8 +62,9 @@ static void fd_int_handler(void)
 }
 
 /* If no request is currently being processed and there's new requests in
-   the queue, process the first one. This can be called from an interrupt
-   or the normal kernel context. */
+   the queue, process the next one. This can be called from an interrupt
+   or the normal kernel context. REQ is either a request to add to the
+   queue or NULL. */
 void do_request(blkreq_t *req)
 {
     fd_dev_t *dev;
@@ -74,10 +78,13 @@ void do_request(blkreq_t *req)
 top:
 
     cli();
+    if(req != NULL)
+    {
+	blkq_add(&fd_queue, req);
+	req = NULL;
+    }
     if(current_req != NULL)
     {
-	if(req != NULL)
-	    append_node(&fd_reqs, &req->node);
 	load_flags(flags);
 	return;
     }
@@ -86,24 +93,15 @@ top:
 	if(fd_devs[i].recalibrate)
 	{
 	    fdc_recal(&fd_devs[i]);
-	    if(req != NULL)
-		append_node(&fd_reqs, &req->node);
 	    load_flags(flags);
 	    return;
 	}
     }
+    req = blkq_next(&fd_queue);
     if(req == NULL)
     {
-	if(!list_empty_p(&fd_reqs))
-	{
-	    req = (blkreq_t *)fd_reqs.head;
-	    remove_node(&req->node);
-	}
-	else
-	{
-	    load_flags(flags);
-	    return;
-	}
+	load_flags(flags);
+	return;
     }
     current_req = req;
 #if 0
@@ -248,6 +246,19 @@ int fd_sync_request(blkreq_t *req)
 	return sync_request(req);
 }
 
+void fd_async_io(fd_dev_t *fd, int command, u_long block, blkio_t *io)
+{
+	async_io(fd, command, block, io);
+}
+
+/* Merging is disabled on the floppy so this only queues one request
+   per buffer at once, letting the elevator order them. */
+bool fd_sync_vector(fd_dev_t *fd, int command, u_long block, void **bufs,
+		    int count, int per_buf)
+{
+	return sync_vector(fd, command, block, bufs, count, per_buf, 0);
+}
+
 void fd_end_request(int i)
 {
 	end_request(i);
@@ -277,7 +288,7 @@ void handle_error(const char *from)
 	    REQ_FD_DEV(current_req)->recalibrate = TRUE;
 	/* Retry the current request, this simply means stacking it on the
 	   front of the queue and calling do_request(). */
-	prepend_node(&fd_reqs, &current_req->node);
+	blkq_requeue(&fd_queue, current_req);
 	current_req = NULL;
 	DB(("fd:handle_error: Retrying request %p\n", current_req));
     }
@@ -302,7 +313,8 @@ bool floppy_init(void)
 
 	kprintf("fd: init\n");
 
-	init_list(&fd_reqs);
+	blkq_init(&fd_queue, 0);
+	blkio_init();
 
 	/* get the IRQ and DMA hardware and a DMA buffer */
 	if(!kernel->alloc_irq(FLOPPY_IRQ, fd_int_handler, "fd")) {
@@ -277,6 +277,76 @@ hd_write_blocks(hd_partition_t *p, void *buf, u_long block, int count)
 }
 
 
+/* Vectored versions of the above, COUNT buffers BUFS each of PER-BUF
+   blocks are transferred. If the device has no vectored functions each
+   buffer is transferred separately. */
+
+bool
+hd_read_blocks_v(hd_partition_t *p, void **bufs, u_long block, int count,
+		 int per_buf)
+{
+    int i;
+    if((block + count * per_buf) > p->size)
+	return FALSE;
+    if(p->hd->read_blocks_v != NULL)
+	return p->hd->read_blocks_v(p->hd, bufs, block + p->start, count,
+				    per_buf);
+    for(i = 0; i < count; i++)
+    {
+	if(!p->hd->read_blocks(p->hd, bufs[i],
+			       block + p->start + i * per_buf, per_buf))
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+bool
+hd_write_blocks_v(hd_partition_t *p, void **bufs, u_long block, int count,
+		  int per_buf)
+{
+    int i;
+    if((block + count * per_buf) > p->size)
+	return FALSE;
+    if(p->hd->write_blocks_v != NULL)
+	return p->hd->write_blocks_v(p->hd, bufs, block + p->start, count,
+				     per_buf);
+    for(i = 0; i < count; i++)
+    {
+	if(!p->hd->write_blocks(p->hd, bufs[i],
+				block + p->start + i * per_buf, per_buf))
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+
+/* Start the transfer IO on the partition P, returning FALSE if it's
+   outside the partition. If the device can't do asynchronous transfers
+   IO is done before this returns, but its submitter is still notified
+   in the usual way. */
+bool
+hd_submit_io(hd_partition_t *p, blkio_t *io)
+{
+    u_long flags;
+    bool ok;
+    if((io->block + io->nblocks) > p->size)
+	return FALSE;
+    if(p->hd->submit_io != NULL)
+	return p->hd->submit_io(p->hd, io, io->block + p->start);
+    if(io->write)
+	ok = p->hd->write_blocks(p->hd, io->buf, io->block + p->start,
+				 io->nblocks);
+    else
+	ok = p->hd->read_blocks(p->hd, io->buf, io->block + p->start,
+				io->nblocks);
+    save_flags(flags);
+    cli();
+    blkio_complete(io, ok ? 0 : -1);
+    load_flags(flags);
+    return TRUE;
+}
+
+
 /* Functions to interface a logical partition to the file system. */
 
 static long
@@ -293,6 +363,20 @@ hd_fs_write_blocks(void *p, blkno block, void *buf, int count)
 			   count * (FS_BLKSIZ / 512)) ? 1 : -E_IO;
 }
 
+static long
+hd_fs_read_blocks_v(void *p, blkno block, void **bufs, int count)
+{
+    return hd_read_blocks_v(p, bufs, block * (FS_BLKSIZ / 512), count,
+			    FS_BLKSIZ / 512) ? 1 : -E_IO;
+}
+
+static long
+hd_fs_write_blocks_v(void *p, blkno block, void **bufs, int count)
+{
+    return hd_write_blocks_v(p, bufs, block * (FS_BLKSIZ / 512), count,
+			     FS_BLKSIZ / 512) ? 1 : -E_IO;
+}
+
 /* Mount the logical partition P in the file system. If READ-ONLY is TRUE
    no modifications will be allowed to P. */
 bool
@@ -313,6 +397,8 @@ hd_mount_partition(hd_partition_t *p, bool read_only)
 	dev->name = p->name;
 	dev->read_blocks = hd_fs_read_blocks;
 	dev->write_blocks = hd_fs_write_blocks;
+	dev->read_blocks_v = hd_fs_read_blocks_v;
+	dev->write_blocks_v = hd_fs_write_blocks_v;
 	dev->test_media = NULL;
 	dev->user_data = p;
 	dev->read_only = read_only;	/* ? */
@@ -331,9 +417,10 @@ hd_mount_partition(hd_partition_t *p, bool read_only)
     return rc;
 }
 
-/* Create a file system on the unmounted partition P. */
+/* Create a file system on the unmounted partition P, in the format
+   VERSION (FS_VERSION_1 or FS_VERSION_2). */
 bool
-hd_mkfs_partition(hd_partition_t *p, u_long reserved)
+hd_mkfs_partition(hd_partition_t *p, u_long reserved, int version)
 {
     bool rc = FALSE;
     struct fs_device *dev = fs->get_device(p->name);
@@ -349,10 +436,12 @@ hd_mkfs_partition(hd_partition_t *p, u_long reserved)
 	dev->name = p->name;
 	dev->read_blocks = hd_fs_read_blocks;
 	dev->write_blocks = hd_fs_write_blocks;
+	dev->read_blocks_v = hd_fs_read_blocks_v;
+	dev->write_blocks_v = hd_fs_write_blocks_v;
 	dev->test_media = NULL;
 	dev->user_data = p;
 	dev->read_only = FALSE;
-	if(fs->mkfs(dev, p->size / (FS_BLKSIZ / 512), reserved))
+	if(fs->mkfs(dev, p->size / (FS_BLKSIZ / 512), reserved, version))
 	    rc = TRUE;
     }
     return rc;
@@ -14,6 +14,8 @@ struct hd_module hd_module =
     hd_add_dev, hd_remove_dev,
     hd_find_partition, hd_read_blocks, hd_write_blocks,
     hd_mount_partition, hd_mkfs_partition,
+    hd_read_blocks_v, hd_write_blocks_v,
+    hd_submit_io,
 };
 
 bool
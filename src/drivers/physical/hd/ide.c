@@ -19,16 +19,27 @@
 #include <vmm/tasks.h>
 #include <vmm/kernel.h>
 #include <vmm/irq.h>
+#include <vmm/page.h>
 
 #define kprintf kernel->printf
 #define ksprintf kernel->sprintf
 
 #define MAX_RETRIES	16
+#define MAX_MERGE	128		/* Sectors in one merged command */
+#define MAX_MULTIPLE	16		/* Most sectors per interrupt */
 #define RESET_FREQ	8
 #define RECAL_FREQ	4
 
 #define IDE0_IRQ	14
 
+/* PCI configuration mechanism #1. */
+#define PCI_CONFIG_ADDR	0xcf8
+#define PCI_CONFIG_DATA	0xcfc
+#define PCI_ENABLE	0x80000000
+
+/* The PRD table fills one page. */
+#define MAX_PRDS	(PAGE_SIZE / sizeof(struct ide_prd))
+
 #define IN_SECT(buf)	insw(buf, 256, HD_DATA)
 #define OUT_SECT(buf)	outsw(buf, 256, HD_DATA)
 
@@ -44,6 +55,8 @@ typedef struct {
     u_long precomp, lzone;		/* Unused by the driver */
     u_char ctl, select;
     u_char drvno;
+    u_char multiple;			/* Sectors per IRQ, 0 if not multiple */
+    bool dma;				/* TRUE to use bus-master DMA */
     bool recalibrate;			/* TRUE when device should recal. */
 } ide_dev_t;
 
@@ -59,10 +72,10 @@ static ide_dev_t ide_devs[2];
 /* The function to dispatch the next IRQ to (or NULL). */
 static void (*ide_intr)(void);
 
-/* The list of IDE requests, the first element is the request to process
-   after the current one completes. Note that any access to this structure
-   must only take place with interrupts masked. */
-static list_t ide_reqs;
+/* The queue of IDE requests waiting for the current one to complete.
+   Note that any access to this structure must only take place with
+   interrupts masked. */
+static blkqueue_t ide_queue;
 
 /* The request currently being processed, or NULL. Same warning applies
    about interrupts as above. */
@@ -75,14 +88,27 @@ static blkreq_t *current_req;
 /* TRUE when the controller should be reset before the next request. */
 static bool reset_pending;
 
+/* I/O base of the bus-master registers for the primary channel, or zero
+   if there's no bus-master controller. */
+static u_short bm_base;
+
+/* The PRD table for DMA transfers and its physical address. */
+static struct ide_prd *prd_table;
+static u_long prd_phys;
+
+/* TRUE when the command in progress is a DMA transfer. */
+static bool dma_active;
+
 static void do_request(blkreq_t *req);
 static void handle_error(const char *from);
 
 
-/* Pull in the two functions from <vmm/blkdev.h> */
+/* Pull in the functions from <vmm/blkdev.h> */
 
 END_REQUEST_FUN(current_req)
 SYNC_REQUEST_FUN(do_request)
+SYNC_VECTOR_FUN(do_request)
+ASYNC_IO_FUN(do_request)
 
 
 
@@ -165,6 +191,36 @@ wait_stat(int good_stat, int bad_stat, int retries, const char *from)
     return TRUE;
 }
 
+/* Returns the number of sectors the drive transfers before the next
+   interrupt of the command for REQ, which is in progress. */
+static inline int
+group_size(blkreq_t *req)
+{
+    u_long left;
+    if(req->dev->multiple == 0)
+	return 1;
+    left = blkq_chain_blocks(req);
+    return (left < req->dev->multiple) ? left : req->dev->multiple;
+}
+
+/* Move the current request on by one sector, into the next request of
+   its merge chain if necessary. Returns FALSE if the whole chain has
+   been transferred. */
+static bool
+next_sector(void)
+{
+    blkreq_t *req = current_req;
+    if(req->nblocks > 1)
+    {
+	req->block++;
+	req->nblocks--;
+	req->buf += 512;
+	req->retries = 0;
+	return TRUE;
+    }
+    return next_merged_request();
+}
+
 /* IRQ handler for read requests. */
 static void
 read_intr(void)
@@ -173,32 +229,53 @@ read_intr(void)
     if(current_req != NULL)
     {
 	blkreq_t *req = current_req;
+	int count;
 	if(!test_stat(GET_STAT(), DATA_RDY_STAT, BAD_RW_STAT))
 	{
 	    handle_error("read_intr");
 	    do_request(NULL);
 	    return;
 	}
-	IN_SECT(req->buf);
-	DB(("ide:read_intr: Read sector, drive=%d block=%d\n",
-	    req->dev->drvno, req->block));
-	if(req->nblocks > 1)
+	for(count = group_size(req); count > 0; count--)
 	{
-	    req->block++;
-	    req->nblocks--;
-	    req->buf += 512;
-	    req->retries = 0;
-	    ide_intr = read_intr;
+	    IN_SECT(current_req->buf);
+	    DB(("ide:read_intr: Read sector, drive=%d block=%d\n",
+		req->dev->drvno, current_req->block));
+	    if(!next_sector())
+	    {
+		end_request(0);
+		do_request(NULL);
+		return;
+	    }
 	}
-	else
+	ide_intr = read_intr;
+    }
+}
+
+#ifndef READ_ONLY
+/* Output the sectors the drive wants before its next interrupt, from
+   the current position of the current request onwards. The request
+   isn't moved on until the interrupt shows they were written. */
+static void
+out_group(void)
+{
+    blkreq_t *req = current_req;
+    char *buf = req->buf;
+    int left = req->nblocks;
+    int count;
+    for(count = group_size(req); count > 0; count--)
+    {
+	OUT_SECT(buf);
+	if(--left > 0)
+	    buf += 512;
+	else if((req = req->merge_next) != NULL)
 	{
-	    end_request(0);
-	    do_request(NULL);
+	    buf = req->buf;
+	    left = req->nblocks;
 	}
     }
 }
 
-#ifndef READ_ONLY
 /* IRQ handler for write requests. */
 static void
 write_intr(void)
@@ -207,37 +284,135 @@ write_intr(void)
     if(current_req != NULL)
     {
 	blkreq_t *req = current_req;
+	int count;
 	if(!test_stat(GET_STAT(), DRV_RDY_STAT, BAD_RW_STAT))
 	{
 	    handle_error("write_intr");
 	    do_request(NULL);
 	    return;
 	}
-	DB(("ide:write_intr: Done writing sector, drive=%d block=%d\n",
+	DB(("ide:write_intr: Done writing sectors, drive=%d block=%d\n",
 	    req->dev->drvno, req->block));
-	if(req->nblocks > 1)
+	for(count = group_size(req); count > 0; count--)
 	{
-	    req->block++;
-	    req->nblocks--;
-	    req->buf += 512;
-	    req->retries = 0;
-	    if(wait_stat(HD_STAT_DRQ, BAD_RW_STAT, 100000, "write_intr:DRQ"))
+	    if(!next_sector())
 	    {
-		OUT_SECT(req->buf);
-		DB(("ide:write_intr: Output sector, drive=%d block=%d.\n",
-		    req->dev->drvno, req->block));
-		ide_intr = write_intr;
+		end_request(0);
+		do_request(NULL);
+		return;
 	    }
 	}
-	else
+	if(wait_stat(HD_STAT_DRQ, BAD_RW_STAT, 100000, "write_intr:DRQ"))
 	{
-	    end_request(0);
-	    do_request(NULL);
+	    out_group();
+	    DB(("ide:write_intr: Output sectors, drive=%d block=%d.\n",
+		req->dev->drvno, current_req->block));
+	    ide_intr = write_intr;
 	}
     }
 }
 #endif
 
+/* Fill in the PRD table for the transfer of REQ and the requests merged
+   after it. Returns FALSE if the buffers can't be described, in which
+   case PIO must be used. */
+static bool
+build_prd_table(blkreq_t *req)
+{
+    struct ide_prd *prd = NULL;
+    u_int nprds = 0;
+    for(; req != NULL; req = req->merge_next)
+    {
+	u_long addr = (u_long)req->buf;
+	u_long len = req->nblocks * 512;
+	if(addr & 1)
+	    return FALSE;
+	while(len > 0)
+	{
+	    u_long chunk = PAGE_SIZE - PAGE_OFFSET(addr);
+	    u_long phys = kernel->lin_to_phys(kernel->current_task->page_dir,
+					      TO_LINEAR(addr));
+	    if(phys == 0)
+		return FALSE;
+	    if(chunk > len)
+		chunk = len;
+	    if(prd != NULL && prd->addr + prd->count == phys
+	       && prd->count + chunk < 0x10000
+	       && (prd->addr & 0xffff0000) == ((phys + chunk - 1) & 0xffff0000))
+	    {
+		/* Physically contiguous with the last region. */
+		prd->count += chunk;
+	    }
+	    else
+	    {
+		if(nprds == MAX_PRDS)
+		    return FALSE;
+		prd = &prd_table[nprds++];
+		prd->addr = phys;
+		prd->count = chunk;
+		prd->flags = 0;
+	    }
+	    addr += chunk;
+	    len -= chunk;
+	}
+    }
+    if(prd == NULL)
+	return FALSE;
+    prd->flags = PRD_EOT;
+    return TRUE;
+}
+
+/* IRQ handler for DMA requests. */
+static void
+dma_intr(void)
+{
+    u_char bm_stat;
+    DB(("ide:dma_intr: current_req=%p\n", current_req));
+    if(current_req == NULL)
+	return;
+    bm_stat = inb_p(bm_base + BM_STATUS);
+    outb_p(0, bm_base + BM_COMMAND);
+    outb_p(bm_stat | BM_STAT_ERR | BM_STAT_INTR, bm_base + BM_STATUS);
+    if(bm_stat & BM_STAT_ERR)
+    {
+	kprintf("ide: %s: DMA bus error, using PIO.\n",
+		current_req->dev->hd.name);
+	current_req->dev->dma = FALSE;
+    }
+    if((bm_stat & BM_STAT_ERR)
+       || !test_stat(GET_STAT(), DRV_RDY_STAT, BAD_RW_STAT))
+    {
+	handle_error("dma_intr");
+	do_request(NULL);
+	return;
+    }
+    end_request(0);
+    do_request(NULL);
+}
+
+/* Start a DMA transfer for REQ, whose address and sector count have
+   already been given to the drive. Returns FALSE if the transfer can't
+   be done by DMA. */
+static bool
+start_dma(blkreq_t *req)
+{
+    u_char dir;
+    if(!req->dev->dma || !build_prd_table(req))
+	return FALSE;
+    dir = (req->command == HD_CMD_READ) ? BM_CMD_READ : 0;
+    outl_p(prd_phys, bm_base + BM_PRD);
+    outb_p(dir, bm_base + BM_COMMAND);
+    outb_p(inb_p(bm_base + BM_STATUS) | BM_STAT_ERR | BM_STAT_INTR,
+	   bm_base + BM_STATUS);
+    ide_intr = dma_intr;
+    dma_active = TRUE;
+    outb_p((req->command == HD_CMD_READ) ? HD_CMD_READDMA : HD_CMD_WRITEDMA,
+	   HD_COMMAND);
+    outb_p(dir | BM_CMD_START, bm_base + BM_COMMAND);
+    DB(("ide:start_dma: drive=%d block=%d\n", req->dev->drvno, req->block));
+    return TRUE;
+}
+
 /* IRQ dispatcher. */
 static void
 ide_int_handler(void)
@@ -287,6 +462,126 @@ recalibrate_drive(ide_dev_t *dev)
     }
 }
 
+/* Tell device DEV to transfer DEV->multiple sectors per interrupt in
+   READ and WRITE MULTIPLE commands. The command is polled with the
+   drive's interrupt disabled. If the drive refuses, multiple mode is
+   turned off and single-sector commands are used instead. */
+static void
+set_multiple_mode(ide_dev_t *dev)
+{
+    if(dev->multiple == 0)
+	return;
+    outb_p(dev->select, HD_CURRENT);
+    if(wait_stat(HD_STAT_DRDY, HD_STAT_BSY | HD_STAT_DRQ, 100000, NULL))
+    {
+	bool ok;
+	outb_p(dev->ctl | HD_nIEN, HD_DEVCTRL);
+	outb_p(dev->multiple, HD_NSECTOR);
+	outb_p(HD_CMD_SETMULT, HD_COMMAND);
+	ok = wait_stat(HD_STAT_DRDY, HD_STAT_ERR | HD_STAT_DWF, 100000, NULL);
+	outb_p(dev->ctl, HD_DEVCTRL);
+	if(ok)
+	    return;
+    }
+    kprintf("ide: %s: Can't set multiple mode, using single sectors.\n",
+	    dev->hd.name);
+    dev->multiple = 0;
+}
+
+/* Returns TRUE if device DEV, whose IDENTIFY data is IDENT, can do
+   multiword or Ultra DMA transfers. If the BIOS hasn't selected one of
+   its DMA modes the fastest multiword mode is selected. */
+static bool
+set_dma_mode(ide_dev_t *dev, uint8_t *ident)
+{
+    int mode;
+    bool ok = FALSE;
+    if(bm_base == 0 || !(ident[ATA_IDENT_CAPABILITIES + 1] & 1))
+	return FALSE;
+    if(ident[ATA_IDENT_MWDMA + 1] != 0
+       || ((ident[ATA_IDENT_FIELDVALID] & 4)
+	   && ident[ATA_IDENT_UDMA + 1] != 0))
+	return TRUE;
+    for(mode = 2; mode >= 0; mode--)
+    {
+	if(ident[ATA_IDENT_MWDMA] & (1 << mode))
+	    break;
+    }
+    if(mode < 0)
+	return FALSE;
+    outb_p(dev->select, HD_CURRENT);
+    if(wait_stat(HD_STAT_DRDY, HD_STAT_BSY | HD_STAT_DRQ, 100000, NULL))
+    {
+	outb_p(dev->ctl | HD_nIEN, HD_DEVCTRL);
+	outb_p(HD_FEAT_XFER_MODE, HD_FEATURE);
+	outb_p(HD_XFER_MWDMA | mode, HD_NSECTOR);
+	outb_p(HD_CMD_SETFEATURES, HD_COMMAND);
+	ok = wait_stat(HD_STAT_DRDY, HD_STAT_ERR | HD_STAT_DWF, 100000, NULL);
+	outb_p(dev->ctl, HD_DEVCTRL);
+    }
+    return ok;
+}
+
+static inline u_long
+pci_read_config(int dev, int fn, int reg)
+{
+    outl(PCI_ENABLE | (dev << 11) | (fn << 8) | reg, PCI_CONFIG_ADDR);
+    return inl(PCI_CONFIG_DATA);
+}
+
+static inline void
+pci_write_config(int dev, int fn, int reg, u_long val)
+{
+    outl(PCI_ENABLE | (dev << 11) | (fn << 8) | reg, PCI_CONFIG_ADDR);
+    outl(val, PCI_CONFIG_DATA);
+}
+
+/* Look on PCI bus zero for a bus-master IDE controller whose primary
+   channel is at the legacy addresses we drive. If one is found enable
+   bus-mastering on it and set `bm_base'. */
+static void
+find_busmaster(void)
+{
+    int dev, fn;
+    outl(PCI_ENABLE, PCI_CONFIG_ADDR);
+    if(inl(PCI_CONFIG_ADDR) != PCI_ENABLE)
+	return;
+    for(dev = 0; dev < 32; dev++)
+    {
+	for(fn = 0; fn < 8; fn++)
+	{
+	    u_long id = pci_read_config(dev, fn, 0x00);
+	    u_long class, bar4;
+	    if((id & 0xffff) == 0xffff)
+	    {
+		if(fn == 0)
+		    break;
+		continue;
+	    }
+	    class = pci_read_config(dev, fn, 0x08);
+	    /* Mass storage, IDE, bus-master capable, primary channel in
+	       compatibility mode. */
+	    if((class >> 16) == 0x0101 && (class & 0x8000)
+	       && !(class & 0x0100))
+	    {
+		bar4 = pci_read_config(dev, fn, 0x20);
+		if((bar4 & 1) && (bar4 & 0xfffc) != 0)
+		{
+		    u_long cmd = pci_read_config(dev, fn, 0x04) & 0xffff;
+		    /* Enable I/O space and bus-mastering. */
+		    pci_write_config(dev, fn, 0x04, cmd | 0x05);
+		    bm_base = bar4 & 0xfffc;
+		    kprintf("ide: Bus-master controller %04x:%04x at %#x\n",
+			    id & 0xffff, id >> 16, bm_base);
+		    return;
+		}
+	    }
+	    if(fn == 0 && !(pci_read_config(dev, 0, 0x0c) & 0x00800000))
+		break;
+	}
+    }
+}
+
 /* Soft-reset the IDE controller. */
 static void
 reset_controller(void)
@@ -295,6 +590,8 @@ reset_controller(void)
     reset_pending = FALSE;
     kprintf("ide: Resetting controller.. ");
     current_req = FAKE_REQ;
+    if(bm_base != 0)
+	outb_p(0, bm_base + BM_COMMAND);
     outb_p(HD_SRST, HD_DEVCTRL);
     for(i = 0; i < 1000; i++)
 	nop();
@@ -334,13 +631,16 @@ reset_controller(void)
 	    kprintf("; %s: error", ide_devs[1].hd.name);
 	kprintf("\n");
     }
+    /* The reset may have cleared the drives' multiple mode settings. */
+    for(i = 0; i < 2; i++)
+	set_multiple_mode(&ide_devs[i]);
     current_req = NULL;
 }
     
 /* If no request is currently being processed and there's new requests in
-   the queue, process the first one. This can be called from an interrupt
-   or the normal kernel context. REQ is either a request to try and process
-   or NULL. It will get added to the list of requests if necessary. */
+   the queue, process the next one. This can be called from an interrupt
+   or the normal kernel context. REQ is either a request to add to the
+   queue or NULL. */
 static void
 do_request(blkreq_t *req)
 {
@@ -359,10 +659,13 @@ do_request(blkreq_t *req)
 top:
 
     cli();
+    if(req != NULL)
+    {
+	blkq_add(&ide_queue, req);
+	req = NULL;
+    }
     if(current_req != NULL)
     {
-	if(req != NULL)
-	    append_node(&ide_reqs, &req->node);
 	load_flags(flags);
 	return;
     }
@@ -373,24 +676,15 @@ top:
 	if(ide_devs[i].recalibrate)
 	{
 	    recalibrate_drive(&ide_devs[i]);
-	    if(req != NULL)
-		append_node(&ide_reqs, &req->node);
 	    load_flags(flags);
 	    return;
 	}
     }
+    req = blkq_next(&ide_queue);
     if(req == NULL)
     {
-	if(!list_empty_p(&ide_reqs))
-	{
-	    req = (blkreq_t *)ide_reqs.head;
-	    remove_node(&req->node);
-	}
-	else
-	{
-	    load_flags(flags);
-	    return;
-	}
+	load_flags(flags);
+	return;
     }
     current_req = req;
     load_flags(flags);
@@ -427,7 +721,7 @@ top:
 		 "do_request:select"))
     {
 	outb_p(dev->ctl, HD_DEVCTRL);
-	outb_p(req->nblocks, HD_NSECTOR);
+	outb_p(blkq_chain_blocks(req), HD_NSECTOR);
 #ifdef USE_CHS
 	outb_p(sect, HD_SECTOR);
 	outb_p(cyl, HD_LCYL);
@@ -440,21 +734,27 @@ top:
 	outb_p(dev->select | lba3, HD_CURRENT);
 #endif
 
+	dma_active = FALSE;
 	switch(req->command)
 	{
 	case HD_CMD_READ:
+	    if(start_dma(req))
+		break;
 	    ide_intr = read_intr;
-	    outb_p(HD_CMD_READ, HD_COMMAND);
+	    outb_p(dev->multiple ? HD_CMD_READMULT : HD_CMD_READ, HD_COMMAND);
 	    break;
 
 	case HD_CMD_WRITE:
 #ifndef READ_ONLY
+	    if(start_dma(req))
+		break;
 	    ide_intr = write_intr;
-	    outb_p(HD_CMD_WRITE, HD_COMMAND);
+	    outb_p(dev->multiple ? HD_CMD_WRITEMULT : HD_CMD_WRITE,
+		   HD_COMMAND);
 	    if(wait_stat(HD_STAT_DRQ, BAD_RW_STAT, 100000, "do_request:DRQ"))
 	    {
-		OUT_SECT(req->buf);
-		DB(("ide:do_request: Output sector, drive=%d block=%d.\n",
+		out_group();
+		DB(("ide:do_request: Output sectors, drive=%d block=%d.\n",
 		    req->dev->drvno, req->block));
 	    }
 #else
@@ -489,6 +789,27 @@ handle_error(const char *from)
     kprintf("ide: %s (%s): Error\n", from, current_req->dev->hd.name);
     dump_stat();
     ide_intr = NULL;
+    if(dma_active)
+    {
+	outb_p(0, bm_base + BM_COMMAND);
+	dma_active = FALSE;
+	if((GET_STAT() & HD_STAT_ERR) && (GET_ERR() & HD_ERR_ABRT))
+	{
+	    /* The drive doesn't like DMA after all, fall back to PIO. */
+	    kprintf("ide: %s: Command aborted, disabling DMA.\n",
+		    current_req->dev->hd.name);
+	    current_req->dev->dma = FALSE;
+	}
+    }
+    else if(current_req->dev->multiple != 0
+	    && (GET_STAT() & HD_STAT_ERR) && (GET_ERR() & HD_ERR_ABRT))
+    {
+	/* Probably the drive doesn't like READ/WRITE MULTIPLE after all,
+	   fall back to transferring single sectors. */
+	kprintf("ide: %s: Command aborted, disabling multiple mode.\n",
+		current_req->dev->hd.name);
+	current_req->dev->multiple = 0;
+    }
     if(current_req->retries++ < MAX_RETRIES)
     {
 	if((current_req->retries % RESET_FREQ) == 0)
@@ -497,7 +818,7 @@ handle_error(const char *from)
 	    current_req->dev->recalibrate = TRUE;
 	/* Retry the current request, this simply means stacking it on the
 	   front of the queue and calling do_request(). */
-	prepend_node(&ide_reqs, &current_req->node);
+	blkq_requeue(&ide_queue, current_req);
 	current_req = NULL;
 	DB(("ide:handle_error: Retrying request %p\n", current_req));
     }
@@ -540,16 +861,59 @@ ide_write_blocks(hd_dev_t *hd, void *buf, u_long block, int count)
     return sync_request(&req);
 }
 
+/* Read COUNT buffers BUFS, each PER-BUF blocks long, from the blocks
+   starting at BLOCK of the device HD. Each run of up to MAX_MERGE blocks
+   is read by a single command. */
+bool
+ide_read_blocks_v(hd_dev_t *hd, void **bufs, u_long block, int count,
+		  int per_buf)
+{
+    return sync_vector((ide_dev_t *)hd, HD_CMD_READ, block, bufs, count,
+		       per_buf, MAX_MERGE);
+}
+
+/* Write COUNT buffers BUFS, each PER-BUF blocks long, to the blocks
+   starting at BLOCK of the device HD. */
+bool
+ide_write_blocks_v(hd_dev_t *hd, void **bufs, u_long block, int count,
+		   int per_buf)
+{
+    return sync_vector((ide_dev_t *)hd, HD_CMD_WRITE, block, bufs, count,
+		       per_buf, MAX_MERGE);
+}
+
+/* Start the transfer IO at the block BLOCK of the device HD, and
+   return without waiting for it to finish. */
+bool
+ide_submit_io(hd_dev_t *hd, blkio_t *io, u_long block)
+{
+    async_io((ide_dev_t *)hd, io->write ? HD_CMD_WRITE : HD_CMD_READ,
+	     block, io);
+    return TRUE;
+}
+
 /* Initialise everything. */
 void
 ide_init(void)
 {
     int i;
-    init_list(&ide_reqs);
+    blkq_init(&ide_queue, MAX_MERGE);
+    blkio_init();
     /* Use a queued IRQ as the handler may sleep */
     if(!kernel->alloc_queued_irq(IDE0_IRQ, ide_int_handler, "hard disk"))
 	return;
 
+    find_busmaster();
+    if(bm_base != 0)
+    {
+	/* A page is 4-byte aligned and can't cross a 64K boundary. */
+	prd_table = (struct ide_prd *)kernel->alloc_page();
+	if(prd_table != NULL)
+	    prd_phys = TO_PHYSICAL(prd_table);
+	else
+	    bm_base = 0;
+    }
+
     /* Have to set up the device tables. */
     for(i = 0; i < 2; i++)
     {
@@ -646,14 +1010,36 @@ ide_init(void)
 	    ide_devs[i].hd.name = (i == 0) ? "hda" : "hdb";
 	    ide_devs[i].hd.read_blocks = ide_read_blocks;
 	    ide_devs[i].hd.write_blocks = ide_write_blocks;
+	    ide_devs[i].hd.read_blocks_v = ide_read_blocks_v;
+	    ide_devs[i].hd.write_blocks_v = ide_write_blocks_v;
+	    ide_devs[i].hd.submit_io = ide_submit_io;
 
 	    ide_devs[i].drvno = i;
 
+	    /* Use the largest power of two sectors per interrupt that
+	       the drive can manage, up to MAX_MULTIPLE. */
+	    ide_devs[i].multiple = 0;
+	    for(j = MAX_MULTIPLE; j > 1; j >>= 1)
+	    {
+		if(ident[ATA_IDENT_MAX_MULTIPLE] >= j)
+		{
+		    ide_devs[i].multiple = j;
+		    break;
+		}
+	    }
+	    set_multiple_mode(&ide_devs[i]);
+	    ide_devs[i].dma = set_dma_mode(&ide_devs[i], ident);
+
 	    kprintf("%s: %s\n",  ide_devs[i].hd.name, name);
 	    kprintf("%s: heads=%d cylinders=%d sectors=%d total_blocks=%d\n",
 		    ide_devs[i].hd.name, ide_devs[i].hd.heads,
 		    ide_devs[i].hd.cylinders, ide_devs[i].hd.sectors,
 		    ide_devs[i].hd.total_blocks);
+	    if(ide_devs[i].dma)
+		kprintf("%s: Using bus-master DMA\n", ide_devs[i].hd.name);
+	    else if(ide_devs[i].multiple != 0)
+		kprintf("%s: %d sectors per interrupt\n",
+			ide_devs[i].hd.name, ide_devs[i].multiple);
 
 	    hd_add_dev(&ide_devs[i].hd);
 	}
@@ -17,14 +17,16 @@
 #define kprintf kernel->printf
 #define REQ_RD_DEV(r) ((rd_dev_t *)(r->dev))
 
+#define MAX_MERGE 128
+
 /* Device structures for the ramdisks. */
 list_t rd_dev_list;
 
 
-/* The list of FD requests, the first element is the request to process
-   after the current one completes. Note that any access to this structure
-   must only take place with interrupts masked. */
-static list_t rd_reqs;
+/* The queue of RD requests waiting for the current one to complete.
+   Note that any access to this structure must only take place with
+   interrupts masked. */
+static blkqueue_t rd_queue;
 
 /* The request currently being processed, or NULL. Same warning applies
    about interrupts as above. */
@@ -40,20 +42,24 @@ static void do_request(blkreq_t *req);
 static struct fs_module *fs;
 
 
-/* Pull in the two functions from <vmm/blkdev.h> */
+/* Pull in the functions from <vmm/blkdev.h> */
 
 END_REQUEST_FUN(current_req)
 SYNC_REQUEST_FUN(do_request)
+SYNC_VECTOR_FUN(do_request)
+ASYNC_IO_FUN(do_request)
 
 
 
 /* If no request is currently being processed and there's new requests in
-   the queue, process the first one. This can be called from an interrupt
-   or the normal kernel context. */
+   the queue, process the next one. This can be called from an interrupt
+   or the normal kernel context. REQ is either a request to add to the
+   queue or NULL. */
 static void
 do_request(blkreq_t *req)
 {
     rd_dev_t *dev;
+    blkreq_t *r;
     u_long flags;
 
     save_flags(flags);
@@ -62,25 +68,21 @@ do_request(blkreq_t *req)
 top:
 
     cli();
+    if(req != NULL)
+    {
+	blkq_add(&rd_queue, req);
+	req = NULL;
+    }
     if(current_req != NULL)
     {
-	if(req != NULL)
-	    append_node(&rd_reqs, &req->node);
 	load_flags(flags);
 	return;
     }
+    req = blkq_next(&rd_queue);
     if(req == NULL)
     {
-	if(!list_empty_p(&rd_reqs))
-	{
-	    req = (blkreq_t *)rd_reqs.head;
-	    remove_node(&req->node);
-	}
-	else
-	{
-	    load_flags(flags);
-	    return;
-	}
+	load_flags(flags);
+	return;
     }
     current_req = req;
     load_flags(flags);
@@ -103,8 +105,9 @@ top:
 
     case RD_CMD_READ:	
 	DB(("dev->ram = %p\n", dev->ram));
-	memcpy(req->buf, dev->ram + (req->block * FS_BLKSIZ/2),
-		req->nblocks * FS_BLKSIZ/2);
+	for(r = req; r != NULL; r = r->merge_next)
+	    memcpy(r->buf, dev->ram + (r->block * FS_BLKSIZ/2),
+		   r->nblocks * FS_BLKSIZ/2);
 	end_request(0);
 	req = NULL;
 	goto top;
@@ -112,8 +115,9 @@ top:
 
     case RD_CMD_WRITE:
 	DB(("dev->ram = %p\n", dev->ram));
-	memcpy(dev->ram + (req->block * FS_BLKSIZ/2), req->buf,
-		req->nblocks * FS_BLKSIZ/2);
+	for(r = req; r != NULL; r = r->merge_next)
+	    memcpy(dev->ram + (r->block * FS_BLKSIZ/2), r->buf,
+		   r->nblocks * FS_BLKSIZ/2);
 	end_request(0);
 	req = NULL;
 	goto top;
@@ -190,7 +194,8 @@ delete_ramdisk(rd_dev_t *rd)
 bool
 ramdisk_init(void)
 {
-	init_list(&rd_reqs);
+	blkq_init(&rd_queue, MAX_MERGE);
+	blkio_init();
 	init_list(&rd_dev_list);
 	fs = (struct fs_module *)kernel->open_module("fs", SYS_VER);
         if (fs != NULL) {
@@ -233,6 +238,16 @@ ramdisk_write_blocks(rd_dev_t *rd, void *buf, u_long block, int count)
 	return sync_request(&req);
 }
 
+/* Start the transfer IO on the ramdisk RD. */
+bool
+ramdisk_submit_io(rd_dev_t *rd, blkio_t *io)
+{
+	if((io->block + io->nblocks) > rd->total_blocks)
+		return FALSE;
+	async_io(rd, io->write ? RD_CMD_WRITE : RD_CMD_READ, io->block, io);
+	return TRUE;
+}
+
 long
 ramdisk_fs_read_blocks(void *f, blkno block, void *buf, int count)
 {
@@ -249,6 +264,22 @@ ramdisk_fs_write_blocks(void *f, blkno block, void *buf, int count)
 }
 
 
+static long
+ramdisk_fs_read_blocks_v(void *f, blkno block, void **bufs, int count)
+{
+	return sync_vector(f, RD_CMD_READ, block * (FS_BLKSIZ / 512), bufs,
+			   count, FS_BLKSIZ / 512, MAX_MERGE) ? 1 : -E_IO;
+}
+
+
+static long
+ramdisk_fs_write_blocks_v(void *f, blkno block, void **bufs, int count)
+{
+	return sync_vector(f, RD_CMD_WRITE, block * (FS_BLKSIZ / 512), bufs,
+			   count, FS_BLKSIZ / 512, MAX_MERGE) ? 1 : -E_IO;
+}
+
+
 bool
 ramdisk_mount_disk(rd_dev_t *rd) 
 {
@@ -259,6 +290,8 @@ ramdisk_mount_disk(rd_dev_t *rd)
 		dev->name = rd->name;
 		dev->read_blocks = ramdisk_fs_read_blocks;
 		dev->write_blocks = ramdisk_fs_write_blocks;
+		dev->read_blocks_v = ramdisk_fs_read_blocks_v;
+		dev->write_blocks_v = ramdisk_fs_write_blocks_v;
 		dev->test_media = NULL;
 		dev->user_data = rd;
 		if(fs->add_device(dev)) {
@@ -301,10 +334,13 @@ ramdisk_mkfs_disk(rd_dev_t *rd, u_long reserved)
         dev->name = rd->name;
         dev->read_blocks = ramdisk_fs_read_blocks;
         dev->write_blocks = ramdisk_fs_write_blocks;
+        dev->read_blocks_v = ramdisk_fs_read_blocks_v;
+        dev->write_blocks_v = ramdisk_fs_write_blocks_v;
         dev->test_media = NULL;
         dev->user_data = rd;
         dev->read_only = FALSE;
-        if(fs->mkfs(dev, rd->total_blocks / (FS_BLKSIZ / 512), reserved))
+        if(fs->mkfs(dev, rd->total_blocks / (FS_BLKSIZ / 512), reserved,
+		    FS_VERSION_1))
             rc = TRUE;
     }
     return rc;
@@ -14,5 +14,6 @@ struct ramdisk_module ramdisk_module =
     ramdisk_mount_disk, ramdisk_mkfs_disk,
     create_ramdisk,
     delete_ramdisk,
-    add_ramdisk_commands
+    add_ramdisk_commands,
+    ramdisk_submit_io
 };
@@ -72,12 +72,24 @@ create_vbios(struct vm *vmach, __attribute__ ((unused)) int argc,
 
 
 
+/* Copy INFO to the disk parameter table of VMACH pointed to by the
+   interrupt vector VECTOR. */
 static void
-init_hdinfo(int vector, struct hd_info *info)
+init_hdinfo(struct vm *vmach, int vector, struct hd_info *info)
 {
-    char *user_ptr = (char *)(get_user_short((u_short *)(vector * 4))
-			      + (get_user_short((u_short *)(vector * 4 + 2)) << 4));
-    memcpy_to_user(user_ptr, info, sizeof(struct hd_info));
+    u_long addr = (get_user_short((u_short *)(vector * 4))
+		   + (get_user_short((u_short *)(vector * 4 + 2)) << 4));
+    if((addr >= 0xa0000) && (addr < 0x100000))
+    {
+	/* The table is in our pseudo-ROM, which is read-only even to
+	   the kernel; write to its page directly. */
+	u_char *src = (u_char *)info;
+	size_t i;
+	for(i = 0; i < sizeof(struct hd_info); i++)
+	    kernel->put_pd_val(vmach->task->page_dir, 1, src[i], addr + i);
+    }
+    else
+	memcpy_to_user((char *)addr, info, sizeof(struct hd_info));
 }
 
 void
@@ -108,9 +120,9 @@ vbios_arpl_handler(struct vm *vmach, struct vm86_regs *regs, u_short num)
 	    put_user_byte(0x02, &BIOS_DATA->video_control_states[0]);
 	if(vmach->hardware.total_hdisks > 0)
 	{
-	    init_hdinfo(0x41, &vmach->hardware.hdisk[0]);
+	    init_hdinfo(vmach, 0x41, &vmach->hardware.hdisk[0]);
 	    if(vmach->hardware.total_hdisks > 1)
-		init_hdinfo(0x46, &vmach->hardware.hdisk[1]);
+		init_hdinfo(vmach, 0x46, &vmach->hardware.hdisk[1]);
 	}
         memcpy_to_user(&BIOS_DATA->lpt1_base, &(vmach->hardware.lprports), 8);
 	break;
@@ -211,6 +223,6 @@ vbios_expunge(void)
 struct vbios_module vbios_module =
 {
     { MODULE_INIT("vbios", SYS_VER, vbios_init, NULL, NULL, vbios_expunge),
-      create_vbios },
+      create_vbios, NULL, NULL, NULL },
     delete_vbios
 };
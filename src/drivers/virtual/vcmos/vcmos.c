@@ -20,6 +20,7 @@
 #include <vmm/mc146818rtc.h>
 #include <vmm/time.h>
 #include <vmm/vpic.h>
+#include <vmm/string.h>
 
 #define kprintf kernel->printf
 
@@ -300,6 +301,62 @@ DB(("Total Hard disks: %d\n", vmach->hardware.total_hdisks));
     return FALSE;
 }
 
+/* Copy the CMOS contents of FROM to its clone TO. */
+static void
+clone_vcmos(struct vm *from, struct vm *to)
+{
+    struct vcmos *src = from->slots[vm_slot];
+    struct vcmos *dst = to->slots[vm_slot];
+    if((src != NULL) && (dst != NULL))
+    {
+	u_long flags;
+	save_flags(flags);
+	cli();
+	memcpy(dst->cmos_mem, src->cmos_mem, sizeof(dst->cmos_mem));
+	dst->cmos_reg = src->cmos_reg;
+	load_flags(flags);
+    }
+}
+
+/* Return a copy of VM's CMOS memory followed by the selected register. */
+static void *
+save_vcmos(struct vm *vm, size_t *lenp)
+{
+    struct vcmos *v = vm->slots[vm_slot];
+    u_char *data;
+    if(v == NULL)
+	return NULL;
+    data = kernel->malloc(sizeof(v->cmos_mem) + 1);
+    if(data != NULL)
+    {
+	u_long flags;
+	save_flags(flags);
+	cli();
+	memcpy(data, v->cmos_mem, sizeof(v->cmos_mem));
+	data[sizeof(v->cmos_mem)] = v->cmos_reg;
+	load_flags(flags);
+	*lenp = sizeof(v->cmos_mem) + 1;
+    }
+    return data;
+}
+
+/* Give VM's CMOS the contents DATA saved by save_vcmos(). */
+static bool
+restore_vcmos(struct vm *vm, const void *data, size_t len)
+{
+    struct vcmos *v = vm->slots[vm_slot];
+    const u_char *saved = data;
+    u_long flags;
+    if((v == NULL) || (len != sizeof(v->cmos_mem) + 1))
+	return FALSE;
+    save_flags(flags);
+    cli();
+    memcpy(v->cmos_mem, saved, sizeof(v->cmos_mem));
+    v->cmos_reg = saved[sizeof(v->cmos_mem)];
+    load_flags(flags);
+    return TRUE;
+}
+
 
 /* Virtualisation Stuff */
 
@@ -538,7 +595,8 @@ void reset_alarm(struct vm *vm, __attribute__ ((unused)) struct vm86_regs *regs)
 /* Module stuff. */
 
 static struct io_handler cmos_io = {
-    NULL, "cmos", CMOS_ADDR_LOW, CMOS_ADDR_HI, vcmos_in, vcmos_out
+    NULL, "cmos", CMOS_ADDR_LOW, CMOS_ADDR_HI, vcmos_in, vcmos_out,
+    NULL, NULL
 };
 
 static bool
@@ -575,7 +633,7 @@ vcmos_expunge(void)
 struct vcmos_module vcmos_module =
 {
     { MODULE_INIT("vcmos", SYS_VER, vcmos_init, NULL, NULL, vcmos_expunge),
-      create_vcmos },
+      create_vcmos, clone_vcmos, save_vcmos, restore_vcmos },
     delete_vcmos,
     get_vcmos_byte,
     set_vcmos_byte,
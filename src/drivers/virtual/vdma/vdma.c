@@ -51,6 +51,41 @@ create_vdma(struct vm *vmach, __attribute__ ((unused)) int argc,
     return FALSE;
 }
 
+/* Return a copy of the two DMA controllers of VMACH. */
+static void *
+save_vdma(struct vm *vmach, size_t *lenp)
+{
+    struct vdma *v = vmach->slots[vm_slot];
+    struct dma_ctrl *data;
+    if(v == NULL)
+	return NULL;
+    data = kernel->malloc(2 * sizeof(struct dma_ctrl));
+    if(data != NULL)
+    {
+	u_long flags;
+	save_flags(flags);
+	cli();
+	data[0] = v->dmac[0];
+	data[1] = v->dmac[1];
+	load_flags(flags);
+	*lenp = 2 * sizeof(struct dma_ctrl);
+    }
+    return data;
+}
+
+/* Give the DMA controllers of VMACH the state DATA from save_vdma(). */
+static bool
+restore_vdma(struct vm *vmach, const void *data, size_t len)
+{
+    struct vdma *v = vmach->slots[vm_slot];
+    const struct dma_ctrl *saved = data;
+    if((v == NULL) || (len != 2 * sizeof(struct dma_ctrl)))
+	return FALSE;
+    v->dmac[0] = saved[0];
+    v->dmac[1] = saved[1];
+    return TRUE;
+}
+
 
 /* Virtualisation Stuff */
 
@@ -404,9 +439,9 @@ set_dma_info(struct vm *vm, u_int channel, struct channel_info *info)
 /* Module stuff. */
 
 static struct io_handler dma_io[3] = {
-    { NULL, "dma", DMA0_LOW, DMA0_HI, vdma_in, vdma_out },
-    { NULL, "dma", DMA1_LOW, DMA1_HI, vdma_in, vdma_out },
-    { NULL, "dma", DMAPAGE_LOW, DMAPAGE_HI, vdma_in, vdma_out }
+    { NULL, "dma", DMA0_LOW, DMA0_HI, vdma_in, vdma_out, NULL, NULL },
+    { NULL, "dma", DMA1_LOW, DMA1_HI, vdma_in, vdma_out, NULL, NULL },
+    { NULL, "dma", DMAPAGE_LOW, DMAPAGE_HI, vdma_in, vdma_out, NULL, NULL }
 };
 
 static bool
@@ -446,7 +481,7 @@ vdma_expunge(void)
 struct vdma_module vdma_module =
 {
     { MODULE_INIT("vdma", SYS_VER, vdma_init, NULL, NULL, vdma_expunge),
-      create_vdma },
+      create_vdma, NULL, save_vdma, restore_vdma },
     delete_vdma,
     get_dma_info,
     set_dma_info
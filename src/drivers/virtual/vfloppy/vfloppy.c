@@ -216,6 +216,6 @@ vfloppy_expunge(void)
 struct vfloppy_module vfloppy_module =
 {
     { MODULE_INIT("vfloppy", SYS_VER, vfloppy_init, NULL, NULL, vfloppy_expunge),
-     create_vfloppy },
+     create_vfloppy, NULL, NULL, NULL },
     delete_vfloppy, vfloppy_read_sectors, vfloppy_get_status
 };
@@ -3,6 +3,17 @@
    Currently this only supports a single disk on the controller, also it's
    totally untested..
 
+   Sector transfers don't stop the virtual machine: the controller shows
+   BSY while a transfer is queued, either to the hd module's asynchronous
+   interface for partitions or to the `vided' task for image files, and
+   raises IRQ 14 when it's done. A multi-sector read fetches up to
+   MAX_XFER sectors at once, and writes are gathered into transfers of
+   the same size.
+
+   A clone's disk is read-only: the image is shared with the vm it was
+   cloned from, whose guest has its own idea of what's on the disk, so
+   the clone is given write errors instead.
+
    John Harper. */
 
 #include <vmm/vide.h>
@@ -16,12 +27,18 @@
 #include <vmm/segment.h>
 #include <vmm/string.h>
 #include <vmm/vcmos.h>
+#include <vmm/tasks.h>
+#include <vmm/blkio.h>
 
 #define kprintf kernel->printf
 
+/* The largest number of sectors transferred by one request. */
+#define MAX_XFER 64
+
 struct vide {
     struct vm *vm;
     bool is_file;
+    bool read_only;
     union {
 	struct file *file;
 	hd_partition_t *disk;
@@ -37,8 +54,19 @@ struct vide {
 
     bool intrq;
 
-    u_long buf_index, block, blocks_left;
-    u_char buf[512];
+    /* BUF holds BUF_BLOCKS sectors, starting at sector BLOCK. BUF_INDEX
+       is the offset of the next byte the guest will access and
+       BLOCKS_LEFT the number of sectors of the command not yet
+       transferred to or from the guest. */
+    u_long buf_index, block, blocks_left, buf_blocks;
+    u_char *buf;
+
+    /* The transfer in progress; PENDING is TRUE until it completes and
+       IO_SEM is signalled when it does. */
+    blkio_t io;
+    bool pending;
+    struct semaphore io_sem;
+    struct vide *work_next;
 
     struct vm_kill_handler kh;
 };
@@ -50,23 +78,39 @@ static struct vpic_module *vpic;
 
 static int vm_slot;
 
+/* Image files are read and written by the task `vided', which takes
+   the virtual disks from the queue WORK_HEAD. */
+static struct task *vide_task;
+static struct semaphore work_sem;
+static struct vide *work_head, **work_tail = &work_head;
+
 #define RDY_STAT	(HD_STAT_DRDY | HD_STAT_DSC)
-#define DATA_RDY_STAT	(RDY_STAT | HD_STAT_DRDY)
+#define DATA_RDY_STAT	(RDY_STAT | HD_STAT_DRQ)
 #define ERR_STAT	HD_STAT_ERR
 #define WERR_STAT	(HD_STAT_ERR | HD_STAT_DWF)
 #define BUSY_STAT	HD_STAT_BSY
 
 
 
+/* Wait for any transfer V has in progress to finish. */
+static inline void
+wait_idle(struct vide *v)
+{
+    if(v->pending)
+	wait(&v->io_sem);
+}
+
 static void
 delete_vide(struct vm *vm)
 {
     struct vide *v = vm->slots[vm_slot];
     if(v != NULL)
     {
+	wait_idle(v);
 	vm->slots[vm_slot] = NULL;
 	if(v->is_file)
 	    fs->close(v->vdisk.file);
+	kernel->free(v->buf);
 	kernel->free(v);
 	vide_module.base.vxd_base.open_count--;
     }
@@ -86,6 +130,12 @@ create_vide(struct vm *vmach, int argc, char **argv)
     new = kernel->calloc(sizeof(struct vide), 1);
     if(new != NULL)
     {
+	new->buf = kernel->malloc(MAX_XFER * 512);
+	if(new->buf == NULL)
+	{
+	    kernel->free(new);
+	    return FALSE;
+	}
 	u_long namelen = strlen(argv[0]);
 	new->vm = vmach;
 	if(argv[0][namelen-1] == ':')
@@ -101,7 +151,8 @@ create_vide(struct vm *vmach, int argc, char **argv)
 	else
 	{
 	    new->is_file = TRUE;
-	    new->vdisk.file = fs->open(argv[0], F_READ | F_WRITE | F_CREATE);
+	    new->vdisk.file = fs->open(argv[0], (F_READ | F_WRITE | F_CREATE
+						 | F_DIRECT));
 	    DB(("vide: Opened file `%s' (%p)\n", argv[0], new->vdisk.file));
 	}
 	if((new->is_file && new->vdisk.file)
@@ -138,6 +189,21 @@ create_vide(struct vm *vmach, int argc, char **argv)
 		new->cylinders = blocks / new->heads;
 	    }
 	    new->blocks = new->cylinders * new->heads * new->sectors;
+
+	    /* Allocate the whole image up front so that it's laid out
+	       contiguously, not a block at a time as the guest writes. */
+	    if(new->is_file
+	       && !fs->preallocate(new->vdisk.file, new->blocks * 512,
+				   PREALLOC_ZERO))
+	    {
+		kprintf("create_vide: Can't allocate %Z blocks for `%s'\n",
+			new->blocks, argv[0]);
+		fs->close(new->vdisk.file);
+		kernel->free(new->buf);
+		kernel->free(new);
+		return FALSE;
+	    }
+
 	    new->select = 0xA0;
 	    new->status = RDY_STAT;
 	    new->irq = 14;
@@ -145,9 +211,6 @@ create_vide(struct vm *vmach, int argc, char **argv)
 	    vm->add_vm_kill_handler(vmach, &new->kh);
 	    vmach->slots[vm_slot] = new;
 
-	    if(new->is_file)
-		fs->set_file_size(new->vdisk.file, new->blocks * 512);
-
 	    vmach->hardware.total_hdisks = 1;
 	    vmach->hardware.hdisk[0].cylinders = new->cylinders;
 	    vmach->hardware.hdisk[0].heads = new->heads;
@@ -185,11 +248,117 @@ create_vide(struct vm *vmach, int argc, char **argv)
 
 	    return TRUE;
 	}
+	kernel->free(new->buf);
 	kernel->free(new);
     }
     return FALSE;
 }
 
+/* The controller state saved by save_vide(). When a command is part way
+   through it's followed by the contents of the sector buffer. */
+struct vide_state {
+    u_char error, features, num_sectors, sector, low_cyl, high_cyl;
+    u_char select, status, command;
+    u_char devctrl;
+    bool intrq;
+    u_long buf_index, block, blocks_left, buf_blocks;
+};
+
+/* The clone TO shares FROM's disk, which FROM may still write to; make
+   TO's copy of it read-only. An image file is opened again without
+   write access so that nothing can slip through. */
+static void
+clone_vide(__attribute__ ((unused)) struct vm *from, struct vm *to)
+{
+    struct vide *v = to->slots[vm_slot];
+    struct vm_vxd *vxd;
+    if(v == NULL)
+	return;
+    v->read_only = TRUE;
+    if(!v->is_file)
+	return;
+    for(vxd = to->vxd_list; vxd != NULL; vxd = vxd->next)
+    {
+	if((vxd->argc > 1) && !strcmp(vxd->argv[0], "vide"))
+	{
+	    struct file *file = fs->open(vxd->argv[1], F_READ | F_DIRECT);
+	    if(file != NULL)
+	    {
+		fs->close(v->vdisk.file);
+		v->vdisk.file = file;
+	    }
+	    break;
+	}
+    }
+}
+
+static void *
+save_vide(struct vm *vmach, size_t *lenp)
+{
+    struct vide *v = vmach->slots[vm_slot];
+    struct vide_state *s;
+    size_t len = sizeof(struct vide_state);
+    /* A transfer in progress would raise its interrupt after the vpic
+       may already have been saved, so the vm must be saved later. */
+    if((v == NULL) || v->pending)
+	return NULL;
+    if(v->blocks_left > 0)
+	len += MAX_XFER * 512;
+    s = kernel->malloc(len);
+    if(s != NULL)
+    {
+	s->error = v->error;
+	s->features = v->features;
+	s->num_sectors = v->num_sectors;
+	s->sector = v->sector;
+	s->low_cyl = v->low_cyl;
+	s->high_cyl = v->high_cyl;
+	s->select = v->select;
+	s->status = v->status;
+	s->command = v->command;
+	s->devctrl = v->devctrl;
+	s->intrq = v->intrq;
+	s->buf_index = v->buf_index;
+	s->block = v->block;
+	s->blocks_left = v->blocks_left;
+	s->buf_blocks = v->buf_blocks;
+	if(v->blocks_left > 0)
+	    memcpy(s + 1, v->buf, MAX_XFER * 512);
+	*lenp = len;
+    }
+    return s;
+}
+
+static bool
+restore_vide(struct vm *vmach, const void *data, size_t len)
+{
+    struct vide *v = vmach->slots[vm_slot];
+    const struct vide_state *s = data;
+    if((v == NULL) || (len < sizeof(struct vide_state))
+       || (len != (sizeof(struct vide_state)
+		   + ((s->blocks_left > 0) ? MAX_XFER * 512 : 0)))
+       || (s->buf_index > MAX_XFER * 512) || (s->buf_blocks > MAX_XFER))
+	return FALSE;
+    v->error = s->error;
+    v->features = s->features;
+    v->num_sectors = s->num_sectors;
+    v->sector = s->sector;
+    v->low_cyl = s->low_cyl;
+    v->high_cyl = s->high_cyl;
+    v->select = s->select;
+    v->status = s->status;
+    v->command = s->command;
+    v->devctrl = s->devctrl;
+    v->intrq = s->intrq;
+    v->buf_index = s->buf_index;
+    v->block = s->block;
+    v->blocks_left = s->blocks_left;
+    v->buf_blocks = s->buf_blocks;
+    if(v->blocks_left > 0)
+	memcpy(v->buf, s + 1, MAX_XFER * 512);
+    return TRUE;
+}
+
 
 /* I/O port virtualisation. */
 
@@ -225,71 +394,229 @@ make_irq(struct vide *v)
 	vpic->simulate_irq(v->vm, v->irq);
 }
 
+/* Called with interrupts masked when the transfer IO has finished,
+   either from the disk's interrupt or from the vided task. */
 static void
-read_next_block(struct vide *v)
+xfer_done(blkio_t *io)
 {
-    if(v->block >= v->blocks)
-    {
-	kprintf("vide: Reading a non-existent block, vm=%p block=%d\n",
-		v->vm, v->block);
-	v->error = HD_ERR_UNK;
-	v->status = ERR_STAT;
-    }
-    else
+    struct vide *v = io->data;
+    v->pending = FALSE;
+    if(!io->write)
     {
-	/* It would be nice to have async I/O here.. */
-	if(!read_one_block(v, v->block, v->buf))
+	if(io->result != 0)
 	{
 	    v->error = HD_ERR_UNK;
 	    v->status = ERR_STAT;
 	}
 	else
 	{
+	    v->buf_blocks = io->nblocks;
+	    v->buf_index = 0;
 	    v->status = DATA_RDY_STAT;
-	    v->block++;
-	    v->blocks_left--;
+	}
+    }
+    else
+    {
+	if(io->result != 0)
+	{
+	    v->error = HD_ERR_BBK;
+	    v->status = WERR_STAT;
+	}
+	else
+	{
+	    v->block += io->nblocks;
+	    v->blocks_left -= io->nblocks;
 	    v->buf_index = 0;
-	    make_irq(v);
+	    v->status = (v->blocks_left > 0) ? DATA_RDY_STAT : RDY_STAT;
 	}
     }
+    make_irq(v);
 }
 
+/* Start transferring COUNT sectors between V's buffer and the disk,
+   from V's current block. The controller is busy until xfer_done() is
+   called. */
 static void
-write_block(struct vide *v)
+start_xfer(struct vide *v, bool write, u_long count)
 {
+    u_long flags;
+    v->io.write = write;
+    v->io.buf = v->buf;
+    v->io.block = v->block;
+    v->io.nblocks = count;
+    v->io.callback = xfer_done;
+    v->io.sem = &v->io_sem;
+    v->io.data = v;
+    set_sem_blocked(&v->io_sem);
+    v->pending = TRUE;
+    v->status = BUSY_STAT;
+    if(!v->is_file)
+    {
+	if(!hd->submit_io(v->vdisk.disk, &v->io))
+	{
+	    save_flags(flags);
+	    cli();
+	    blkio_complete(&v->io, -1);
+	    load_flags(flags);
+	}
+	return;
+    }
+    save_flags(flags);
+    cli();
+    v->work_next = NULL;
+    *work_tail = v;
+    work_tail = &v->work_next;
+    load_flags(flags);
+    signal(&work_sem);
+}
+
+/* The vided task. Performs the transfers queued for image files. */
+static void
+vide_worker(void)
+{
+    while(1)
+    {
+	struct vide *v;
+	u_long flags;
+	wait(&work_sem);
+	while(1)
+	{
+	    blkio_t *io;
+	    long len;
+	    bool ok;
+	    save_flags(flags);
+	    cli();
+	    v = work_head;
+	    if(v != NULL)
+	    {
+		work_head = v->work_next;
+		if(work_head == NULL)
+		    work_tail = &work_head;
+	    }
+	    load_flags(flags);
+	    if(v == NULL)
+		break;
+	    io = &v->io;
+	    len = io->nblocks * 512;
+	    ok = fs->seek(v->vdisk.file, io->block * 512, SEEK_ABS) >= 0;
+	    if(ok && io->write)
+		ok = fs->write(io->buf, len, v->vdisk.file) == len;
+	    else if(ok)
+		ok = fs->read(io->buf, len, v->vdisk.file) == len;
+	    save_flags(flags);
+	    cli();
+	    blkio_complete(io, ok ? 0 : -1);
+	    load_flags(flags);
+	}
+    }
+}
+
+/* Fetch as many of the sectors left in the current read command as will
+   fit in the buffer. */
+static void
+read_next_blocks(struct vide *v)
+{
+    u_long count = min(v->blocks_left, MAX_XFER);
     if(v->block >= v->blocks)
     {
-	kprintf("vide: Writing a non-existent block, vm=%p block=%d\n",
+	kprintf("vide: Reading a non-existent block, vm=%p block=%d\n",
 		v->vm, v->block);
 	v->error = HD_ERR_UNK;
+	v->status = ERR_STAT;
+	make_irq(v);
+    }
+    else
+	start_xfer(v, FALSE, min(count, v->blocks - v->block));
+}
+
+/* Called each time the guest has filled a sector of the buffer. Once
+   the buffer is full, or holds the rest of the command, it's written. */
+static void
+write_blocks(struct vide *v)
+{
+    u_long count = v->buf_index / 512;
+    if(v->block + count > v->blocks)
+    {
+	kprintf("vide: Writing a non-existent block, vm=%p block=%d\n",
+		v->vm, v->block + count - 1);
+	v->error = HD_ERR_UNK;
 	v->status = WERR_STAT;
+	make_irq(v);
     }
+    else if(count == MAX_XFER || count == v->blocks_left)
+	start_xfer(v, TRUE, count);
     else
     {
-	/* It would be nice to have async I/O here.. */
-	if(!write_one_block(v, v->block, v->buf))
-	{
-	    v->error = HD_ERR_BBK;
-	    v->status = WERR_STAT;
-	}
-	else
-	{
-	    v->block++;
-	    if(--v->blocks_left > 0)
-	    {
-		v->status = DATA_RDY_STAT;
-		make_irq(v);
-	    }
-	    v->buf_index = 0;
-	}
+	v->status = DATA_RDY_STAT;
+	make_irq(v);
+    }
+}
+
+/* Called each time the guest has read a whole sector. */
+static void
+read_sector_done(struct vide *v)
+{
+    v->blocks_left--;
+    if(v->blocks_left == 0)
+	v->status = RDY_STAT;
+    else if(v->buf_index < v->buf_blocks * 512)
+	make_irq(v);
+    else
+    {
+	v->block += v->buf_blocks;
+	read_next_blocks(v);
     }
 }
 
+/* Handle `REP INS' from the data port, copying as much of the current
+   sector as is wanted straight to the guest's buffer BUF. */
+static u_long
+vide_in_string(struct vm *vm, u_short port, int size, u_long count,
+	       void *buf)
+{
+    struct vide *v = vm->slots[vm_slot];
+    u_long len;
+    if(v == NULL || port != HD_DATA
+       || (v->status & (HD_STAT_BSY | HD_STAT_DRQ)) != HD_STAT_DRQ
+       || v->command != HD_CMD_READ)
+	return 0;
+    len = 512 - (v->buf_index % 512);
+    if(count < len / size)
+	len = count * size;
+    memcpy_to_user(buf, v->buf + v->buf_index, len);
+    v->buf_index += len;
+    if((v->buf_index % 512) == 0)
+	read_sector_done(v);
+    return len / size;
+}
+
+/* Handle `REP OUTS' to the data port, filling the rest of the current
+   sector from the guest's buffer BUF. */
+static u_long
+vide_out_string(struct vm *vm, u_short port, int size, u_long count,
+		void *buf)
+{
+    struct vide *v = vm->slots[vm_slot];
+    u_long len;
+    if(v == NULL || port != HD_DATA
+       || (v->status & (HD_STAT_BSY | HD_STAT_DRQ)) != HD_STAT_DRQ
+       || v->command != HD_CMD_WRITE)
+	return 0;
+    len = 512 - (v->buf_index % 512);
+    if(count < len / size)
+	len = count * size;
+    memcpy_from_user(v->buf + v->buf_index, buf, len);
+    v->buf_index += len;
+    if((v->buf_index % 512) == 0)
+	write_blocks(v);
+    return len / size;
+}
+
 static u_long
 vide_in(struct vm *vm, u_short port, int size)
 {
     struct vide *v = vm->slots[vm_slot];
-    kprintf("vide_in: v=%p port=%x size=%d\n", v, port, size);
+    DB(("vide_in: v=%p port=%x size=%d\n", v, port, size));
     if(v == NULL)
 	return (u_long)-1;
     switch(port)
@@ -297,6 +624,9 @@ vide_in(struct vm *vm, u_short port, int size)
     case HD_DATA:
 	{
 	    u_long val;
+	    if((v->status & (HD_STAT_BSY | HD_STAT_DRQ)) != HD_STAT_DRQ
+	       || v->command != HD_CMD_READ)
+		return (u_long)-1;
 	    switch(size)
 	    {
 	    case 1:
@@ -311,12 +641,8 @@ vide_in(struct vm *vm, u_short port, int size)
 		val = *((u_long *)(v->buf + v->buf_index));
 		v->buf_index += 4;
 	    }
-	    if(v->buf_index >= 256)
-	    {
-		v->status = RDY_STAT;
-		if(v->blocks_left > 0)
-		    read_next_block(v);
-	    }
+	    if((v->buf_index % 512) == 0)
+		read_sector_done(v);
 	    return val;
 	}
 
@@ -360,12 +686,16 @@ static void
 vide_out(struct vm *vm, u_short port, int size, u_long val)
 {
     struct vide *v = vm->slots[vm_slot];
-    kprintf("vide_out: v=%p port=%x size=%d val=%x\n", v, port, size, val);
+    DB(("vide_out: v=%p port=%x size=%d val=%x\n", v, port, size, val));
     if(v == NULL)
 	return;
+    if((v->status & HD_STAT_BSY) && port != HD_DEVCTRL)
+	return;
     switch(port)
     {
     case HD_DATA:
+	if((v->status & HD_STAT_DRQ) == 0 || v->command != HD_CMD_WRITE)
+	    break;
 	switch(size)
 	{
 	case 1:
@@ -379,11 +709,8 @@ vide_out(struct vm *vm, u_short port, int size, u_long val)
 	    *((u_long *)(v->buf + v->buf_index)) = val;
 	    v->buf_index += 4;
 	}
-	if(v->buf_index >= 256)
-	{
-	    v->status = RDY_STAT;
-	    write_block(v);
-	}
+	if((v->buf_index % 512) == 0)
+	    write_blocks(v);
 	break;
 
     case HD_FEATURE:
@@ -424,13 +751,21 @@ vide_out(struct vm *vm, u_short port, int size, u_long val)
 
 	case HD_CMD_READ:
 	    make_blkno(v);
-	    v->blocks_left = v->num_sectors;
-	    read_next_block(v);
+	    v->blocks_left = v->num_sectors ? v->num_sectors : 256;
+	    read_next_blocks(v);
 	    break;
 
 	case HD_CMD_WRITE:
+	    if(v->read_only)
+	    {
+		v->status = ERR_STAT;
+		v->error = HD_ERR_ABRT;
+		make_irq(v);
+		break;
+	    }
 	    make_blkno(v);
-	    v->blocks_left = v->num_sectors;
+	    v->blocks_left = v->num_sectors ? v->num_sectors : 256;
+	    v->buf_index = 0;
 	    v->status = DATA_RDY_STAT;
 	    make_irq(v);
 	    break;
@@ -446,6 +781,7 @@ vide_out(struct vm *vm, u_short port, int size, u_long val)
 	v->devctrl = val;
 	if(val & HD_SRST)
 	{
+	    wait_idle(v);
 	    /* Reset controlller. */
 	    v->error = v->num_sectors = v->sector = 0x01;
 	    v->low_cyl = v->high_cyl = v->select = 0x00;
@@ -478,6 +814,7 @@ read_user_blocks(struct vm *vm, u_int drvno, u_int head, u_int cyl,
 	vm, drvno, head, cyl, sector, count, buf));
     if(v == NULL)
 	return -1;
+    wait_idle(v);
     blkno = (sector - 1) + (head * v->sectors) + (cyl * v->heads * v->sectors);
     if((drvno != 0)
        || (head >= v->heads)
@@ -512,6 +849,7 @@ write_user_blocks(struct vm *vm, u_int drvno, u_int head, u_int cyl,
 	vm, drvno, head, cyl, sector, count, buf));
     if(v == NULL)
 	return -1;
+    wait_idle(v);
     blkno = (sector - 1) + (head * v->sectors) + (cyl * v->heads * v->sectors);
     if((drvno != 0)
        || (head >= v->heads)
@@ -524,6 +862,12 @@ write_user_blocks(struct vm *vm, u_int drvno, u_int head, u_int cyl,
 	DB(("vide:write_sector: bad argument.\n"));
 	return -1;
     }
+    if(v->read_only)
+    {
+	ERRNO = E_PERM;
+	set_stat(v, FALSE, TRUE, HD_ERR_ABRT);
+	return -1;
+    }
     do {
 	memcpy_from_user(tmp_buf, buf, 512);
 	buf += 512;
@@ -562,11 +906,13 @@ get_geom(struct vm *vm, u_int *headsp, u_int *cylsp, u_int *sectsp)
 /* Module stuff. */
 
 static struct io_handler low_ioh = {
-    NULL, "ide", HD_DATA, HD_STATUS, vide_in, vide_out
+    NULL, "ide", HD_DATA, HD_STATUS, vide_in, vide_out,
+    vide_in_string, vide_out_string
 };
 
 static struct io_handler high_ioh = {
-    NULL, "ide", HD_DEVCTRL, HD_DEVCTRL, vide_in, vide_out
+    NULL, "ide", HD_DEVCTRL, HD_DEVCTRL, vide_in, vide_out,
+    NULL, NULL
 };
 
 static bool
@@ -587,9 +933,16 @@ vide_init(void)
 		    vm_slot = vm->alloc_vm_slot();
 		    if(vm_slot >= 0)
 		    {
-			vm->add_io_handler(NULL, &low_ioh);
-			vm->add_io_handler(NULL, &high_ioh);
-			return TRUE;
+			set_sem_blocked(&work_sem);
+			vide_task = kernel->add_task(vide_worker, TASK_RUNNING,
+						     0, "vided");
+			if(vide_task != NULL)
+			{
+			    vm->add_io_handler(NULL, &low_ioh);
+			    vm->add_io_handler(NULL, &high_ioh);
+			    return TRUE;
+			}
+			vm->free_vm_slot(vm_slot);
 		    }
 		    kernel->close_module((struct module *)vpic);
 		}
@@ -609,6 +962,7 @@ vide_expunge(void)
     {
 	vm->remove_io_handler(NULL, &high_ioh);
 	vm->remove_io_handler(NULL, &low_ioh);
+	kernel->kill_task(vide_task);
 	vm->free_vm_slot(vm_slot);
 	kernel->close_module((struct module *)vpic);
 	kernel->close_module((struct module *)vm);
@@ -622,6 +976,6 @@ vide_expunge(void)
 struct vide_module vide_module =
 {
     { MODULE_INIT("vide", SYS_VER, vide_init, NULL, NULL, vide_expunge),
-      create_vide },
+      create_vide, clone_vide, save_vide, restore_vide },
     delete_vide, read_user_blocks, write_user_blocks, get_status, get_geom
 };
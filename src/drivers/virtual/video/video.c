@@ -33,11 +33,13 @@ struct video_module video_module =
 };
 
 struct io_handler video_mda_io = {
-    NULL, "video-mda", 0x3b0, 0x3bb, video_in, video_out
+    NULL, "video-mda", 0x3b0, 0x3bb, video_in, video_out,
+    NULL, NULL
 };
 
 struct io_handler video_io = {
-    NULL, "video", 0x3c0, 0x3df, video_in, video_out
+    NULL, "video", 0x3c0, 0x3df, video_in, video_out,
+    NULL, NULL
 };
 
 static struct vm_module *vm;
@@ -742,10 +742,12 @@ vkbd_arpl_handler(struct vm *vm, __attribute__ ((unused)) struct vm86_regs *regs
 
 
 struct io_handler kbd_data_ioh = {
-    NULL, "kbd", 0x60, 0x61, vkbd_read_port, vkbd_write_port
+    NULL, "kbd", 0x60, 0x61, vkbd_read_port, vkbd_write_port,
+    NULL, NULL
 };
 struct io_handler kbd_ctrl_ioh = {
-    NULL, "kbd", 0x64, 0x64, vkbd_read_port, vkbd_write_port
+    NULL, "kbd", 0x64, 0x64, vkbd_read_port, vkbd_write_port,
+    NULL, NULL
 };
 
 struct arpl_handler kbd_arpl = {
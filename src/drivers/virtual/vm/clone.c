@@ -0,0 +1,235 @@
+/* clone.c -- Creating virtual machines as copies of existing ones.
+   John Harper. */
+
+#include <vmm/vm.h>
+#include <vmm/tasks.h>
+#include <vmm/kernel.h>
+#include <vmm/page.h>
+#include <vmm/string.h>
+
+#define kprintf kernel->printf
+
+/* Record that the device created by the vmvxd command with arguments
+   ARGC and ARGV (ARGV[0] being the name of the module) was installed in
+   VM. */
+bool
+add_vm_vxd(struct vm *vm, int argc, char **argv)
+{
+    struct vm_vxd *vxd, **ptr;
+    size_t len = sizeof(struct vm_vxd) + argc * sizeof(char *);
+    char *str;
+    int i;
+    for(i = 0; i < argc; i++)
+	len += strlen(argv[i]) + 1;
+    vxd = kernel->malloc(len);
+    if(vxd == NULL)
+	return FALSE;
+    vxd->next = NULL;
+    vxd->argc = argc;
+    vxd->argv = (char **)(vxd + 1);
+    str = (char *)(vxd->argv + argc);
+    for(i = 0; i < argc; i++)
+    {
+	vxd->argv[i] = str;
+	strcpy(str, argv[i]);
+	str += strlen(str) + 1;
+    }
+    ptr = &vm->vxd_list;
+    while(*ptr != NULL)
+	ptr = &(*ptr)->next;
+    *ptr = vxd;
+    return TRUE;
+}
+
+void
+free_vm_vxds(struct vm *vm)
+{
+    struct vm_vxd *vxd = vm->vxd_list;
+    while(vxd != NULL)
+    {
+	struct vm_vxd *nxt = vxd->next;
+	kernel->free(vxd);
+	vxd = nxt;
+    }
+    vm->vxd_list = NULL;
+}
+
+/* Give the clone VM the same devices as TEMPLATE, copying their state. */
+static bool
+clone_vxds(struct vm *template, struct vm *vm)
+{
+    struct vm_vxd *vxd;
+    for(vxd = template->vxd_list; vxd != NULL; vxd = vxd->next)
+    {
+	struct vxd_module *mod =
+	    (struct vxd_module *)kernel->open_module(vxd->argv[0], SYS_VER);
+	bool ok = FALSE;
+	if(mod != NULL)
+	{
+	    if(mod->create_vxd(vm, vxd->argc - 1, vxd->argv + 1)
+	       && add_vm_vxd(vm, vxd->argc, vxd->argv))
+	    {
+		if(mod->clone_vxd != NULL)
+		    mod->clone_vxd(template, vm);
+		ok = TRUE;
+	    }
+	    kernel->close_module((struct module *)mod);
+	}
+	if(!ok)
+	{
+	    kprintf("vm: Can't install `%s' in clone\n", vxd->argv[0]);
+	    return FALSE;
+	}
+    }
+    return TRUE;
+}
+
+/* Return a pte mapping a private copy of the page mapped by PTE, or zero
+   if PTE doesn't map a page of normal memory. Used when pages can't be
+   shared. ERROR is set to TRUE if no page could be allocated. */
+static u_long
+copy_pte(u_long pte, bool *error)
+{
+    page *new;
+    if((pte & PTE_PRESENT) == 0 || (pte & (PTE_FREEABLE | PTE_COW)) == 0)
+	return 0;
+    new = kernel->alloc_page();
+    if(new == NULL)
+    {
+	*error = TRUE;
+	return 0;
+    }
+    memcpy(new, TO_LOGICAL(PTE_GET_ADDR(pte), page *), PAGE_SIZE);
+    return (TO_PHYSICAL(new) | (pte & ~(PTE_ADDR | PTE_COW))
+	    | PTE_READ_WRITE | PTE_FREEABLE);
+}
+
+/* Make the memory of the clone VM the same as TEMPLATE's. Normal memory
+   is shared copy-on-write when possible; pages in the adapter area (i.e.
+   video memory) belong to the devices of each vm so only their contents
+   are copied. Should be called inside a forbid(). */
+static bool
+clone_memory(struct vm *template, struct vm *vm)
+{
+    page_dir *tpd = template->task->page_dir, *pd = vm->task->page_dir;
+    u_long addr, end = (1024 + template->hardware.extended_mem) * 1024;
+    bool error = FALSE;
+
+    /* Work with the clone's real HMA pages mapped. */
+    set_gate_a20(vm, TRUE);
+    for(addr = 0; addr < end && !error; addr += PAGE_SIZE)
+    {
+	u_long tpte, pte, old;
+	u_long *ptep = &tpte;
+	if((addr >= 0xa0000) && (addr < 0x100000))
+	{
+	    tpte = kernel->get_pte(tpd, addr);
+	    pte = kernel->get_pte(pd, addr);
+	    if((tpte & (PTE_PRESENT | PTE_READ_WRITE))
+	       == (PTE_PRESENT | PTE_READ_WRITE)
+	       && (pte & (PTE_PRESENT | PTE_READ_WRITE))
+	       == (PTE_PRESENT | PTE_READ_WRITE)
+	       && PTE_GET_ADDR(pte) != PTE_GET_ADDR(tpte))
+	    {
+		memcpy(TO_LOGICAL(PTE_GET_ADDR(pte), page *),
+		       TO_LOGICAL(PTE_GET_ADDR(tpte), page *), PAGE_SIZE);
+	    }
+	    continue;
+	}
+	if(!template->a20_state && (addr >= 0x100000) && (addr < 0x110000))
+	    ptep = &template->himem_ptes[(addr - 0x100000) / PAGE_SIZE];
+	else
+	    tpte = kernel->get_pte(tpd, addr);
+	if(cow_enabled)
+	{
+	    pte = share_pte(ptep);
+	    if(ptep == &tpte)
+		kernel->set_pte(tpd, addr, tpte);
+	}
+	else
+	    pte = copy_pte(*ptep, &error);
+	if(pte == 0)
+	    continue;
+	old = kernel->get_pte(pd, addr);
+	if((old & (PTE_PRESENT | PTE_FREEABLE)) == (PTE_PRESENT | PTE_FREEABLE))
+	    kernel->free_page(TO_LOGICAL(PTE_GET_ADDR(old), page *));
+	kernel->set_pte(pd, addr, pte);
+    }
+    if(!template->a20_state)
+    {
+	/* Refresh the template's aliases of its (now read-only) first
+	   64K. */
+	for(addr = 0; addr < 0x10000; addr += PAGE_SIZE)
+	{
+	    kernel->set_pte(tpd, addr + 0x100000,
+			    kernel->get_pte(tpd, addr) & ~PTE_FREEABLE);
+	}
+    }
+    set_gate_a20(vm, template->a20_state);
+    flush_tlb();
+    return !error;
+}
+
+/* Make the suspended task of VM start with the registers REGS when it's
+   next woken. */
+void
+load_vm_regs(struct vm *vm, struct vm86_regs *regs)
+{
+    struct tss *tss = &vm->task->tss;
+    tss->eax = regs->eax;
+    tss->ebx = regs->ebx;
+    tss->ecx = regs->ecx;
+    tss->edx = regs->edx;
+    tss->esi = regs->esi;
+    tss->edi = regs->edi;
+    tss->ebp = regs->ebp;
+    tss->eip = regs->eip;
+    tss->eflags = regs->eflags;
+    tss->esp = regs->esp;
+    tss->cs = regs->cs;
+    tss->ss = regs->ss;
+    tss->ds = regs->ds;
+    tss->es = regs->es;
+    tss->fs = regs->fs;
+    tss->gs = regs->gs;
+}
+
+/* Create a new vm called NAME which is a copy of the vm TEMPLATE: it
+   has the same devices (created with the same arguments, then given
+   the same state where the device supports it), memory and registers.
+   TEMPLATE must be halted, i.e. waiting for an interrupt. Memory is
+   shared between the two until one of them writes to it. As with
+   create_vm() the new vm's task is left suspended. */
+struct vm *
+clone_vm(struct vm *template, const char *name)
+{
+    struct vm *vm;
+    if(!template->hlted || !init_cow())
+	return NULL;
+    vm = create_vm(name, template->hardware.total_mem,
+		   (template->hardware.monitor_type == 3) ? "mda" : "cga");
+    if(vm == NULL)
+	return NULL;
+    vm->hardware = template->hardware;
+    /* Bring back any of the template's pages which are in the swap file
+       (they can't be shared from there). */
+    if(!clone_vxds(template, vm) || !lock_vm_memory(template))
+    {
+	kill_vm(vm);
+	return NULL;
+    }
+    forbid();
+    if(!template->hlted || !clone_memory(template, vm))
+    {
+	permit();
+	unlock_vm_memory();
+	kill_vm(vm);
+	return NULL;
+    }
+    load_vm_regs(vm, VM_FRAME(template));
+    vm->virtual_eflags = template->virtual_eflags;
+    vm->nmi_sts = template->nmi_sts;
+    permit();
+    unlock_vm_memory();
+    return vm;
+}
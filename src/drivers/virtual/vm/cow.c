@@ -0,0 +1,433 @@
+/* cow.c -- Sharing pages between virtual machines.
+
+   A page shared by several vm's (for example by a vm and its clones)
+   is mapped read-only in each of them with PTE_COW set and PTE_FREEABLE
+   clear; COW_COUNT records how many pte's map it. The first write by a
+   vm to such a page faults and break_cow() gives the vm its own copy,
+   or if no other pte's map the page simply makes it writable again.
+
+   Pages come to be shared in two ways: clone_vm() shares all the memory
+   of the template with its clone, and the `vmdedup' task periodically
+   looks for pages of different vm's (or of the same vm) which have the
+   same contents and merges them.
+
+   ZERO_PAGE is a special shared page: it's mapped wherever a vm reads
+   memory it hasn't yet written to, and since it's never freed it isn't
+   counted in COW_COUNT. Writing to it gives the vm a new page of zeros.
+
+   On processors which can't make the kernel honour read-only pages (the
+   80386 has no CR0.WP bit) writes by the virtual devices wouldn't be
+   noticed, so pages are never shared; COW_ENABLED is FALSE.
+
+   John Harper. */
+
+#include <vmm/vm.h>
+#include <vmm/tasks.h>
+#include <vmm/kernel.h>
+#include <vmm/page.h>
+#include <vmm/string.h>
+
+#define kprintf kernel->printf
+
+/* The number of pte's mapping each shared page, indexed by physical page
+   number. Zero for pages which aren't shared. */
+static u_short *cow_count;
+static u_long cow_pages;
+
+/* TRUE if pages may be shared. */
+bool cow_enabled;
+
+/* A page of zeros, shared by all vm's. */
+static page *zero_page;
+
+#define IS_ZERO_PTE(pte) \
+    ((zero_page != NULL) && (PTE_GET_ADDR(pte) == TO_PHYSICAL(zero_page)))
+
+/* Ticks (1024Hz) between each scan for identical pages. */
+#define DEDUP_INTERVAL	(5 * 1024)
+
+#define DEDUP_HASH_SIZE	256
+
+/* A page seen by the current scan, either one shared copy-on-write or a
+   vm's own page which hasn't been written to since the last scan. */
+struct dedup_page {
+    struct dedup_page *next;
+    struct vm *vm;
+    u_long addr;		/* Linear address in VM. */
+    u_long frame;		/* Physical address when it was hashed. */
+    u_long hash;
+};
+
+static struct dedup_page *dedup_table[DEDUP_HASH_SIZE];
+
+/* There's at most one entry for each physical page. */
+static struct dedup_page *dedup_pages;
+static u_long dedup_used;
+
+static void dedup_task(void);
+
+/* Prepare for sharing pages, this is called as each vm is created. The
+   first time it starts the vmdedup task. Returns FALSE if there isn't
+   enough memory. */
+bool
+init_cow(void)
+{
+    if(cow_count == NULL)
+    {
+	u_long pages = kernel->cookie->total_mem / (PAGE_SIZE / 1024);
+	cow_count = kernel->calloc(pages, sizeof(u_short));
+	if(cow_count == NULL)
+	    return FALSE;
+	cow_pages = pages;
+	if(kernel->cookie->proc.cpu_type >= 4)
+	{
+	    /* Make the kernel's own writes to vm pages fault when the
+	       page is read-only. */
+	    u_long cr0;
+	    asm volatile ("movl %%cr0,%0" : "=r" (cr0));
+	    asm volatile ("movl %0,%%cr0" : : "r" (cr0 | CR0_WP));
+	    cow_enabled = TRUE;
+
+	    zero_page = kernel->alloc_page();
+	    if(zero_page != NULL)
+		memset(zero_page, 0, PAGE_SIZE);
+
+	    dedup_pages = kernel->malloc(pages * sizeof(struct dedup_page));
+	    if(dedup_pages != NULL
+	       && kernel->add_task(dedup_task, TASK_RUNNING,
+				   -1, "vmdedup") == NULL)
+	    {
+		kernel->free(dedup_pages);
+		dedup_pages = NULL;
+	    }
+	}
+    }
+    return TRUE;
+}
+
+/* *PTEP maps a page of a vm; mark it as shared copy-on-write and count
+   one more reference to it. Returns the pte to use in the vm sharing the
+   page, or zero if the page can't be shared (it isn't present or isn't
+   normal memory). */
+u_long
+share_pte(u_long *ptep)
+{
+    u_long pte = *ptep, page_nr, flags;
+    if(!cow_enabled
+       || (pte & PTE_PRESENT) == 0
+       || (pte & (PTE_FREEABLE | PTE_COW)) == 0)
+	return 0;
+    if(IS_ZERO_PTE(pte))
+	return pte;
+    page_nr = PTE_GET_ADDR(pte) / PAGE_SIZE;
+    if(page_nr >= cow_pages)
+	return 0;
+    save_flags(flags);
+    cli();
+    if((pte & PTE_COW) == 0)
+    {
+	pte = (pte & ~(PTE_READ_WRITE | PTE_FREEABLE)) | PTE_COW;
+	*ptep = pte;
+	cow_count[page_nr] = 1;
+    }
+    cow_count[page_nr]++;
+    load_flags(flags);
+    return pte;
+}
+
+/* If the page at linear address ADDR in VM is shared copy-on-write give
+   VM its own writable copy of it and return TRUE. VM must be the current
+   task. May be called with interrupts masked. */
+bool
+break_cow(struct vm *vm, u_long addr)
+{
+    page_dir *pd = vm->task->page_dir;
+    u_long pte, flags;
+    bool rc = FALSE;
+    if(cow_count == NULL)
+	return FALSE;
+    addr &= PAGE_MASK;
+    if(!vm->a20_state && (addr >= 0x100000) && (addr < 0x110000))
+    {
+	/* With A20 disabled the first 64K is aliased at 1M, the lower
+	   pte is the one that owns the page. */
+	addr -= 0x100000;
+    }
+    save_flags(flags);
+    cli();
+    pte = kernel->get_pte(pd, addr);
+    if((pte & (PTE_PRESENT | PTE_COW)) == (PTE_PRESENT | PTE_COW))
+    {
+	u_long page_nr = PTE_GET_ADDR(pte) / PAGE_SIZE;
+	if(IS_ZERO_PTE(pte))
+	{
+	    page *new = kernel->alloc_page();
+	    if(new == NULL)
+		goto out;
+	    memset(new, 0, PAGE_SIZE);
+	    pte = TO_PHYSICAL(new) | (pte & ~PTE_ADDR);
+	}
+	else if(cow_count[page_nr] > 1)
+	{
+	    page *new = kernel->alloc_page();
+	    if(new == NULL)
+		goto out;
+	    memcpy(new, TO_LOGICAL(PTE_GET_ADDR(pte), page *), PAGE_SIZE);
+	    cow_count[page_nr]--;
+	    pte = TO_PHYSICAL(new) | (pte & ~PTE_ADDR);
+	}
+	else
+	    cow_count[page_nr] = 0;
+	pte = (pte & ~PTE_COW) | PTE_READ_WRITE | PTE_FREEABLE;
+	kernel->set_pte(pd, addr, pte);
+	if(!vm->a20_state && (addr < 0x10000))
+	    kernel->set_pte(pd, addr + 0x100000, pte & ~PTE_FREEABLE);
+	flush_tlb();
+	rc = TRUE;
+    }
+out:
+    load_flags(flags);
+    return rc;
+}
+
+/* Drop a reference to the shared page mapped by PTE, freeing it if no
+   other pte's map it. */
+static void
+unshare_pte(u_long pte)
+{
+    u_long page_nr = PTE_GET_ADDR(pte) / PAGE_SIZE, flags;
+    if(IS_ZERO_PTE(pte))
+	return;
+    save_flags(flags);
+    cli();
+    if(--cow_count[page_nr] == 0)
+	kernel->free_page(TO_LOGICAL(PTE_GET_ADDR(pte), page *));
+    load_flags(flags);
+}
+
+/* Release all shared pages mapped by VM; called as VM is killed (since
+   these pages aren't freeable they wouldn't otherwise be freed). */
+void
+release_cow_pages(struct vm *vm)
+{
+    page_dir *pd = vm->task->page_dir;
+    u_long addr, end = (1024 + vm->hardware.extended_mem) * 1024;
+    if(cow_count == NULL)
+	return;
+    for(addr = 0; addr < end; addr += PAGE_SIZE)
+    {
+	u_long pte;
+	if(!vm->a20_state && (addr >= 0x100000) && (addr < 0x110000))
+	    pte = vm->himem_ptes[(addr - 0x100000) / PAGE_SIZE];
+	else
+	    pte = kernel->get_pte(pd, addr);
+	if((pte & (PTE_PRESENT | PTE_COW)) == (PTE_PRESENT | PTE_COW))
+	    unshare_pte(pte);
+    }
+}
+
+/* Set the pte of the page at ADDR in VM to PTE, also setting the copy at
+   1M if A20 is disabled. */
+void
+set_vm_pte(struct vm *vm, u_long addr, u_long pte)
+{
+    kernel->set_pte(vm->task->page_dir, addr, pte);
+    if(!vm->a20_state && (addr < 0x10000))
+	kernel->set_pte(vm->task->page_dir, addr + 0x100000,
+			pte & ~PTE_FREEABLE);
+}
+
+/* If possible map the zero page at ADDR in VM, whose not-present pte is
+   PTE, and return TRUE. Called when VM reads from memory it has never
+   written to. */
+bool
+map_zero_page(struct vm *vm, u_long addr, u_long pte)
+{
+    if(zero_page == NULL
+       || (pte & (PTE_PRESENT | PTE_FREEABLE)) != PTE_FREEABLE)
+	return FALSE;
+    set_vm_pte(vm, addr & PAGE_MASK,
+	       TO_PHYSICAL(zero_page) | (pte & PTE_USER)
+	       | PTE_COW | PTE_PRESENT);
+    return TRUE;
+}
+
+/* Give back the page at ADDR in VM, mapped by PTE, if it only contains
+   zeros and map the zero page in its place. Returns TRUE if it did. */
+static bool
+merge_zero_page(struct vm *vm, u_long addr, u_long pte)
+{
+    u_long flags;
+    bool rc = FALSE;
+    if(zero_page == NULL || IS_ZERO_PTE(pte))
+	return FALSE;
+    save_flags(flags);
+    cli();
+    if(memcmp(zero_page, TO_LOGICAL(PTE_GET_ADDR(pte), void *),
+	      PAGE_SIZE) == 0)
+    {
+	if(pte & PTE_COW)
+	    unshare_pte(pte);
+	else
+	    kernel->free_page(TO_LOGICAL(PTE_GET_ADDR(pte), page *));
+	set_vm_pte(vm, addr, (TO_PHYSICAL(zero_page) | (pte & PTE_USER)
+			      | PTE_COW | PTE_PRESENT));
+	rc = TRUE;
+    }
+    load_flags(flags);
+    return rc;
+}
+
+static u_long
+hash_page(u_long *p)
+{
+    u_long hash = 0;
+    int i;
+    for(i = 0; i < PAGE_ENTRIES; i++)
+	hash = ((hash << 5) | (hash >> 27)) ^ p[i];
+    return hash;
+}
+
+static bool
+vm_exists(struct vm *vm)
+{
+    struct vm *x;
+    for(x = vm_list; x != NULL; x = x->next)
+    {
+	if(x == vm)
+	    return TRUE;
+    }
+    return FALSE;
+}
+
+/* Try to make the page at ADDR in VM, currently mapped by PTE, share the
+   page described by D. Returns TRUE if it now does. */
+static bool
+merge_page(struct vm *vm, u_long addr, u_long pte, struct dedup_page *d)
+{
+    u_long dpte, new, flags;
+    bool rc = FALSE;
+    if(!vm_exists(d->vm))
+	return FALSE;
+    save_flags(flags);
+    cli();
+    dpte = kernel->get_pte(d->vm->task->page_dir, d->addr);
+    if((dpte & PTE_PRESENT) && (PTE_GET_ADDR(dpte) == d->frame)
+       && (dpte & (PTE_FREEABLE | PTE_COW))
+       && (memcmp(TO_LOGICAL(d->frame, void *),
+		  TO_LOGICAL(PTE_GET_ADDR(pte), void *), PAGE_SIZE) == 0))
+    {
+	new = share_pte(&dpte);
+	if(new != 0)
+	{
+	    set_vm_pte(d->vm, d->addr, dpte);
+	    if(pte & PTE_COW)
+		unshare_pte(pte);
+	    else
+		kernel->free_page(TO_LOGICAL(PTE_GET_ADDR(pte), page *));
+	    set_vm_pte(vm, addr, new & ~PTE_DIRTY);
+	    rc = TRUE;
+	}
+    }
+    load_flags(flags);
+    return rc;
+}
+
+/* Look at each page of VM's memory. Pages written to since the last scan
+   are left alone (their dirty bits are cleared so the next scan can tell
+   if they've changed again); the others are hashed and, if an identical
+   page has already been seen, merged with it. Called inside a forbid()
+   from the vmdedup task, so VM isn't running and its TLB entries will be
+   reloaded when it next runs. */
+static void
+dedup_vm(struct vm *vm)
+{
+    page_dir *pd = vm->task->page_dir;
+    u_long addr, end = (1024 + vm->hardware.extended_mem) * 1024;
+    for(addr = 0; addr < end; addr += PAGE_SIZE)
+    {
+	struct dedup_page *d;
+	u_long pte, hash;
+	if((addr >= 0xa0000) && (addr < 0x100000))
+	{
+	    /* The adapter area belongs to the devices. */
+	    addr = 0x100000 - PAGE_SIZE;
+	    continue;
+	}
+	if(!vm->a20_state && (addr >= 0x100000) && (addr < 0x110000))
+	    continue;
+	pte = kernel->get_pte(pd, addr);
+	if((pte & PTE_PRESENT) == 0)
+	    continue;
+	if(pte & PTE_FREEABLE)
+	{
+	    u_long dirty = pte & PTE_DIRTY;
+	    if((pte & PTE_READ_WRITE) == 0)
+		continue;
+	    if(!vm->a20_state && (addr < 0x10000))
+	    {
+		u_long alias = kernel->get_pte(pd, addr + 0x100000);
+		dirty |= alias & PTE_DIRTY;
+		kernel->set_pte(pd, addr + 0x100000, alias & ~PTE_DIRTY);
+	    }
+	    if(dirty)
+	    {
+		kernel->set_pte(pd, addr, pte & ~PTE_DIRTY);
+		continue;
+	    }
+	}
+	else if((pte & PTE_COW) == 0 || IS_ZERO_PTE(pte))
+	    continue;
+	hash = hash_page(TO_LOGICAL(PTE_GET_ADDR(pte), u_long *));
+	if((hash == 0) && merge_zero_page(vm, addr, pte))
+	    continue;
+	for(d = dedup_table[hash % DEDUP_HASH_SIZE]; d != NULL; d = d->next)
+	{
+	    if(d->hash == hash)
+	    {
+		if(d->frame == PTE_GET_ADDR(pte)
+		   || merge_page(vm, addr, pte, d))
+		    break;
+	    }
+	}
+	if((d == NULL) && (dedup_used < cow_pages))
+	{
+	    d = &dedup_pages[dedup_used++];
+	    d->vm = vm;
+	    d->addr = addr;
+	    d->frame = PTE_GET_ADDR(pte);
+	    d->hash = hash;
+	    d->next = dedup_table[hash % DEDUP_HASH_SIZE];
+	    dedup_table[hash % DEDUP_HASH_SIZE] = d;
+	}
+    }
+}
+
+/* The vmdedup task. Every DEDUP_INTERVAL ticks it scans the memory of all
+   vm's for identical pages. Other tasks may run between each vm, so a
+   vm may be killed (which only means that it's skipped). */
+static void
+dedup_task(void)
+{
+    while(1)
+    {
+	int i, n;
+	kernel->sleep_for_ticks(DEDUP_INTERVAL);
+	memset(dedup_table, 0, sizeof(dedup_table));
+	dedup_used = 0;
+	for(n = 0; ; n++)
+	{
+	    struct vm *vm;
+	    forbid();
+	    for(vm = vm_list, i = 0; vm != NULL && i < n; vm = vm->next, i++)
+		;
+	    if(vm == NULL)
+	    {
+		permit();
+		break;
+	    }
+	    dedup_vm(vm);
+	    permit();
+	}
+    }
+}
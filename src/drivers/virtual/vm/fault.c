@@ -11,6 +11,7 @@
 #include <vmm/page.h>
 #include <vmm/traps.h>
 #include <vmm/vpic.h>
+#include <vmm/string.h>
 
 #define kprintf kernel->printf
 
@@ -164,13 +165,171 @@ push_sp(struct vm86_regs *regs, int size, u_long value)
 static void
 push_far_sp(struct vm *vm, struct vm86_regs *regs, u_long value)
 {
+    u_long addr;
     regs->esp = SET16(regs->esp, GET16(regs->esp) - 2);
-    kernel->put_pd_val(vm->task->page_dir, 2, value,
-		       (regs->ss << 4) + GET16(regs->esp));
+    addr = (regs->ss << 4) + GET16(regs->esp);
+    /* put_pd_val() writes to the physical page, so it mustn't be one
+       that's shared or swapped out, until the write is done. */
+    if(!pin_vm_memory(vm, addr, 2, TRUE))
+    {
+	kprintf("vm: Can't page in the stack at %#x\n", addr);
+	return;
+    }
+    kernel->put_pd_val(vm->task->page_dir, 2, value, addr);
+    unlock_vm_memory();
+}
+
+/* Emulate `REP INS' if IN is TRUE, otherwise `REP OUTS', moving SIZE
+   byte elements. When the port's handler has a string function and the
+   elements are stored upwards the whole block is moved by one call to
+   it (or as much of it as the handler accepts), otherwise each element
+   is transferred separately. An element that straddles the end of the
+   segment is split into bytes so that it wraps around to offset zero.
+   ECX and EDI or ESI are updated once at the end. */
+static void
+rep_string_io(struct vm *vm, struct vm86_regs *regs, u_long prefixes,
+	      bool in, int size)
+{
+    u_long addr_mask = (prefixes & PFX_ADDR) ? 0xffffffff : 0x0000ffff;
+    u_short port = GET16(regs->edx);
+    u_long count = regs->ecx & addr_mask;
+    u_long base, addr;
+    struct io_handler *ioh = get_io_handler(vm, port);
+    if(in)
+    {
+	base = regs->es << 4;
+	addr = regs->edi & addr_mask;
+    }
+    else
+    {
+	base = get_data_seg(regs, prefixes) << 4;
+	addr = regs->esi & addr_mask;
+    }
+    DB(("vm_gpe: REP %s (addr=%x base=%x count=%#x port=%#x)\n",
+	in ? "INS" : "OUTS", addr, base, count, port));
+    if(ioh == NULL && verbose_io)
+	kprintf("vm_gpe: unhandled %s %#x\n", in ? "INS" : "OUTS", port);
+    while(count != 0)
+    {
+	u_long val;
+	/* Whether this element runs past the end of the segment. */
+	bool wraps = (addr_mask - addr) < (u_long)(size - 1);
+	if(ioh != NULL && (regs->eflags & FLAGS_DF) == 0 && !wraps
+	   && (in ? (ioh->in_string != NULL) : (ioh->out_string != NULL)))
+	{
+	    /* Only pass the elements that lie wholly inside the segment,
+	       any that wraps around its end is done separately below. */
+	    u_long room = (addr_mask - addr - (size - 1)) / size + 1;
+	    u_long run = (room < count) ? room : count;
+	    u_long done = (in
+			   ? ioh->in_string(vm, port, size, run,
+					    (void *)(base + addr))
+			   : ioh->out_string(vm, port, size, run,
+					     (void *)(base + addr)));
+	    if(done > 0)
+	    {
+		count -= done;
+		addr = (addr + done * size) & addr_mask;
+		continue;
+	    }
+	}
+	if(wraps)
+	{
+	    int i;
+	    if(in)
+	    {
+		val = ioh ? ioh->in(vm, port, size) : 0xffffffff;
+		for(i = 0; i < size; i++)
+		    put_user_byte(val >> (i * 8),
+				  (u_char *)(base + ((addr + i) & addr_mask)));
+	    }
+	    else if(ioh != NULL)
+	    {
+		val = 0;
+		for(i = 0; i < size; i++)
+		{
+		    u_char *p = (u_char *)(base + ((addr + i) & addr_mask));
+		    val |= (u_long)get_user_byte(p) << (i * 8);
+		}
+		ioh->out(vm, port, size, val);
+	    }
+	}
+	else if(in)
+	{
+	    val = ioh ? ioh->in(vm, port, size) : 0xffffffff;
+	    switch(size)
+	    {
+	    case 1:
+		put_user_byte(val, (u_char *)(base + addr));
+		break;
+	    case 2:
+		put_user_short(val, (u_short *)(base + addr));
+		break;
+	    case 4:
+		put_user_long(val, (u_long *)(base + addr));
+		break;
+	    }
+	}
+	else if(ioh != NULL)
+	{
+	    switch(size)
+	    {
+	    case 1:
+		val = get_user_byte((u_char *)(base + addr));
+		break;
+	    case 2:
+		val = get_user_short((u_short *)(base + addr));
+		break;
+	    case 4:
+	    default:
+		val = get_user_long((u_long *)(base + addr));
+		break;
+	    }
+	    ioh->out(vm, port, size, val);
+	}
+	if(regs->eflags & FLAGS_DF)
+	    addr = (addr - size) & addr_mask;
+	else
+	    addr = (addr + size) & addr_mask;
+	count--;
+    }
+    regs->ecx &= ~addr_mask;
+    if(in)
+	regs->edi = (regs->edi & ~addr_mask) | addr;
+    else
+	regs->esi = (regs->esi & ~addr_mask) | addr;
 }
 
 #define REGS ((struct vm86_regs *)regs)
 
+/* If VM uses VME its interrupt flag is the VIF bit of REGS->eflags, copy
+   it into VM->virtual_eflags so that it can be emulated as usual. */
+static inline void
+get_vif(struct vm *vm, struct trap_regs *regs)
+{
+    if(vm->vme)
+    {
+	vm->virtual_eflags = ((vm->virtual_eflags & ~FLAGS_IF)
+			      | ((regs->eflags & EFLAGS_VIF) ? FLAGS_IF : 0));
+    }
+}
+
+/* The reverse of get_vif(), VIP is left as VIP-BIT (its value on entry
+   to the trap) while the virtual IF is clear; once interrupts are enabled
+   the vpic delivers whatever is pending itself. */
+static inline void
+set_vif(struct vm *vm, struct trap_regs *regs, u_long vip_bit)
+{
+    if(vm->vme)
+    {
+	regs->eflags &= ~(EFLAGS_VIF | EFLAGS_VIP);
+	if(vm->virtual_eflags & FLAGS_IF)
+	    regs->eflags |= EFLAGS_VIF;
+	else
+	    regs->eflags |= vip_bit;
+    }
+}
+
 /* Set up the current stack frame of VM (i.e. vm->task->frame) to simulate
    an `INT VECTOR' instruction. */
 void
@@ -178,15 +337,25 @@ simulate_vm_int(struct vm *vm, struct trap_regs *regs, int vector)
 {
     u_long vec_phys_addr;
     DB(("simulate_vm_int: vm=%p vector=%d\n", vm, vector));
-    vec_phys_addr = kernel->lin_to_phys(vm->task->page_dir,
-					vector * 4);
+    get_vif(vm, regs);
     push_far_sp(vm, REGS, ((vm->virtual_eflags & ~USER_EFLAGS)
 			   | (regs->eflags & USER_EFLAGS)));
     vm->virtual_eflags &= ~(FLAGS_IF | FLAGS_TF);
+    if(vm->vme)
+	regs->eflags &= ~(EFLAGS_VIF | EFLAGS_VIP);
     push_far_sp(vm, REGS, REGS->cs);
     push_far_sp(vm, REGS, REGS->eip);
+    /* The vector is read through its physical address, keep its page
+       in memory until it's been read. */
+    if(!pin_vm_memory(vm, vector * 4, 4, FALSE))
+    {
+	kprintf("vm: Can't page in interrupt vector %d\n", vector);
+	return;
+    }
+    vec_phys_addr = kernel->lin_to_phys(vm->task->page_dir, vector * 4);
     REGS->cs = *TO_LOGICAL(vec_phys_addr+2, u_short *);
     REGS->eip = SET16(REGS->eip, *TO_LOGICAL(vec_phys_addr, u_short *));
+    unlock_vm_memory();
     DB(("simulate_vm_int: cs:eip=%x:%x eflags=%x\n", REGS->cs, REGS->eip,
 	REGS->eflags));
 }
@@ -233,6 +402,97 @@ get_prefixes(struct vm86_regs *regs)
     }
 }
 
+/* Types of entries in a vm's instruction cache. */
+#define INSN_GPE 1			/* Decoded by decode_insn() */
+#define INSN_PFL 2			/* Only LEN is valid */
+
+#define INSN_HASH(addr) (((addr) ^ ((addr) >> 8)) & (VM_INSN_CACHE - 1))
+
+/* Look for an instruction of type TYPE at REGS's CS:IP in VM's cache.
+   If one exists and its code hasn't been changed since it was stored,
+   copy it to INSN and return TRUE. */
+static inline bool
+lookup_insn(struct vm *vm, struct vm86_regs *regs, int type,
+	    struct vm_insn *insn)
+{
+    u_long addr = (regs->cs << 4) + GET16(regs->eip);
+    struct vm_insn *entry = &vm->insn_cache[INSN_HASH(addr)];
+    if(entry->type == type
+       && entry->addr == addr
+       && ((get_user_long((u_long *)addr) & entry->mask[0])
+	   == entry->code[0])
+       && ((get_user_long((u_long *)(addr + 4)) & entry->mask[1])
+	   == entry->code[1]))
+    {
+	*insn = *entry;
+	return TRUE;
+    }
+    return FALSE;
+}
+
+/* Store INSN, an instruction of type TYPE at REGS's CS:IP, in VM's
+   instruction cache. Instructions that don't fit in the 8 bytes compared
+   by lookup_insn(), or whose bytes aren't contiguous, aren't stored. */
+static void
+store_insn(struct vm *vm, struct vm86_regs *regs, int type,
+	   struct vm_insn *insn)
+{
+    u_long addr = (regs->cs << 4) + GET16(regs->eip);
+    struct vm_insn *entry;
+    if(insn->len == 0 || insn->len > 8
+       || (addr & ~PAGE_MASK) > PAGE_SIZE - 8
+       || GET16(regs->eip) > 0x10000 - 8)
+	return;
+    entry = &vm->insn_cache[INSN_HASH(addr)];
+    *entry = *insn;
+    entry->addr = addr;
+    entry->type = type;
+    entry->mask[0] = (insn->len >= 4) ? 0xffffffff
+		     : (1UL << (insn->len * 8)) - 1;
+    entry->mask[1] = (insn->len >= 8) ? 0xffffffff
+		     : (insn->len > 4) ? (1UL << ((insn->len - 4) * 8)) - 1 : 0;
+    entry->code[0] = get_user_long((u_long *)addr) & entry->mask[0];
+    entry->code[1] = get_user_long((u_long *)(addr + 4)) & entry->mask[1];
+}
+
+/* Decode the instruction at REGS's CS:IP into INSN, leaving REGS as it
+   was. Returns FALSE if vm_gpe_handler() can't emulate the instruction. */
+static bool
+decode_insn(struct vm86_regs *regs, struct vm_insn *insn)
+{
+    u_long orig_eip = regs->eip;
+    bool known = TRUE;
+    insn->prefixes = get_prefixes(regs);
+    insn->opcode = pop_cs(regs);
+    insn->opcode2 = insn->imm = 0;
+    switch(insn->opcode)
+    {
+    case 0xe4: case 0xe5: case 0xe6: case 0xe7:	/* IN/OUT Ib */
+    case 0xcd:					/* INT Ib */
+	insn->imm = pop_cs(regs);
+	break;
+    case 0x6c: case 0x6d: case 0x6e: case 0x6f:
+    case 0xec: case 0xed: case 0xee: case 0xef:
+    case 0xfa: case 0xfb: case 0x9c: case 0x9d:
+    case 0xcc: case 0xcf: case 0xf4:
+	break;
+    case 0xf3:					/* REP/REPE */
+	insn->prefixes |= get_prefixes(regs);
+	insn->opcode2 = pop_cs(regs);
+	known = (insn->opcode2 >= 0x6c && insn->opcode2 <= 0x6f);
+	break;
+    case 0x0f:					/* 2-byte escape */
+	insn->opcode2 = pop_cs(regs);
+	known = (insn->opcode2 <= 0x01);
+	break;
+    default:
+	known = FALSE;
+    }
+    insn->len = GET16(regs->eip - orig_eip);
+    regs->eip = orig_eip;
+    return known;
+}
+
 void
 vm_gpe_handler(struct trap_regs *regs)
 {
@@ -241,6 +501,8 @@ vm_gpe_handler(struct trap_regs *regs)
     struct vm *vm = GET_TASK_VM(kernel->current_task);
     u_long prefixes;
     u_long orig_eip = regs->eip;
+    u_long vip_bit = regs->eflags & EFLAGS_VIP;
+    struct vm_insn insn;
     u_char byte;
 
     if (!vpic) {
@@ -258,8 +520,21 @@ vm_gpe_handler(struct trap_regs *regs)
 	kernel->dump_regs(regs, TRUE);
     }
 
-    prefixes = get_prefixes(REGS);
-    switch((byte = pop_cs(REGS)))
+    /* With VME the flag instructions that still trap (PUSHFD, POPFD,
+       IRETD, or STI, POPF and IRET while VIP is set) are emulated on
+       the virtual_eflags copy of VIF. */
+    get_vif(vm, regs);
+
+    /* Guests tend to trap on the same few instructions over and over
+       again, so look in the cache before decoding. */
+    if(!lookup_insn(vm, REGS, INSN_GPE, &insn)
+       && decode_insn(REGS, &insn))
+    {
+	store_insn(vm, REGS, INSN_GPE, &insn);
+    }
+    prefixes = insn.prefixes;
+    REGS->eip = SET16(REGS->eip, GET16(REGS->eip) + insn.len);
+    switch((byte = insn.opcode))
     {
     case 0xe4:			/* IN AL,Ib */
     case 0xe5:			/* IN eAX,Ib */
@@ -276,7 +551,7 @@ vm_gpe_handler(struct trap_regs *regs)
 	    if(byte & 0x08)
 		port = GET16(REGS->edx);
 	    else
-		port = pop_cs(REGS);
+		port = insn.imm;
 	    if(byte & 1)
 	    {
 		if(prefixes & PFX_OP)
@@ -312,7 +587,7 @@ vm_gpe_handler(struct trap_regs *regs)
 	    if(byte & 0x08)
 		port = GET16(REGS->edx);
 	    else
-		port = pop_cs(REGS);
+		port = insn.imm;
 	    ioh = get_io_handler(vm, port);
 	    if(ioh == NULL)
 	    {
@@ -412,7 +687,7 @@ vm_gpe_handler(struct trap_regs *regs)
 
     case 0xcd:			/* INT Ib */
 	{
-	    u_char vec = pop_cs(REGS);
+	    u_char vec = insn.imm;
 	    DB(("vm_gpe: INT 0x%x\n", vec));
 	    simulate_vm_int(vm, regs, vec);
 	}
@@ -446,102 +721,22 @@ vm_gpe_handler(struct trap_regs *regs)
 	break;
 
     case 0xf3:			/* REP/REPE */
-	switch((byte = pop_cs(REGS)))
+	switch((byte = insn.opcode2))
 	{
 	case 0x6c:		/* REP INSB Yb,DX */
 	case 0x6d:		/* REP INSW/D Yv,DX */
-	    {
-		u_long addr = REGS->edi;
-		u_long base = REGS->es << 4;
-		u_long count = REGS->ecx;
-		u_short port = GET16(regs->edx);
-		u_long addr_mask;
-		u_int size;
-		struct io_handler *ioh = get_io_handler(vm, port);
-		DB(("vm_gpe: REP INS (addr=%x base=%x count=%#x port=%#x)\n",
-		    addr, base, count, port));
-		if(ioh == NULL && verbose_io)
-		    kprintf("vm_gpe: unhandled INS %#x\n", port);
-		addr_mask = ((byte & 1)
-			     ? ((prefixes & PFX_ADDR)
-				? 0xffffffff : 0x0000ffff)
-			     : 0x000000ff);
-		size = (byte & 1) ? ((prefixes & PFX_OP) ? 4 : 2) : 1;
-		addr &= addr_mask;
-		count &= (prefixes & PFX_ADDR) ? 0xffffffff : 0x0000ffff;
-		while(count-- != 0)
-		{
-		    u_long val = ioh ? ioh->in(vm, port, size) : 0xffffffff;
-		    switch(size)
-		    {
-		    case 1:
-			put_user_byte(val, (u_char *)(base + addr));
-			break;
-		    case 2:
-			put_user_short(val, (u_short *)(base + addr));
-			break;
-		    case 4:
-			put_user_long(val, (u_long *)(base + addr));
-			break;
-		    }
-		    addr = (addr + size) & addr_mask;
-		}
-		REGS->ecx = REGS->ecx & ~addr_mask;
-		break;
-	    }
-
-	case 0x6e:		/* OUTSB DX,Xb */
-	case 0x6f:		/* OUTSW/D DX,Xv */
-	    {
-		u_long addr = REGS->esi;
-		u_long base = get_data_seg(REGS, prefixes) << 4;
-		u_long count = REGS->ecx;
-		u_short port = GET16(regs->edx);
-		u_long addr_mask;
-		u_int size;
-		struct io_handler *ioh = get_io_handler(vm, port);
-		DB(("vm_gpe: REP OUTS (addr=%x base=%x count=%#x port=%#x)\n",
-		    addr, base, count, port));
-		if(ioh == NULL && verbose_io)
-		    kprintf("vm_gpe: unhandled OUTS %#x\n", port);
-		addr_mask = ((byte & 1)
-			     ? ((prefixes & PFX_ADDR)
-				? 0xffffffff : 0x0000ffff)
-			     : 0x000000ff);
-		if(ioh != NULL)
-		{
-		    size = (byte & 1) ? ((prefixes & PFX_OP) ? 4 : 2) : 1;
-		    addr &= addr_mask;
-		    count &= (prefixes & PFX_ADDR) ? 0xffffffff : 0x0000ffff;
-		    while(count-- != 0)
-		    {
-			u_long val;
-			switch(size)
-			{
-			case 1:
-			    val = get_user_byte((u_char *)(base + addr));
-			    break;
-			case 2:
-			    val = get_user_short((u_short *)(base + addr));
-			    break;
-			case 4:
-			default:
-			    val = get_user_long((u_long *)(base + addr));
-			    break;
-			}
-			addr = (addr + size) & addr_mask;
-			ioh->out(vm, port, size, val);
-		    }
-		}
-		REGS->ecx = REGS->ecx & ~addr_mask;
-		break;
-	    }
+	case 0x6e:		/* REP OUTSB DX,Xb */
+	case 0x6f:		/* REP OUTSW/D DX,Xv */
+	    rep_string_io(vm, REGS, prefixes, (byte & 2) == 0,
+			  (byte & 1) ? ((prefixes & PFX_OP) ? 4 : 2) : 1);
+	    break;
 	default:
 	    goto stop;
 	}
+	break;
 
     case 0x0f:			/* 2-byte escape */
-	switch((byte = pop_cs(REGS)))
+	switch((byte = insn.opcode2))
 	{
 	case 0x00:		/* Group 6 */
 	case 0x01:		/* Group 7 */
@@ -552,6 +747,7 @@ vm_gpe_handler(struct trap_regs *regs)
 	default:
 	    goto stop;
 	}
+	break;
 
     default:
     stop:
@@ -559,6 +755,7 @@ vm_gpe_handler(struct trap_regs *regs)
 	kprintf("*** VM gpe: pid=%d ec=%x\n", vm->task->pid, REGS->error_code);
 	kernel->dump_regs(regs, TRUE);
     }
+    set_vif(vm, regs, vip_bit);
 }
 
 void
@@ -661,6 +858,31 @@ vm_ovfl_handler(struct trap_regs *regs)
 	simulate_vm_int(vm, regs, 4);
 }
 
+/* Called when the kernel (i.e. a virtual device) writes to a read-only
+   page of VM at LIN-ADDR that isn't shared; this only happens once CR0.WP
+   is set (see cow.c). Give VM a private copy of the page so that the write
+   can complete without altering a page used elsewhere (i.e. EMPTY_PAGE).
+   Only RAM is treated like this; pages in the adapter area are the ROMs
+   of the vm's devices, which must stay read-only (devices have to write
+   to those pages through their physical addresses). */
+static bool
+kernel_write_fault(struct vm *vm, u_long lin_addr)
+{
+    page_dir *pd = vm->task->page_dir;
+    u_long pte;
+    page *new;
+    if((lin_addr >= 0xa0000) && (lin_addr < 0x100000))
+	return FALSE;
+    pte = kernel->get_pte(pd, lin_addr);
+    if((pte & PTE_PRESENT) == 0 || (new = kernel->alloc_page()) == NULL)
+	return FALSE;
+    memcpy(new, TO_LOGICAL(PTE_GET_ADDR(pte), page *), PAGE_SIZE);
+    kernel->map_page(pd, new, lin_addr & PAGE_MASK,
+		     PTE_USER | PTE_READ_WRITE | PTE_FREEABLE | PTE_PRESENT);
+    flush_tlb();
+    return TRUE;
+}
+
 bool
 vm_pfl_handler(struct trap_regs *regs, u_long lin_addr)
 {
@@ -669,22 +891,36 @@ vm_pfl_handler(struct trap_regs *regs, u_long lin_addr)
 
     if(regs->error_code & PF_ERROR_PROTECTION)
     {
-	/* The only time the top-level pfl handler calls us with a
-	   prot error is when it thinks it's a pseudo-ROM page. We attempt
-	   to skip the faulting instruction.. */
+	/* The top-level pfl handler calls us with a prot error when
+	   the vm writes to a read-only page. Either it's shared with other
+	   vm's and must be copied, or it's a pseudo-ROM page and we
+	   attempt to skip the faulting instruction.. */
+	struct vm_insn insn;
+	if(break_cow(vm, lin_addr))
+	    return TRUE;
+	if((regs->error_code & PF_ERROR_USER) == 0)
+	    return kernel_write_fault(vm, lin_addr);
 	if((lin_addr < 0xa0000) || (lin_addr > 0xfffff))
 	    return FALSE;
-	REGS->eip = SET16(REGS->eip, GET16(REGS->eip)
-			  + get_inslen((u_char *)GET16(REGS->eip), TRUE,
-			  	       FALSE));
+	if(!lookup_insn(vm, REGS, INSN_PFL, &insn))
+	{
+	    insn.prefixes = 0;
+	    insn.opcode = insn.opcode2 = insn.imm = 0;
+	    insn.len = get_inslen((u_char *)((REGS->cs << 4)
+					     + GET16(REGS->eip)),
+				  TRUE, FALSE);
+	    store_insn(vm, REGS, INSN_PFL, &insn);
+	}
+	REGS->eip = SET16(REGS->eip, GET16(REGS->eip) + insn.len);
 	return TRUE;
     }
     else
     {
 	/* Okay; the only other time we get called is when a not-present
-	   page was accessed. We can allocate a page and map it in. Note
-	   that we're careful to handle the virtual A20 gate.. */
-	page *new = kernel->alloc_page();
+	   page was accessed. Reads are given the shared zero page, for
+	   writes we allocate a page of zeros and map it in. Note that
+	   we're careful to handle the virtual A20 gate.. */
+	page *new;
 	page_dir *pd = kernel->current_task->page_dir;
 	u_long pte;
 	if(!vm->a20_state && (lin_addr >= 0x100000))
@@ -693,6 +929,15 @@ vm_pfl_handler(struct trap_regs *regs, u_long lin_addr)
 	    lin_addr -= 0x100000;
 	}
 	pte = kernel->get_pte(pd, lin_addr);
+	if(pte & PTE_SWAPPED)
+	    return swap_in(vm, lin_addr);
+	if((regs->error_code & PF_ERROR_WRITE) == 0
+	   && map_zero_page(vm, lin_addr, pte))
+	    return TRUE;
+	new = alloc_vm_page();
+	if(new == NULL)
+	    return FALSE;
+	memset(new, 0, PAGE_SIZE);
 	kernel->map_page(pd, new, lin_addr & PAGE_MASK,
 			 (pte & (PTE_USER | PTE_READ_WRITE | PTE_FREEABLE))
 			 | PTE_PRESENT);
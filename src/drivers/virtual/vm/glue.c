@@ -120,7 +120,11 @@ cmd_vmvxd(struct shell *sh, int argc, char **argv)
 	    if(mod != NULL)
 	    {
 		if(mod->create_vxd(init->vm, argc - 1, argv + 1))
+		{
+		    if(!add_vm_vxd(init->vm, argc, argv))
+			sh->shell->printf(sh, "Warning: `%s' won't be cloned\n", argv[0]);
 		    rc = 0;
+		}
 		kernel->close_module((struct module *)mod);
 	    }
 	    else
@@ -0,0 +1,475 @@
+/* save.c -- Saving virtual machines to files and restoring them.
+
+   save_vm() writes everything needed to carry on running a halted vm
+   to a file: its registers and memory, the state of its virtual devices
+   and of its keyboard and video adapter. restore_vm() makes a new vm
+   from the file which continues from where the saved one stopped,
+   without going through the BIOS and booting.
+
+   The file is written and read in a single pass, it holds:
+
+	struct save_header
+	For each device in the vm's VXD-LIST, in order:
+	    struct save_vxd
+	    The device's arguments, each followed by a zero byte
+	    The state returned by the device's save_vxd() function
+	struct save_tty
+	For each page of memory which doesn't only contain zeros:
+	    The address of the page (a u_long)
+	    The contents of the page
+	END_OF_PAGES (a u_long)
+
+   Devices without a save_vxd() function are created with the same
+   arguments but otherwise start afresh. Disk images aren't part of the
+   file, they shouldn't be changed until the vm has been restored.
+
+   John Harper. */
+
+#include <vmm/vm.h>
+#include <vmm/tasks.h>
+#include <vmm/kernel.h>
+#include <vmm/page.h>
+#include <vmm/fs.h>
+#include <vmm/tty.h>
+#include <vmm/video.h>
+#include <vmm/string.h>
+
+#define kprintf kernel->printf
+
+#define SAVE_MAGIC	0x4d563638	/* "86VM" */
+#define SAVE_VERSION	1
+
+#define END_OF_PAGES	((u_long)-1)
+
+/* The number of bytes from the field FIELD of the structure at PTR to
+   its end. */
+#define BYTES_FROM(ptr, field) \
+    (sizeof(*(ptr)) - ((u_char *)&(ptr)->field - (u_char *)(ptr)))
+
+struct save_header {
+    u_long magic, version;
+    struct cookie_jar hardware;
+    struct vm86_regs regs;
+    u_long virtual_eflags;
+    bool a20_state, nmi_sts;
+    int num_vxds;
+};
+
+struct save_vxd {
+    int argc;
+    size_t args_len, state_len;
+};
+
+/* Only the fields of the vkbd from STATUS-BYTE on and the registers of
+   the video adapter (not its buffer pointers) are restored. */
+struct save_tty {
+    struct vkbd kbd;
+    u_char video_mode;
+    union {
+	struct mda_data mda;
+	struct cga_data cga;
+    } video;
+};
+
+static struct fs_module *fs;
+
+static inline bool
+write_data(struct file *fh, const void *buf, size_t len)
+{
+    return fs->write(buf, len, fh) == (long)len;
+}
+
+static inline bool
+read_data(struct file *fh, void *buf, size_t len)
+{
+    return fs->read(buf, len, fh) == (long)len;
+}
+
+static bool
+page_is_zero(page *p)
+{
+    u_long *ptr = (u_long *)p, i;
+    for(i = 0; i < PAGE_SIZE / sizeof(u_long); i++)
+    {
+	if(ptr[i] != 0)
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+/* Write the device DEV of VM to FH. */
+static bool
+save_vxd(struct vm *vm, struct vm_vxd *dev, struct file *fh)
+{
+    struct vxd_module *mod;
+    struct save_vxd rec;
+    void *state = NULL;
+    bool has_state, ok;
+    int i;
+    mod = (struct vxd_module *)kernel->open_module(dev->argv[0], SYS_VER);
+    if(mod == NULL)
+	return FALSE;
+    rec.argc = dev->argc;
+    rec.args_len = 0;
+    for(i = 0; i < dev->argc; i++)
+	rec.args_len += strlen(dev->argv[i]) + 1;
+    rec.state_len = 0;
+    has_state = (mod->save_vxd != NULL);
+    if(has_state)
+	state = mod->save_vxd(vm, &rec.state_len);
+    kernel->close_module((struct module *)mod);
+    if(has_state && (state == NULL))
+    {
+	kprintf("vm: Can't save the state of `%s'\n", dev->argv[0]);
+	return FALSE;
+    }
+    ok = write_data(fh, &rec, sizeof(rec));
+    for(i = 0; ok && i < dev->argc; i++)
+	ok = write_data(fh, dev->argv[i], strlen(dev->argv[i]) + 1);
+    if(ok && state != NULL)
+	ok = write_data(fh, state, rec.state_len);
+    if(state != NULL)
+	kernel->free(state);
+    return ok;
+}
+
+/* Write the memory of VM to FH, using BUF to hold each page. Pages are
+   copied inside a forbid() since other tasks may be sharing them. */
+static bool
+save_memory(struct vm *vm, struct file *fh, page *buf)
+{
+    page_dir *pd = vm->task->page_dir;
+    u_long addr, end = (1024 + vm->hardware.extended_mem) * 1024;
+    for(addr = 0; addr < end; addr += PAGE_SIZE)
+    {
+	u_long pte;
+	bool adapter = (addr >= 0xa0000) && (addr < 0x100000), wanted;
+	forbid();
+	if(!vm->a20_state && (addr >= 0x100000) && (addr < 0x110000))
+	    pte = vm->himem_ptes[(addr - 0x100000) / PAGE_SIZE];
+	else
+	    pte = kernel->get_pte(pd, addr);
+	/* In the adapter area only video memory is saved, not ROMs. */
+	if(adapter)
+	    wanted = ((pte & (PTE_PRESENT | PTE_READ_WRITE))
+		      == (PTE_PRESENT | PTE_READ_WRITE));
+	else
+	    wanted = ((pte & PTE_PRESENT)
+		      && (pte & (PTE_FREEABLE | PTE_COW)));
+	if(wanted)
+	    memcpy(buf, TO_LOGICAL(PTE_GET_ADDR(pte), page *), PAGE_SIZE);
+	permit();
+	if(!wanted || (!adapter && page_is_zero(buf)))
+	    continue;
+	if(!write_data(fh, &addr, sizeof(addr))
+	   || !write_data(fh, buf, PAGE_SIZE))
+	    return FALSE;
+    }
+    addr = END_OF_PAGES;
+    return write_data(fh, &addr, sizeof(addr));
+}
+
+/* Write the frozen vm VM to FH. */
+static bool
+write_vm(struct vm *vm, struct file *fh, page *buf)
+{
+    struct save_header hdr;
+    struct save_tty tty;
+    struct vm_vxd *dev;
+    hdr.magic = SAVE_MAGIC;
+    hdr.version = SAVE_VERSION;
+    hdr.hardware = vm->hardware;
+    hdr.regs = *VM_FRAME(vm);
+    hdr.virtual_eflags = vm->virtual_eflags;
+    hdr.a20_state = vm->a20_state;
+    hdr.nmi_sts = vm->nmi_sts;
+    hdr.num_vxds = 0;
+    for(dev = vm->vxd_list; dev != NULL; dev = dev->next)
+	hdr.num_vxds++;
+    if(!write_data(fh, &hdr, sizeof(hdr)))
+	return FALSE;
+    for(dev = vm->vxd_list; dev != NULL; dev = dev->next)
+    {
+	if(!save_vxd(vm, dev, fh))
+	    return FALSE;
+    }
+    tty.kbd = vm->tty->kbd.virtual;
+    tty.video_mode = vm->tty->video.mode;
+    memcpy(&tty.video, &vm->tty->video.data, sizeof(tty.video));
+    if(!write_data(fh, &tty, sizeof(tty)))
+	return FALSE;
+    return save_memory(vm, fh, buf);
+}
+
+/* Let VM run again after it was frozen by save_vm(). */
+static void
+thaw_vm(struct vm *vm)
+{
+    u_long flags;
+    save_flags(flags);
+    cli();
+    vm->task->flags &= ~TASK_FROZEN;
+    /* If an interrupt arrived while it was frozen it's no longer
+       halted. */
+    if(!vm->hlted)
+	kernel->wake_task(vm->task);
+    load_flags(flags);
+}
+
+/* Write the state of the vm VM to the file called FILE. VM must be
+   halted, i.e. waiting for an interrupt. If the state is saved VM is
+   left frozen (it won't run again) and TRUE is returned; usually it
+   should then be killed. Otherwise VM carries on. */
+bool
+save_vm(struct vm *vm, const char *file)
+{
+    struct file *fh;
+    page *buf;
+    bool frozen = FALSE, ok = FALSE;
+    u_long flags;
+    if(!vm->hlted)
+	return FALSE;
+    fs = (struct fs_module *)kernel->open_module("fs", SYS_VER);
+    if(fs == NULL)
+	return FALSE;
+    buf = kernel->alloc_page();
+    if(buf != NULL)
+    {
+	fh = fs->open(file, F_WRITE | F_CREATE | F_TRUNCATE);
+	if(fh != NULL)
+	{
+	    /* Bring its memory back from the swap file, then stop it from
+	       running while it's written. */
+	    if(lock_vm_memory(vm))
+	    {
+		save_flags(flags);
+		cli();
+		if(vm->hlted)
+		{
+		    vm->task->flags |= TASK_FROZEN;
+		    kernel->suspend_task(vm->task);
+		    frozen = TRUE;
+		}
+		load_flags(flags);
+		if(frozen)
+		    ok = write_vm(vm, fh, buf);
+		unlock_vm_memory();
+		if(frozen && !ok)
+		    thaw_vm(vm);
+	    }
+	    fs->close(fh);
+	    /* Don't leave a partial file which restore_vm() would try
+	       to load. */
+	    if(!ok)
+		fs->remove_link(file);
+	}
+	kernel->free_page(buf);
+    }
+    kernel->close_module((struct module *)fs);
+    return ok;
+}
+
+/* Read the next device from FH and install it in VM. */
+static bool
+restore_vxd(struct vm *vm, struct file *fh)
+{
+    struct save_vxd rec;
+    struct vxd_module *mod;
+    char **argv, *str;
+    void *state = NULL;
+    bool ok = FALSE;
+    int i;
+    if(!read_data(fh, &rec, sizeof(rec))
+       || (rec.argc < 1) || (rec.args_len < (size_t)rec.argc)
+       || (rec.args_len > PAGE_SIZE))
+	return FALSE;
+    argv = kernel->malloc(rec.argc * sizeof(char *) + rec.args_len);
+    if(argv == NULL)
+	return FALSE;
+    str = (char *)(argv + rec.argc);
+    if(!read_data(fh, str, rec.args_len) || (str[rec.args_len - 1] != 0))
+	goto out;
+    for(i = 0; i < rec.argc; i++)
+    {
+	if(str >= (char *)(argv + rec.argc) + rec.args_len)
+	    goto out;
+	argv[i] = str;
+	str += strlen(str) + 1;
+    }
+    if(rec.state_len > 0)
+    {
+	state = kernel->malloc(rec.state_len);
+	if((state == NULL) || !read_data(fh, state, rec.state_len))
+	    goto out;
+    }
+    mod = (struct vxd_module *)kernel->open_module(argv[0], SYS_VER);
+    if(mod != NULL)
+    {
+	if(mod->create_vxd(vm, rec.argc - 1, argv + 1)
+	   && add_vm_vxd(vm, rec.argc, argv))
+	{
+	    ok = TRUE;
+	    if((state != NULL) && (mod->restore_vxd != NULL))
+		ok = mod->restore_vxd(vm, state, rec.state_len);
+	}
+	kernel->close_module((struct module *)mod);
+    }
+    if(!ok)
+	kprintf("vm: Can't restore `%s'\n", argv[0]);
+out:
+    if(state != NULL)
+	kernel->free(state);
+    kernel->free(argv);
+    return ok;
+}
+
+/* Give the keyboard and video adapter of VM the state TTY. */
+static void
+restore_tty(struct vm *vm, struct save_tty *tty)
+{
+    struct video_module *video;
+    struct vkbd *vk = &vm->tty->kbd.virtual;
+    struct video *v = &vm->tty->video;
+    u_long flags;
+    video = (struct video_module *)kernel->open_module("video", SYS_VER);
+    if(video != NULL)
+    {
+	video->set_mode(v, tty->video_mode);
+	kernel->close_module((struct module *)video);
+    }
+    save_flags(flags);
+    cli();
+    memcpy(&vk->status_byte, &tty->kbd.status_byte,
+	   BYTES_FROM(vk, status_byte));
+    if(vm->hardware.monitor_type == 3)
+    {
+	memcpy(&v->data.mda.control_port, &tty->video.mda.control_port,
+	       BYTES_FROM(&v->data.mda, control_port));
+    }
+    else
+    {
+	memcpy(&v->data.cga.mode_select, &tty->video.cga.mode_select,
+	       BYTES_FROM(&v->data.cga, mode_select));
+    }
+    load_flags(flags);
+}
+
+/* Read the pages of memory from FH into VM, whose A20 gate must be
+   enabled. Normal memory is given new pages, video memory is copied into
+   the vm's existing pages. */
+static bool
+restore_memory(struct vm *vm, struct file *fh)
+{
+    page_dir *pd = vm->task->page_dir;
+    u_long addr, end = (1024 + vm->hardware.extended_mem) * 1024;
+    while(read_data(fh, &addr, sizeof(addr)))
+    {
+	u_long pte;
+	page *new;
+	if(addr == END_OF_PAGES)
+	    return TRUE;
+	if((addr >= end) || (addr & ~PAGE_MASK))
+	    return FALSE;
+	new = kernel->alloc_page();
+	if(new == NULL)
+	    return FALSE;
+	if(!read_data(fh, new, PAGE_SIZE))
+	{
+	    kernel->free_page(new);
+	    return FALSE;
+	}
+	forbid();
+	if((addr >= 0xa0000) && (addr < 0x100000))
+	{
+	    pte = kernel->get_pte(pd, addr);
+	    if((pte & (PTE_PRESENT | PTE_READ_WRITE))
+	       == (PTE_PRESENT | PTE_READ_WRITE))
+	    {
+		memcpy(TO_LOGICAL(PTE_GET_ADDR(pte), page *), new, PAGE_SIZE);
+	    }
+	    kernel->free_page(new);
+	}
+	else
+	{
+	    /* The page may have been touched as the devices were created,
+	       and so possibly merged with another vm's. */
+	    break_cow(vm, addr);
+	    pte = kernel->get_pte(pd, addr);
+	    if((pte & (PTE_PRESENT | PTE_FREEABLE))
+	       == (PTE_PRESENT | PTE_FREEABLE))
+	    {
+		kernel->free_page(TO_LOGICAL(PTE_GET_ADDR(pte), page *));
+	    }
+	    kernel->map_page(pd, new, addr,
+			     (pte & (PTE_USER | PTE_READ_WRITE | PTE_FREEABLE))
+			     | PTE_PRESENT);
+	}
+	permit();
+    }
+    return FALSE;
+}
+
+/* Read the devices, tty and memory of VM from FH. */
+static bool
+read_vm(struct vm *vm, struct file *fh, struct save_header *hdr)
+{
+    struct save_tty tty;
+    bool ok;
+    int i;
+    for(i = 0; i < hdr->num_vxds; i++)
+    {
+	if(!restore_vxd(vm, fh))
+	    return FALSE;
+    }
+    if(!read_data(fh, &tty, sizeof(tty)))
+	return FALSE;
+    restore_tty(vm, &tty);
+    /* Stop the pages being swapped out while they're put in place. */
+    if(!lock_vm_memory(vm))
+	return FALSE;
+    set_gate_a20(vm, TRUE);
+    ok = restore_memory(vm, fh);
+    set_gate_a20(vm, hdr->a20_state);
+    unlock_vm_memory();
+    flush_tlb();
+    return ok;
+}
+
+/* Create a new vm called NAME from the file FILE written by save_vm().
+   As with create_vm() its task is left suspended, when woken it carries
+   on from where the saved vm stopped. Returns NULL on failure. */
+struct vm *
+restore_vm(const char *file, const char *name)
+{
+    struct save_header hdr;
+    struct file *fh;
+    struct vm *vm = NULL;
+    fs = (struct fs_module *)kernel->open_module("fs", SYS_VER);
+    if(fs == NULL)
+	return NULL;
+    fh = fs->open(file, F_READ);
+    if(fh != NULL)
+    {
+	if(read_data(fh, &hdr, sizeof(hdr))
+	   && (hdr.magic == SAVE_MAGIC) && (hdr.version == SAVE_VERSION))
+	{
+	    vm = create_vm(name, hdr.hardware.total_mem,
+			   (hdr.hardware.monitor_type == 3) ? "mda" : "cga");
+	    if(vm != NULL)
+	    {
+		vm->hardware = hdr.hardware;
+		load_vm_regs(vm, &hdr.regs);
+		vm->virtual_eflags = hdr.virtual_eflags;
+		vm->nmi_sts = hdr.nmi_sts;
+		if(!read_vm(vm, fh, &hdr))
+		{
+		    kill_vm(vm);
+		    vm = NULL;
+		}
+	    }
+	}
+	fs->close(fh);
+    }
+    kernel->close_module((struct module *)fs);
+    return vm;
+}
@@ -0,0 +1,433 @@
+/* swap.c -- Paging vm memory out to a swap file.
+
+   When free memory runs low the `vmswapd' task writes pages which no vm
+   has accessed recently to the swap file and frees them. A page is
+   chosen with the clock algorithm: each time the hand passes a page its
+   accessed bit is cleared, pages whose accessed bit is still clear the
+   next time round are swapped out. Only pages owned by a single vm
+   (PTE_FREEABLE) are swapped, shared pages and the adapter area aren't.
+
+   The pte of a page in the swap file is not-present with PTE_SWAPPED
+   set; its address field holds the number of the page's slot in the
+   file. When the vm next touches the page vm_pfl_handler() calls
+   swap_in() to read it back.
+
+   SWAP_SEM serialises all use of the swap file, it's held by whoever is
+   moving a page between memory and the file. So a vm faulting on a page
+   which is still being written just waits for the write to finish.
+
+   John Harper. */
+
+#include <vmm/vm.h>
+#include <vmm/tasks.h>
+#include <vmm/kernel.h>
+#include <vmm/page.h>
+#include <vmm/fs.h>
+#include <vmm/bits.h>
+#include <vmm/shell.h>
+#include <vmm/string.h>
+
+#define kprintf kernel->printf
+
+/* Ticks (1024Hz) between each check of the number of free pages. */
+#define SWAP_INTERVAL	256
+
+/* vmswapd starts swapping when fewer than SWAP_LOW pages are free, and
+   stops when SWAP_HIGH pages are. */
+#define SWAP_LOW	64
+#define SWAP_HIGH	128
+
+/* Pages to free when a vm can't allocate a page itself. */
+#define SWAP_BATCH	8
+
+#define NO_SLOT		((u_long)-1)
+
+static struct fs_module *fs;
+static struct file *swap_file;
+
+/* One bit for each of the SWAP_SLOTS pages in the file, set if it's
+   in use. */
+static u_char *swap_map;
+static u_long swap_slots, swap_used, swap_rotor;
+
+static struct semaphore swap_sem;
+
+/* Position of the clock hand: a page of the HAND_VM'th vm in VM_LIST. */
+static int hand_vm;
+static u_long hand_addr;
+
+static u_long
+alloc_slot(void)
+{
+    u_long i, flags;
+    save_flags(flags);
+    cli();
+    for(i = 0; i < swap_slots; i++)
+    {
+	u_long slot = (swap_rotor + i) % swap_slots;
+	if(!test_bit(swap_map, slot))
+	{
+	    set_bit(swap_map, slot);
+	    swap_used++;
+	    swap_rotor = slot + 1;
+	    load_flags(flags);
+	    return slot;
+	}
+    }
+    load_flags(flags);
+    return NO_SLOT;
+}
+
+static void
+free_slot(u_long slot)
+{
+    u_long flags;
+    save_flags(flags);
+    cli();
+    if(test_bit(swap_map, slot))
+    {
+	clear_bit(swap_map, slot);
+	swap_used--;
+    }
+    load_flags(flags);
+}
+
+static bool
+write_slot(u_long slot, page *p)
+{
+    return (fs->seek(swap_file, slot * PAGE_SIZE, SEEK_ABS) >= 0
+	    && fs->write(p, PAGE_SIZE, swap_file) == PAGE_SIZE);
+}
+
+static bool
+read_slot(u_long slot, page *p)
+{
+    return (fs->seek(swap_file, slot * PAGE_SIZE, SEEK_ABS) >= 0
+	    && fs->read(p, PAGE_SIZE, swap_file) == PAGE_SIZE);
+}
+
+/* TRUE if the page at ADDR in VM, mapped by PTE, may be swapped out. */
+static bool
+swappable(struct vm *vm, u_long addr, u_long pte)
+{
+    if((addr >= 0xa0000) && (addr < 0x100000))
+	return FALSE;
+    /* With A20 disabled the first 64K has two pte's and the real HMA
+       pte's are in HIMEM_PTES, leave them all alone. */
+    if(!vm->a20_state && ((addr < 0x10000)
+			  || ((addr >= 0x100000) && (addr < 0x110000))))
+	return FALSE;
+    return ((pte & (PTE_PRESENT | PTE_FREEABLE | PTE_COW))
+	    == (PTE_PRESENT | PTE_FREEABLE));
+}
+
+/* Move the clock hand over at most WANT pages, swapping out those not
+   accessed since it last passed. Returns the number of pages freed.
+   Stops early if the hand goes all the way round twice or the swap file
+   is full. */
+static u_long
+reclaim_pages(u_long want)
+{
+    u_long freed = 0;
+    int wraps = 0;
+    wait(&swap_sem);
+    while((freed < want) && (wraps < 2))
+    {
+	struct vm *vm;
+	page_dir *pd;
+	u_long addr, end, pte, new_pte, slot;
+	int i;
+	bool ok;
+	forbid();
+	for(vm = vm_list, i = 0; vm != NULL && i < hand_vm; vm = vm->next, i++)
+	    ;
+	if(vm == NULL)
+	{
+	    permit();
+	    hand_vm = 0;
+	    hand_addr = 0;
+	    wraps++;
+	    continue;
+	}
+	end = (1024 + vm->hardware.extended_mem) * 1024;
+	if(hand_addr >= end)
+	{
+	    permit();
+	    hand_vm++;
+	    hand_addr = 0;
+	    continue;
+	}
+	addr = hand_addr;
+	hand_addr += PAGE_SIZE;
+	pd = vm->task->page_dir;
+	pte = kernel->get_pte(pd, addr);
+	if(!swappable(vm, addr, pte))
+	{
+	    permit();
+	    continue;
+	}
+	if(pte & PTE_ACCESSED)
+	{
+	    kernel->set_pte(pd, addr, pte & ~PTE_ACCESSED);
+	    if(vm->task == kernel->current_task)
+		flush_tlb();
+	    permit();
+	    continue;
+	}
+	slot = alloc_slot();
+	if(slot == NO_SLOT)
+	{
+	    permit();
+	    break;
+	}
+	/* Unmap the page before writing it so that it can't change under
+	   us; the frame isn't freed until it's safely in the file. */
+	new_pte = ((slot << PAGE_BITS) | (pte & (PTE_USER | PTE_READ_WRITE))
+		   | PTE_SWAPPED);
+	kernel->set_pte(pd, addr, new_pte);
+	if(vm->task == kernel->current_task)
+	    flush_tlb();
+	permit();
+	ok = write_slot(slot, TO_LOGICAL(PTE_GET_ADDR(pte), page *));
+	forbid();
+	if(ok)
+	{
+	    kernel->free_page(TO_LOGICAL(PTE_GET_ADDR(pte), page *));
+	    freed++;
+	}
+	else
+	{
+	    /* Put the page back, unless its vm has been killed. */
+	    for(vm = vm_list; vm != NULL; vm = vm->next)
+	    {
+		if(vm->task->page_dir == pd)
+		    break;
+	    }
+	    if((vm != NULL) && (kernel->get_pte(pd, addr) == new_pte))
+		kernel->set_pte(pd, addr, pte);
+	    else
+		kernel->free_page(TO_LOGICAL(PTE_GET_ADDR(pte), page *));
+	    free_slot(slot);
+	    permit();
+	    kprintf("vmswap: Can't write to swap file\n");
+	    break;
+	}
+	permit();
+    }
+    signal(&swap_sem);
+    return freed;
+}
+
+/* Read the page at ADDR in VM back from the swap file into NEW, if it
+   is still swapped out. If PTEP is non-null it points to the page's pte
+   (i.e. in HIMEM_PTES). SWAP_SEM must be held. Returns FALSE if NEW
+   wasn't used (either because the page isn't swapped or it couldn't be
+   read); ERROR is set in the second case. */
+static bool
+read_back(struct vm *vm, u_long addr, u_long *ptep, page *new, bool *error)
+{
+    u_long pte, slot;
+    pte = (ptep != NULL) ? *ptep : kernel->get_pte(vm->task->page_dir, addr);
+    if((pte & (PTE_PRESENT | PTE_SWAPPED)) != PTE_SWAPPED)
+	return FALSE;
+    slot = PTE_GET_ADDR(pte) >> PAGE_BITS;
+    if(!read_slot(slot, new))
+    {
+	*error = TRUE;
+	return FALSE;
+    }
+    pte = (TO_PHYSICAL(new) | (pte & (PTE_USER | PTE_READ_WRITE))
+	   | PTE_FREEABLE | PTE_PRESENT);
+    forbid();
+    if(ptep != NULL)
+	*ptep = pte;
+    else
+	set_vm_pte(vm, addr, pte);
+    permit();
+    free_slot(slot);
+    return TRUE;
+}
+
+/* Allocate a page for VM's memory, swapping out other pages if there
+   are no free pages. May sleep. */
+page *
+alloc_vm_page(void)
+{
+    page *p = kernel->alloc_page();
+    if((p == NULL) && (swap_file != NULL) && (reclaim_pages(SWAP_BATCH) > 0))
+	p = kernel->alloc_page();
+    return p;
+}
+
+/* The page at ADDR in VM is swapped out, read it back into memory.
+   Returns FALSE if it can't be. May sleep. */
+bool
+swap_in(struct vm *vm, u_long addr)
+{
+    page *new;
+    bool error = FALSE;
+    if(!vm->a20_state && (addr >= 0x100000) && (addr < 0x110000))
+	addr -= 0x100000;
+    new = alloc_vm_page();
+    if(new == NULL)
+	return FALSE;
+    wait(&swap_sem);
+    if(!read_back(vm, addr & PAGE_MASK, NULL, new, &error))
+	kernel->free_page(new);
+    signal(&swap_sem);
+    if(error)
+	kprintf("vmswap: Can't read from swap file\n");
+    return !error;
+}
+
+/* Make sure that the LEN bytes at ADDR in VM aren't in the swap file,
+   and if WRITING that they aren't shared copy-on-write, then stop them
+   being swapped out until unlock_vm_memory() is called. Used before
+   accessing vm memory through its physical address (as put_pd_val()
+   does). VM must be the current task. Returns FALSE if a page couldn't
+   be read back or copied, in which case nothing is locked. May sleep. */
+bool
+pin_vm_memory(struct vm *vm, u_long addr, size_t len, bool writing)
+{
+    while(1)
+    {
+	u_long page;
+	wait(&swap_sem);
+	for(page = addr & PAGE_MASK; page < addr + len; page += PAGE_SIZE)
+	{
+	    u_long pte = kernel->get_pte(vm->task->page_dir, page);
+	    if(pte & PTE_SWAPPED)
+		break;
+	    if(writing && ((pte & (PTE_PRESENT | PTE_COW))
+			   == (PTE_PRESENT | PTE_COW))
+	       && !break_cow(vm, page))
+	    {
+		signal(&swap_sem);
+		return FALSE;
+	    }
+	}
+	if(page >= addr + len)
+	    return TRUE;
+	/* swap_in() may have to swap other pages out to make room, so
+	   SWAP_SEM can't be held while it's called. */
+	signal(&swap_sem);
+	if(!swap_in(vm, page))
+	    return FALSE;
+    }
+}
+
+/* Read all of VM's pages back from the swap file and stop any being
+   swapped out until unlock_vm_memory() is called. Returns FALSE if this
+   isn't possible, in which case nothing is locked. May sleep. */
+bool
+lock_vm_memory(struct vm *vm)
+{
+    u_long addr, end = (1024 + vm->hardware.extended_mem) * 1024;
+    bool error = FALSE;
+    wait(&swap_sem);
+    for(addr = 0; (addr < end) && !error; addr += PAGE_SIZE)
+    {
+	u_long *ptep = NULL, pte;
+	page *new;
+	if(!vm->a20_state && (addr >= 0x100000) && (addr < 0x110000))
+	{
+	    ptep = &vm->himem_ptes[(addr - 0x100000) / PAGE_SIZE];
+	    pte = *ptep;
+	}
+	else
+	    pte = kernel->get_pte(vm->task->page_dir, addr);
+	if((pte & (PTE_PRESENT | PTE_SWAPPED)) != PTE_SWAPPED)
+	    continue;
+	new = kernel->alloc_page();
+	if(new == NULL)
+	    error = TRUE;
+	else if(!read_back(vm, addr, ptep, new, &error))
+	    kernel->free_page(new);
+    }
+    if(error)
+	signal(&swap_sem);
+    return !error;
+}
+
+void
+unlock_vm_memory(void)
+{
+    signal(&swap_sem);
+}
+
+/* Free the swap slots used by VM, called as it's killed. */
+void
+release_swap_slots(struct vm *vm)
+{
+    u_long addr, end = (1024 + vm->hardware.extended_mem) * 1024;
+    if(swap_file == NULL)
+	return;
+    for(addr = 0; addr < end; addr += PAGE_SIZE)
+    {
+	u_long pte;
+	if(!vm->a20_state && (addr >= 0x100000) && (addr < 0x110000))
+	    pte = vm->himem_ptes[(addr - 0x100000) / PAGE_SIZE];
+	else
+	    pte = kernel->get_pte(vm->task->page_dir, addr);
+	if((pte & (PTE_PRESENT | PTE_SWAPPED)) == PTE_SWAPPED)
+	    free_slot(PTE_GET_ADDR(pte) >> PAGE_BITS);
+    }
+}
+
+/* The vmswapd task. */
+static void
+swap_task(void)
+{
+    while(1)
+    {
+	u_long free;
+	kernel->sleep_for_ticks(SWAP_INTERVAL);
+	free = kernel->free_page_count();
+	if(free < SWAP_LOW)
+	    reclaim_pages(SWAP_HIGH - free);
+    }
+}
+
+/* Start swapping vm pages to the file NAME, using at most KBYTES of it.
+   Only one swap file may be used. Returns FALSE on failure. */
+bool
+start_swap(const char *name, u_long kbytes)
+{
+    u_long slots = kbytes / (PAGE_SIZE / 1024);
+    if(swap_file != NULL || slots == 0)
+	return FALSE;
+    fs = (struct fs_module *)kernel->open_module("fs", SYS_VER);
+    if(fs != NULL)
+    {
+	swap_map = kernel->calloc((slots + 7) / 8, 1);
+	if(swap_map != NULL)
+	{
+	    swap_file = fs->open(name, F_READ | F_WRITE | F_CREATE);
+	    if(swap_file != NULL)
+	    {
+		swap_slots = slots;
+		if(kernel->add_task(swap_task, TASK_RUNNING, -1, "vmswapd"))
+		    return TRUE;
+		fs->close(swap_file);
+		swap_file = NULL;
+		swap_slots = 0;
+	    }
+	    kernel->free(swap_map);
+	    swap_map = NULL;
+	}
+	kernel->close_module((struct module *)fs);
+	fs = NULL;
+    }
+    return FALSE;
+}
+
+void
+describe_swap(struct shell *sh)
+{
+    if(swap_file == NULL)
+	sh->shell->printf(sh, "No swap file.\n");
+    else
+	sh->shell->printf(sh, "Swap: Total: %d  Used: %d  Free: %d\n",
+			  swap_slots * 4, swap_used * 4,
+			  (swap_slots - swap_used) * 4);
+}
@@ -62,10 +62,124 @@ cmd_dbio(struct shell *sh, int argc, char **argv)
     return 0;
 }
 
+#define DOC_vmclone "vmclone PID [NAME]\n\
+Start a new virtual machine called NAME as a copy of the virtual machine\n\
+whose task has id PID, which must be halted (e.g. waiting for a key).\n\
+The new machine is given the same virtual devices and shares the memory\n\
+of the original until either writes to it."
+int
+cmd_vmclone(struct shell *sh, int argc, char **argv)
+{
+    struct task *task;
+    struct vm *vm;
+    char name_buf[100];
+    if(argc < 1)
+    {
+	sh->shell->printf(sh, "Error: no vm specified\n");
+	return RC_FAIL;
+    }
+    task = kernel->find_task_by_pid(kernel->strtoul(argv[0], NULL, 0));
+    if((task == NULL) || !(task->flags & TASK_VM))
+    {
+	sh->shell->printf(sh, "Error: no vm %s\n", argv[0]);
+	return RC_FAIL;
+    }
+    kernel->sprintf(name_buf, "vm<%s>", (argc > 1) ? argv[1] : "");
+    vm = clone_vm(task->user_data, name_buf);
+    if(vm == NULL)
+    {
+	sh->shell->printf(sh, "Error: can't clone vm %s\n", argv[0]);
+	return RC_FAIL;
+    }
+    kernel->wake_task(vm->task);
+    return 0;
+}
+
+#define DOC_vmswap "vmswap [FILE SIZE]\n\
+Use up to SIZE kilobytes of the file FILE (which is created if it doesn't\n\
+exist) to hold pages of virtual machine memory when memory is short.\n\
+Without arguments print how much of the swap file is in use."
+int
+cmd_vmswap(struct shell *sh, int argc, char **argv)
+{
+    if(argc == 0)
+    {
+	describe_swap(sh);
+	return 0;
+    }
+    if(argc < 2)
+    {
+	sh->shell->printf(sh, "Error: no size specified\n");
+	return RC_FAIL;
+    }
+    if(!start_swap(argv[0], kernel->strtoul(argv[1], NULL, 0)))
+    {
+	sh->shell->printf(sh, "Error: can't swap to %s\n", argv[0]);
+	return RC_FAIL;
+    }
+    return 0;
+}
+
+#define DOC_vmsave "vmsave PID FILE\n\
+Write the virtual machine whose task has id PID, which must be halted\n\
+(e.g. waiting for a key), to the file FILE then kill it. The machine can\n\
+be started again from where it stopped with `vmrestore'. Any disk\n\
+images it uses shouldn't be changed in the meantime."
+int
+cmd_vmsave(struct shell *sh, int argc, char **argv)
+{
+    struct task *task;
+    if(argc < 2)
+    {
+	sh->shell->printf(sh, "Error: no vm or file specified\n");
+	return RC_FAIL;
+    }
+    task = kernel->find_task_by_pid(kernel->strtoul(argv[0], NULL, 0));
+    if((task == NULL) || !(task->flags & TASK_VM))
+    {
+	sh->shell->printf(sh, "Error: no vm %s\n", argv[0]);
+	return RC_FAIL;
+    }
+    if(!save_vm(task->user_data, argv[1]))
+    {
+	sh->shell->printf(sh, "Error: can't save vm %s to %s\n",
+			  argv[0], argv[1]);
+	return RC_FAIL;
+    }
+    kill_vm(task->user_data);
+    return 0;
+}
+
+#define DOC_vmrestore "vmrestore FILE [NAME]\n\
+Start a new virtual machine called NAME from the file FILE written by\n\
+the `vmsave' command. It carries on from where the saved machine\n\
+stopped, with the same virtual devices."
+int
+cmd_vmrestore(struct shell *sh, int argc, char **argv)
+{
+    struct vm *vm;
+    char name_buf[100];
+    if(argc < 1)
+    {
+	sh->shell->printf(sh, "Error: no file specified\n");
+	return RC_FAIL;
+    }
+    kernel->sprintf(name_buf, "vm<%s>", (argc > 1) ? argv[1] : "");
+    vm = restore_vm(argv[0], name_buf);
+    if(vm == NULL)
+    {
+	sh->shell->printf(sh, "Error: can't restore vm from %s\n", argv[0]);
+	return RC_FAIL;
+    }
+    kernel->wake_task(vm->task);
+    return 0;
+}
+
 struct shell_cmds vm_cmds =
 {
     0,
-    { CMD(vminfo), CMD(dbio), END_CMD }
+    { CMD(vminfo), CMD(dbio), CMD(vmclone), CMD(vmswap), CMD(vmsave),
+      CMD(vmrestore), END_CMD }
 };
 
 bool
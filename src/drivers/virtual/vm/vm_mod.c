@@ -21,6 +21,7 @@ struct vm_module vm_module =
     create_vm, kill_vm, add_io_handler, remove_io_handler, get_io_handler,
     add_arpl_handler, remove_arpl_handler, get_arpl_handler,
     add_vm_kill_handler,
-    alloc_vm_slot, free_vm_slot, set_gate_a20, simulate_vm_int
+    alloc_vm_slot, free_vm_slot, set_gate_a20, simulate_vm_int,
+    clone_vm, save_vm, restore_vm
 };
 
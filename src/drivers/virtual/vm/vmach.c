@@ -18,9 +18,21 @@
 
 static bool fill_vm_page_dir(struct vm *vm);
 
+/* All existing vm's. Only modified inside a forbid(). */
+struct vm *vm_list;
+
 struct io_handler *global_io;
 struct arpl_handler *global_arpls;
 
+/* The handlers of GLOBAL_IO indexed by port, split into 256-port chunks
+   which are only allocated when they have a handler. Chunks are never
+   freed since vm tables may point to them. */
+static struct io_handler **global_io_table[256];
+
+/* Incremented each time a global handler is added or removed, vm's with
+   a different IO_GEN rebuild their tables. Never zero. */
+static u_long io_gen = 1;
+
 /* If TRUE unhandled I/O addresses are printed to the console when they
    are accessed. */
 bool verbose_io;
@@ -31,6 +43,10 @@ static page *empty_page;
 
 static struct vpic_module *vpic;
 
+/* TRUE if the processor has Virtual-8086 mode extensions and CR4.VME has
+   been set, all vm's then use them. */
+static bool vme_enabled;
+
 bool
 init_vm(void)
 {
@@ -39,6 +55,14 @@ init_vm(void)
     {
 	empty_page = kernel->alloc_page();
 	memset(empty_page, 0, PAGE_SIZE);
+	if(kernel->cookie->proc.id_flag
+	   && (kernel->cookie->proc.flags & CPU_FEAT_VME))
+	{
+	    u_long cr4;
+	    asm volatile ("movl %%cr4,%0" : "=r" (cr4));
+	    asm volatile ("movl %0,%%cr4" : : "r" (cr4 | CR4_VME));
+	    vme_enabled = TRUE;
+	}
 	return TRUE;
     }
     return FALSE;
@@ -52,6 +76,8 @@ struct vm *
 create_vm(const char *name, u_long virtual_mem, const char *display_type)
 {
     struct tty_module *tty = (struct tty_module *)kernel->open_module("tty", SYS_VER);
+    /* Start sharing identical pages between vm's. */
+    init_cow();
     if(tty != NULL)
     {
 	struct vm *vm = kernel->calloc(sizeof(struct vm), 1);
@@ -96,6 +122,18 @@ create_vm(const char *name, u_long virtual_mem, const char *display_type)
 		    vm->task->tss.ss = 0;
 		    vm->task->tss.es = 0;
 		    vm->virtual_eflags = 2;
+		    if(vme_enabled)
+		    {
+			/* Let the vm's own IVT handle all software
+			   interrupts without trapping. */
+			vm->vme = TRUE;
+			memset(vm->task->tss.int_redirect, 0,
+			       sizeof(vm->task->tss.int_redirect));
+		    }
+		    forbid();
+		    vm->next = vm_list;
+		    vm_list = vm;
+		    permit();
 		    kernel->close_module((struct module *)tty);
 		    return vm;
 		}
@@ -114,8 +152,21 @@ void
 kill_vm(struct vm *vm)
 {
     struct vm_kill_handler *kh;
+    struct vm **ptr;
+    int i;
     forbid();
 
+    ptr = &vm_list;
+    while(*ptr != NULL)
+    {
+	if(*ptr == vm)
+	{
+	    *ptr = vm->next;
+	    break;
+	}
+	ptr = &(*ptr)->next;
+    }
+
     /* Freeze the task about to be killed.. */
     vm->task->flags |= TASK_FROZEN;
     kernel->suspend_task(vm->task);
@@ -141,12 +192,20 @@ kill_vm(struct vm *vm)
     }
     if(vm->task != NULL)
     {
+	release_cow_pages(vm);
+	release_swap_slots(vm);
 	if(vm->task->name)
 	    kernel->free((char *)vm->task->name);
 	kernel->kill_task(vm->task);
 	vm->task = NULL;
     }
     permit();
+    for(i = 0; i < 256; i++)
+    {
+	if(test_bit(vm->io_private, i))
+	    kernel->free(vm->io_table[i]);
+    }
+    free_vm_vxds(vm);
     kernel->free(vm);
 }
 
@@ -186,6 +245,96 @@ fill_vm_page_dir(struct vm *vm)
 
 /* I/O port virtualisation. */
 
+/* Return the first handler in the list IOH covering PORT, or NULL. */
+static inline struct io_handler *
+find_io_handler(struct io_handler *ioh, u_short port)
+{
+    while(ioh != NULL)
+    {
+	if((port >= ioh->low_port) && (port <= ioh->high_port))
+	    break;
+	ioh = ioh->next;
+    }
+    return ioh;
+}
+
+/* Recalculate the entries of the global dispatch table for the ports
+   from LOW to HIGH. This should be called in the middle of a forbid(). */
+static void
+update_global_io_table(u_short low, u_short high)
+{
+    u_long port;
+    for(port = low; port <= high; port++)
+    {
+	struct io_handler ***chunk = &global_io_table[port >> 8];
+	struct io_handler *ioh = find_io_handler(global_io, port);
+	if(*chunk == NULL)
+	{
+	    if(ioh == NULL)
+		continue;
+	    *chunk = kernel->calloc(256, sizeof(struct io_handler *));
+	    if(*chunk == NULL)
+	    {
+		kprintf("vm: No memory for I/O table, ports %03X-%03X\n",
+			port & ~0xff, port | 0xff);
+		port |= 0xff;
+		continue;
+	    }
+	}
+	(*chunk)[port & 0xff] = ioh;
+    }
+    if(++io_gen == 0)
+	io_gen = 1;
+}
+
+/* Rebuild the dispatch table of VM from the global table and its list
+   of local handlers. Chunks containing local handlers get a private copy
+   of the global chunk with the local handlers overlaid, the rest share
+   the global chunks. */
+static void
+rebuild_io_table(struct vm *vm)
+{
+    u_long need[256 / 32];
+    struct io_handler *ioh;
+    int i, j;
+    forbid();
+    memset(need, 0, sizeof(need));
+    for(ioh = vm->local_io; ioh != NULL; ioh = ioh->next)
+    {
+	for(i = ioh->low_port >> 8; i <= (ioh->high_port >> 8); i++)
+	    set_bit(need, i);
+    }
+    for(i = 0; i < 256; i++)
+    {
+	struct io_handler **global = global_io_table[i];
+	if(test_bit(need, i) && !test_bit(vm->io_private, i))
+	{
+	    /* Once allocated a private chunk is kept until the vm is
+	       killed, so that a lookup in progress never sees it freed. */
+	    vm->io_table[i] = kernel->malloc(256 * sizeof(struct io_handler *));
+	    if(vm->io_table[i] != NULL)
+		set_bit(vm->io_private, i);
+	    else
+		kprintf("vm: No memory for I/O table, ports %03X-%03X\n",
+			i << 8, (i << 8) | 0xff);
+	}
+	if(test_bit(vm->io_private, i))
+	{
+	    for(j = 0; j < 256; j++)
+	    {
+		ioh = find_io_handler(vm->local_io, (i << 8) | j);
+		if(ioh == NULL && global != NULL)
+		    ioh = global[j];
+		vm->io_table[i][j] = ioh;
+	    }
+	}
+	else
+	    vm->io_table[i] = global;
+    }
+    vm->io_gen = io_gen;
+    permit();
+}
+
 /* Add the io-port handler IOH to the vm LOCAL if LOCAL is non-NULL, or
    to the whole system if LOCAL is NULL. */
 void
@@ -199,6 +348,10 @@ add_io_handler(struct vm *local, struct io_handler *ioh)
 	head = &local->local_io;
     ioh->next = *head;
     *head = ioh;
+    if(local == NULL)
+	update_global_io_table(ioh->low_port, ioh->high_port);
+    else
+	local->io_gen = 0;
     permit();
 }
 
@@ -222,33 +375,25 @@ remove_io_handler(struct vm *local, struct io_handler *ioh)
 	}
 	head = &(*head)->next;
     }
+    if(local == NULL)
+	update_global_io_table(ioh->low_port, ioh->high_port);
+    else
+	local->io_gen = 0;
     permit();
 }
 
 /* Return the io-port handler covering the port PORT in the vm VM, or NULL
-   if that port is not virtualised. */
+   if that port is not virtualised. Handlers local to VM take precedence
+   over global ones. Unless the handlers have changed since the last call
+   this is just two table lookups. */
 struct io_handler *
 get_io_handler(struct vm *vm, u_short port)
 {
-    struct io_handler *ioh;
-    forbid();
-    ioh = vm->local_io;
-    while(ioh != NULL)
-    {
-	if((port >= ioh->low_port) && (port <= ioh->high_port))
-	    goto end;
-	ioh = ioh->next;
-    }
-    ioh = global_io;
-    while(ioh != NULL)
-    {
-	if((port >= ioh->low_port) && (port <= ioh->high_port))
-	    goto end;
-	ioh = ioh->next;
-    }
-end:
-    permit();
-    return ioh;
+    struct io_handler **chunk;
+    if(vm->io_gen != io_gen)
+	rebuild_io_table(vm);
+    chunk = vm->io_table[port >> 8];
+    return (chunk != NULL) ? chunk[port & 0xff] : NULL;
 }
 
 void
@@ -63,20 +63,94 @@ create_vpic(struct vm *vmach, __attribute__ ((unused)) int argc, __attribute__ (
     return FALSE;
 }
 
+/* Give the vpic of the clone TO the state of FROM's vpic. */
+static void
+clone_vpic(struct vm *from, struct vm *to)
+{
+    struct vpic_pair *src = from->slots[vpic_slot];
+    struct vpic_pair *dst = to->slots[vpic_slot];
+    if((src != NULL) && (dst != NULL))
+    {
+	u_long flags;
+	save_flags(flags);
+	cli();
+	dst->master = src->master;
+	dst->slave = src->slave;
+	load_flags(flags);
+    }
+}
+
+static inline void install_return_hook(struct vm *vm);
+
+/* Return a copy of the two 8259s of VM. */
+static void *
+save_vpic(struct vm *vm, size_t *lenp)
+{
+    struct vpic_pair *pair = vm->slots[vpic_slot];
+    struct vpic *data;
+    if(pair == NULL)
+	return NULL;
+    data = kernel->malloc(2 * sizeof(struct vpic));
+    if(data != NULL)
+    {
+	u_long flags;
+	save_flags(flags);
+	cli();
+	data[0] = pair->master;
+	data[1] = pair->slave;
+	load_flags(flags);
+	*lenp = 2 * sizeof(struct vpic);
+    }
+    return data;
+}
+
+/* Give the vpic of VM the state DATA returned by save_vpic(). Interrupts
+   which were waiting are delivered when the vm next runs. */
+static bool
+restore_vpic(struct vm *vm, const void *data, size_t len)
+{
+    struct vpic_pair *pair = vm->slots[vpic_slot];
+    const struct vpic *saved = data;
+    u_long flags;
+    if((pair == NULL) || (len != 2 * sizeof(struct vpic)))
+	return FALSE;
+    save_flags(flags);
+    cli();
+    pair->master = saved[0];
+    pair->slave = saved[1];
+    install_return_hook(vm);
+    load_flags(flags);
+    return TRUE;
+}
+
 
 /* Guts of the VPIC */
 
 /* This gets put into the task->return_hook when virtual interrupts are
-   pending. It's called with interrupts masked. */
+   pending. It's called with interrupts masked. A vm using VME can clear
+   its VIF without trapping so the hook stays installed regardless of its
+   interrupt flag; if it's clear VIP is set instead, making the next
+   instruction that sets VIF trap to vm_gpe_handler(). */
 static void
 vpic_return_hook(struct trap_regs *regs)
 {
     /* Must be INITIALISED to get here */
     struct vm *vmach = kernel->current_task->user_data;
     struct vpic_pair *pair = vmach->slots[vpic_slot];
-    if((regs->eflags & EFLAGS_VM)
+    bool if_set = (vmach->vme ? (regs->eflags & EFLAGS_VIF)
+		   : (vmach->virtual_eflags & FLAGS_IF)) != 0;
+    if(vmach->vme
+       && !if_set
+       && (regs->eflags & EFLAGS_VM)
        && (pair != NULL)
-       && (vmach->virtual_eflags & FLAGS_IF)
+       && (pair->master.isr == 0)
+       && (pair->master.irr != 0))
+    {
+	regs->eflags |= EFLAGS_VIP;
+    }
+    else if((regs->eflags & EFLAGS_VM)
+       && (pair != NULL)
+       && if_set
        && (pair->master.isr == 0)
        && (pair->master.irr != 0))
     {
@@ -112,7 +186,7 @@ install_return_hook(struct vm *vm)
     /* Must be INITIALISED to get here */
     struct vpic_pair *pair = vm->slots[vpic_slot];
     if((pair != NULL)
-       && (vm->virtual_eflags & FLAGS_IF)
+       && (vm->vme || (vm->virtual_eflags & FLAGS_IF))
        && (pair->master.irr != 0))
     {
 	vm->task->return_hook = vpic_return_hook;
@@ -140,7 +214,8 @@ IF_disabled(struct vm *vm)
 	u_long flags;
 	save_flags(flags);
 	cli();
-	vm->task->return_hook = NULL;
+	if(!vm->vme)
+	    vm->task->return_hook = NULL;
 	load_flags(flags);
     }
 }
@@ -200,6 +275,12 @@ simulate_irq(struct vm *vm, u_char irq)
 		}
 		vm->task->return_hook = vpic_return_hook;
 	    }
+	    else if(vm->vme)
+	    {
+		/* VIRTUAL_EFLAGS is only up to date while the vm is
+		   halted (or in a trap); let the hook look at VIF. */
+		vm->task->return_hook = vpic_return_hook;
+	    }
 	    load_flags(flags);
 	}
     }
@@ -347,10 +428,12 @@ vpic_in(struct vm *vm, u_short port, int size)
 /* Module stuff. */
 
 static struct io_handler master_ioh = {
-    NULL, "low-pic", 0x20, 0x21, vpic_in, vpic_out
+    NULL, "low-pic", 0x20, 0x21, vpic_in, vpic_out,
+    NULL, NULL
 };
 static struct io_handler slave_ioh = {
-    NULL, "high-pic", 0xA0, 0xA1, vpic_in, vpic_out
+    NULL, "high-pic", 0xA0, 0xA1, vpic_in, vpic_out,
+    NULL, NULL
 };
 
 static bool
@@ -398,6 +481,6 @@ vpic_expunge(void)
 
 struct vpic_module vpic_module = {
     { MODULE_INIT("vpic", SYS_VER, vpic_init, NULL, NULL, vpic_expunge),
-      create_vpic },
+      create_vpic, clone_vpic, save_vpic, restore_vpic },
     simulate_irq, IF_enabled, IF_disabled, set_mask
 };
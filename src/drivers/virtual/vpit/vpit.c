@@ -12,6 +12,7 @@
 #include <vmm/kernel.h>
 #include <vmm/pit.h>
 #include <vmm/io.h>
+#include <vmm/string.h>
 
 #define kprintf kernel->printf
 
@@ -176,6 +177,53 @@ create_vpit(struct vm *vmach, __attribute__ ((unused)) int argc,
     return FALSE;
 }
 
+/* Give the vpit of the clone TO the channel settings of FROM's. */
+static void
+clone_vpit(struct vm *from, struct vm *to)
+{
+    struct vpit *src = from->slots[vpit_slot];
+    struct vpit *dst = to->slots[vpit_slot];
+    if((src != NULL) && (dst != NULL))
+    {
+	memcpy(dst->channels, src->channels, sizeof(dst->channels));
+	start_timer(to);
+    }
+}
+
+/* Return a copy of the channel settings of VM's vpit. */
+static void *
+save_vpit(struct vm *vm, size_t *lenp)
+{
+    struct vpit *vp = vm->slots[vpit_slot];
+    void *data;
+    if(vp == NULL)
+	return NULL;
+    data = kernel->malloc(sizeof(vp->channels));
+    if(data != NULL)
+    {
+	u_long flags;
+	save_flags(flags);
+	cli();
+	memcpy(data, vp->channels, sizeof(vp->channels));
+	load_flags(flags);
+	*lenp = sizeof(vp->channels);
+    }
+    return data;
+}
+
+/* Give VM's vpit the channel settings DATA from save_vpit() and restart
+   its timer. */
+static bool
+restore_vpit(struct vm *vm, const void *data, size_t len)
+{
+    struct vpit *vp = vm->slots[vpit_slot];
+    if((vp == NULL) || (len != sizeof(vp->channels)))
+	return FALSE;
+    memcpy(vp->channels, data, sizeof(vp->channels));
+    start_timer(vm);
+    return TRUE;
+}
+
 
 static void
 vpit_out(struct vm *vm, u_short port, int size, u_long val)
@@ -347,7 +395,8 @@ get_vpit(struct vm *vm)
 /* Module handling. */
 
 static struct io_handler vpit_ioh = {
-    NULL, "pit", 0x40, 0x43, vpit_in, vpit_out
+    NULL, "pit", 0x40, 0x43, vpit_in, vpit_out,
+    NULL, NULL
 };
 
 static bool
@@ -399,6 +448,6 @@ vpit_expunge(void)
 
 struct vpit_module vpit_module = {
     { MODULE_INIT("vpit", SYS_VER, vpit_init, NULL, NULL, vpit_expunge),
-      create_vpit },
+      create_vpit, clone_vpit, save_vpit, restore_vpit },
     get_vpit
 };
@@ -30,7 +30,8 @@ static u_long vprinter_in(struct vm *vm, u_short port, int size);
 static void vprinter_out(struct vm *vm, u_short port, int size, u_long val);
 
 static struct io_handler printer_io = {
-    NULL, "printer", 0, 0, vprinter_in, vprinter_out
+    NULL, "printer", 0, 0, vprinter_in, vprinter_out,
+    NULL, NULL
 };
 
 
@@ -253,7 +254,7 @@ vprinter_expunge(void)
 struct vprinter_module vprinter_module =
 {
     { MODULE_INIT("vprinter", SYS_VER, vprinter_init, NULL, NULL, vprinter_expunge),
-      create_vprinter},
+      create_vprinter, NULL, NULL, NULL },
     delete_vprinter,
     printer_write_char,
     printer_initialise,
@@ -28,7 +28,8 @@ static u_long vserial_in(struct vm *vm, u_short port, int size);
 static void vserial_out(struct vm *vm, u_short port, int size, u_long val);
 
 static struct io_handler serial_io = {
-    NULL, "serial", 0, 0, vserial_in, vserial_out
+    NULL, "serial", 0, 0, vserial_in, vserial_out,
+    NULL, NULL
 };
 
 
@@ -236,7 +237,7 @@ vserial_expunge(void)
 struct vserial_module vserial_module =
 {
     { MODULE_INIT("vserial", SYS_VER, vserial_init, NULL, NULL, vserial_expunge),
-      create_vserial},
+      create_vserial, NULL, NULL, NULL },
     delete_vserial,
     new_spool_file,
     write_char,
@@ -6,11 +6,15 @@
 #include <vmm/bits.h>
 #include <vmm/io.h>
 #include <vmm/kernel.h>
+#include <vmm/string.h>
 #ifndef TEST
 # define kprintf kernel->printf
+# define malloc kernel->malloc
+# define free kernel->free
 #else
 # define kprintf printf
 #include <stdio.h>
+#include <stdlib.h>
 #endif
 
 
@@ -31,12 +35,12 @@ bmap_alloc(struct fs_device *dev, blkno bmap_start, u_long bmap_len)
 	    return -1;
 	len = min(bmap_len, FS_BLKSIZ * 8);
 	FORBID();
-	bit = find_zero_bit(buf->buf.bmap, len);
+	bit = find_zero_bit(buf->buf->bmap, len);
 	if(bit != -1)
 	{
-	    set_bit(buf->buf.bmap, bit);
+	    set_bit(buf->buf->bmap, bit);
 	    PERMIT();
-	    bdirty(buf, TRUE);
+	    bdirty(buf, FALSE);
 	    brelse(buf);
 	    return ((bmap_blk - bmap_start) * FS_BLKSIZ * 8) + bit;
 	}
@@ -59,40 +63,296 @@ bmap_free(struct fs_device *dev, blkno bmap_start, u_long bit)
     if(buf == NULL)
 	return FALSE;
     bit = bit % (FS_BLKSIZ * 8);
-    if(!test_bit(buf->buf.bmap, bit))
+    if(!test_bit(buf->buf->bmap, bit))
     {
 	kprintf("fs: Oops, freeing a free bit (%u) in bitmap %u\n",
 		bit, bmap_start);
     }
     else
     {
-	clear_bit(buf->buf.bmap, bit);
-	bdirty(buf, TRUE);
+	clear_bit(buf->buf->bmap, bit);
+	bdirty(buf, FALSE);
     }
     brelse(buf);
     return TRUE;
 }
 
 
-/* Data-block bitmap handling. */
+/* Data-block bitmap handling.
+
+   Each device keeps an in-memory copy of its data bitmap together with
+   the number of free blocks covered by each bitmap block, these are read
+   the first time the device allocates or frees a block. Allocation is
+   done from this copy, then the same bit is set in the on-disk bitmap;
+   so finding a free block never reads more than one bitmap block. */
+
+#define BITS_PER_BMAP (FS_BLKSIZ * 8)
+
+/* Read the data bitmap of DEV into memory. Returns FALSE if it couldn't
+   be read, in which case the on-disk bitmap is used directly. */
+static bool
+load_free_map(struct fs_device *dev)
+{
+    u_long bmap_len = dev->sup.data_size;
+    u_long groups = (bmap_len + BITS_PER_BMAP - 1) / BITS_PER_BMAP;
+    u_long free_total = 0;
+    u_char *map;
+    u_long *group_free;
+    u_long i;
+    map = malloc(groups * FS_BLKSIZ);
+    if(map == NULL)
+	return FALSE;
+    group_free = malloc(groups * sizeof(u_long));
+    if(group_free == NULL)
+    {
+	free(map);
+	return FALSE;
+    }
+    for(i = 0; i < groups; i++)
+    {
+	u_char *gmap = map + (i * FS_BLKSIZ);
+	int len = min(bmap_len, BITS_PER_BMAP), bit;
+	struct buf_head *buf = bread(dev, dev->sup.data_bitmap + i);
+	if(buf == NULL)
+	{
+	    free(group_free);
+	    free(map);
+	    return FALSE;
+	}
+	memcpy(gmap, buf->buf->bmap, FS_BLKSIZ);
+	brelse(buf);
+	/* Bits past the end of the device are never free. */
+	for(bit = len; bit < BITS_PER_BMAP; bit++)
+	    set_bit(gmap, bit);
+	group_free[i] = 0;
+	for(bit = 0; bit < len; bit++)
+	{
+	    if(!test_bit(gmap, bit))
+		group_free[i]++;
+	}
+	free_total += group_free[i];
+	bmap_len -= len;
+    }
+    FORBID();
+    if(dev->free_map == NULL)
+    {
+	dev->free_map = map;
+	dev->group_free = group_free;
+	dev->free_blocks = free_total;
+	dev->alloc_cursor = 0;
+	map = NULL;
+    }
+    PERMIT();
+    if(map != NULL)
+    {
+	/* Someone else loaded it while we were sleeping. */
+	free(group_free);
+	free(map);
+    }
+    return TRUE;
+}
+
+/* Throw away the in-memory copy of DEV's data bitmap; called when the
+   device becomes invalid. */
+void
+discard_free_map(struct fs_device *dev)
+{
+    u_char *map;
+    u_long *group_free;
+    FORBID();
+    map = dev->free_map;
+    group_free = dev->group_free;
+    dev->free_map = NULL;
+    dev->group_free = NULL;
+    PERMIT();
+    if(map != NULL)
+    {
+	free(group_free);
+	free(map);
+    }
+}
+
+/* Return the first clear bit between bits START and END of the in-memory
+   bitmap of DEV, or -1. This should be called in the middle of a
+   forbid(). */
+static long
+find_free_bit(struct fs_device *dev, u_long start, u_long end)
+{
+    while(start < end)
+    {
+	u_long group = start / BITS_PER_BMAP;
+	u_long group_end = min(end, (group + 1) * BITS_PER_BMAP);
+	if(dev->group_free[group] != 0)
+	{
+	    /* Check bit-by-bit up to a word boundary, then let
+	       find_zero_bit() scan the rest of the group. */
+	    while((start & 31) && (start < group_end))
+	    {
+		if(!test_bit(dev->free_map, start))
+		    return start;
+		start++;
+	    }
+	    if(start < group_end)
+	    {
+		int bit = find_zero_bit(dev->free_map + (start / 8),
+					group_end - start);
+		if((bit != -1) && ((start + bit) < group_end))
+		    return start + bit;
+	    }
+	}
+	start = group_end;
+    }
+    return -1;
+}
+
+/* Mark bit BIT of DEV's in-memory bitmap as free again. This should be
+   called in the middle of a forbid(). */
+static inline void
+unmark_free_bit(struct fs_device *dev, u_long bit)
+{
+    if(dev->free_map != NULL && test_bit(dev->free_map, bit))
+    {
+	clear_bit(dev->free_map, bit);
+	dev->group_free[bit / BITS_PER_BMAP]++;
+	dev->free_blocks++;
+    }
+}
 
 /* Allocate a new block from DEV's bitmap. LOCALITY is where you want the
-   new block to be close to. Note that LOCALITY is ignored for now... */
+   new block to be close to, normally the previous block of the same file;
+   the block following it is used if it's free. Otherwise the search starts
+   from the position of the last allocation and wraps around. */
 blkno
-alloc_block(struct fs_device *dev, __attribute__ ((unused)) blkno locality)
+alloc_block(struct fs_device *dev, blkno locality)
 {
-    blkno blk = bmap_alloc(dev, dev->sup.data_bitmap, dev->sup.data_size);
-    return (blk == NO_FREE_BLOCK) ? 0 : dev->sup.data + blk;
+    long bit;
+    u_long goal;
+    if(dev->free_map == NULL && !load_free_map(dev))
+    {
+	blkno blk = bmap_alloc(dev, dev->sup.data_bitmap, dev->sup.data_size);
+	return (blk == NO_FREE_BLOCK) ? 0 : dev->sup.data + blk;
+    }
+    while(1)
+    {
+	struct buf_head *buf;
+	FORBID();
+	if(dev->free_map == NULL || dev->free_blocks == 0)
+	{
+	    PERMIT();
+	    ERRNO = (dev->free_map == NULL) ? E_INVALID : E_NOSPC;
+	    return 0;
+	}
+	if((locality >= dev->sup.data)
+	   && ((locality - dev->sup.data + 1) < dev->sup.data_size))
+	    goal = locality - dev->sup.data + 1;
+	else
+	    goal = dev->alloc_cursor;
+	bit = find_free_bit(dev, goal, dev->sup.data_size);
+	if(bit == -1)
+	    bit = find_free_bit(dev, 0, goal);
+	if(bit == -1)
+	{
+	    PERMIT();
+	    ERRNO = E_NOSPC;
+	    return 0;
+	}
+	set_bit(dev->free_map, bit);
+	dev->group_free[bit / BITS_PER_BMAP]--;
+	dev->free_blocks--;
+	dev->alloc_cursor = bit + 1;
+	PERMIT();
+
+	/* Now mark it in the on-disk bitmap. */
+	buf = bread(dev, dev->sup.data_bitmap + (bit / BITS_PER_BMAP));
+	if(buf == NULL)
+	{
+	    /* The block wasn't allocated after all. */
+	    FORBID();
+	    unmark_free_bit(dev, bit);
+	    PERMIT();
+	    return 0;
+	}
+	if(test_bit(buf->buf->bmap, bit % BITS_PER_BMAP))
+	{
+	    /* The copy is out of step with the disk; leave the bit set
+	       in memory and try again. */
+	    kprintf("fs: Oops, allocated block %u is already in use\n",
+		    dev->sup.data + bit);
+	    brelse(buf);
+	    continue;
+	}
+	set_bit(buf->buf->bmap, bit % BITS_PER_BMAP);
+	bdirty(buf, FALSE);
+	brelse(buf);
+	return dev->sup.data + bit;
+    }
+}
+
+/* Return the number of free blocks in DEV's in-memory bitmap starting at
+   bit BIT. This should be called in the middle of a forbid(). */
+static u_long
+free_run_length(struct fs_device *dev, u_long bit)
+{
+    u_long len = 0;
+    while(((bit + len) < dev->sup.data_size)
+	  && !test_bit(dev->free_map, bit + len))
+	len++;
+    return len;
+}
+
+/* Arrange for the next block allocated from DEV without a locality to
+   be the first of a free run of at least COUNT blocks, or if there's no
+   such run, of the longest run available. */
+void
+plan_allocation(struct fs_device *dev, u_long count)
+{
+    long start, best = -1;
+    u_long bit, end, len, best_len = 0;
+    int pass;
+    if(dev->free_map == NULL && !load_free_map(dev))
+	return;
+    FORBID();
+    if(dev->free_map == NULL)
+    {
+	PERMIT();
+	return;
+    }
+    /* Search from the cursor to the end of the device, then wrap. */
+    for(pass = 0; (pass < 2) && (best_len < count); pass++)
+    {
+	bit = (pass == 0) ? dev->alloc_cursor : 0;
+	end = (pass == 0) ? dev->sup.data_size : dev->alloc_cursor;
+	while((best_len < count)
+	      && ((start = find_free_bit(dev, bit, end)) != -1))
+	{
+	    len = free_run_length(dev, start);
+	    if(len > best_len)
+	    {
+		best = start;
+		best_len = len;
+	    }
+	    bit = start + len;
+	}
+    }
+    if(best != -1)
+	dev->alloc_cursor = best;
+    PERMIT();
 }
 
 /* Deallocate the block BLK from DEV. */
 bool
 free_block(struct fs_device *dev, blkno blk)
 {
-    return bmap_free(dev, dev->sup.data_bitmap, blk - dev->sup.data);
+    u_long bit = blk - dev->sup.data;
+    if(!bmap_free(dev, dev->sup.data_bitmap, bit))
+	return FALSE;
+    FORBID();
+    unmark_free_bit(dev, bit);
+    PERMIT();
+    return TRUE;
 }
 
-
+
 /* Returns the total number of used blocks in the device DEV. This takes
    into account the boot-block, inode-blocks and the bitmap-blocks. */
 u_long
@@ -101,6 +361,11 @@ used_blocks(struct fs_device *dev)
     u_long total = 0;
     blkno bmap_blk = dev->sup.data_bitmap;
     u_long bmap_len = dev->sup.data_size;	/* in bits */
+    if(dev->free_map != NULL)
+    {
+	total = dev->sup.data_size - dev->free_blocks;
+	bmap_len = 0;
+    }
     while(bmap_len > 0)
     {
 	int i, len;
@@ -110,7 +375,7 @@ used_blocks(struct fs_device *dev)
 	len = min(bmap_len, FS_BLKSIZ * 8);
 	for(i = 0; i < len; i ++)
 	{
-	    if(test_bit(buf->buf.bmap, i))
+	    if(test_bit(buf->buf->bmap, i))
 		total++;
 	}
 	brelse(buf);
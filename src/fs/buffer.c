@@ -9,97 +9,579 @@
 
 #ifndef TEST
 # define kprintf kernel->printf
+# define CURRENT_TICKS kernel->get_timer_ticks()
 #else
 # define kprintf printf
+# define CURRENT_TICKS 0
 #include <stdio.h>
 #endif
 
 
-static list_t buffer_table[BUFFER_BUCKETS];
+#ifndef TEST
+# define malloc kernel->malloc
+# define free kernel->free
+# define alloc_page kernel->alloc_page
+# define free_page kernel->free_page
+#else
+# include <stdlib.h>
+# define alloc_page() ((page *)malloc(PAGE_SIZE))
+# define free_page(p) free(p)
+#endif
+
+#define BUFS_PER_PAGE (PAGE_SIZE / FS_BLKSIZ)
+
+/* Each page of buffer data has one of these describing it. The cache
+   grows and shrinks a buf_page at a time. */
+struct buf_page {
+    struct buf_page *next;
+    page *data;
+    struct buf_head heads[BUFS_PER_PAGE];
+};
+
+/* Hash buckets, there are always a power-of-two number of them. */
+static struct buf_head **buffer_table;
+static list_t buffer_lru;		/* All cached buffers, MRU first */
 static struct buf_head *bh_free_list;
-static struct buf_head buffer_pool[NR_BUFFERS];
+static struct buf_page *buffer_pages;
+
+#define BUFFER_HASH(blk) ((blk) & (buffer_buckets - 1))
+
+/* Size of the cache, in blocks. */
+u_long nr_buffers, min_buffers, max_buffers;
+u_long buffer_buckets;
 
 /* Some simple statistics. */
 u_long total_accessed, cached_accesses, dirty_accesses;
+u_long total_dirty, flushed_blocks, flush_writes;
+u_long readahead_blocks, readahead_reads;
+u_long direct_reads, direct_writes;
+
+/* Runs of dirty blocks are copied here to be written with a single
+   device access. FLUSH-LOCK protects it. */
+static blk flush_buf[FLUSH_MAX_BLOCKS];
+/* Likewise blocks being read ahead are read into here, RA-LOCK protects
+   it. */
+static blk ra_buf[RA_MAX_BLOCKS];
+
+#ifndef TEST
+static struct semaphore flush_lock;
+static struct semaphore ra_lock;
+static struct timer_req flush_timer;
+static struct task *flush_task;
+#endif
 
 static bool handle_device_error(struct buf_head *bh, int access_type,
 				int errno);
+static bool shrink_buffers(void);
 
-void
-init_buffers(void)
+/* Mark the buffer X as dirty, adding it to its device's list of dirty
+   buffers. This should be called in the middle of a forbid(). */
+static void
+mark_dirty(struct buf_head *x)
+{
+    struct buf_head **ptr;
+    if(x->dirty)
+	return;
+    x->dirty = TRUE;
+    x->dirty_time = CURRENT_TICKS;
+    ptr = &x->dev->dirty_list;
+    while((*ptr != NULL) && ((*ptr)->blkno < x->blkno))
+	ptr = &(*ptr)->dirty_next;
+    x->dirty_next = *ptr;
+    *ptr = x;
+    x->dev->dirty_count++;
+    total_dirty++;
+}
+
+/* Mark the buffer X as clean, removing it from its device's list of dirty
+   buffers. This should be called in the middle of a forbid(). */
+static void
+mark_clean(struct buf_head *x)
 {
+    struct buf_head **ptr;
+    if(!x->dirty)
+	return;
+    x->dirty = FALSE;
+    ptr = &x->dev->dirty_list;
+    while(*ptr != NULL)
+    {
+	if(*ptr == x)
+	{
+	    *ptr = x->dirty_next;
+	    x->dev->dirty_count--;
+	    total_dirty--;
+	    break;
+	}
+	ptr = &(*ptr)->dirty_next;
+    }
+}
+
+/* Add the buffer X to its hash chain and the front of the LRU list.
+   This should be called in the middle of a forbid(). */
+static inline void
+hash_buffer(struct buf_head *x)
+{
+    struct buf_head **bucket = &buffer_table[BUFFER_HASH(x->blkno)];
+    x->hash_next = *bucket;
+    *bucket = x;
+    prepend_node(&buffer_lru, &x->link.node);
+}
+
+/* Remove the buffer X from its hash chain and the LRU list. This should
+   be called in the middle of a forbid(). */
+static inline void
+unhash_buffer(struct buf_head *x)
+{
+    struct buf_head **ptr = &buffer_table[BUFFER_HASH(x->blkno)];
+    while(*ptr != NULL)
+    {
+	if(*ptr == x)
+	{
+	    *ptr = x->hash_next;
+	    break;
+	}
+	ptr = &(*ptr)->hash_next;
+    }
+    remove_node(&x->link.node);
+}
+
+/* Resize the hash table to have about one bucket for every two buffers.
+   If there isn't enough memory for a new table the old one is kept.
+   This should be called in the middle of a forbid(). */
+static void
+resize_hash_table(void)
+{
+    u_long buckets = 4, i;
+    struct buf_head **table;
+    list_node_t *nxt, *x;
+    while(buckets * 2 < nr_buffers)
+	buckets *= 2;
+    if(buckets == buffer_buckets)
+	return;
+    table = malloc(buckets * sizeof(struct buf_head *));
+    if(table == NULL)
+	return;
+    for(i = 0; i < buckets; i++)
+	table[i] = NULL;
+    if(buffer_table != NULL)
+	free(buffer_table);
+    buffer_table = table;
+    buffer_buckets = buckets;
+    /* Every hashed buffer is in the LRU list, use it to rebuild the
+       chains without disturbing the order of the list. */
+    x = buffer_lru.head;
+    while((nxt = x->succ) != NULL)
+    {
+	struct buf_head *bh = (struct buf_head *)x;
+	bh->hash_next = table[BUFFER_HASH(bh->blkno)];
+	table[BUFFER_HASH(bh->blkno)] = bh;
+	x = nxt;
+    }
+}
+
+/* Add another page of buffers to the free list. Returns FALSE if the
+   cache is already as big as it's allowed to be or no memory is
+   available. This should be called in the middle of a forbid(). */
+static bool
+grow_buffers(void)
+{
+    struct buf_page *bp;
     int i;
-    for(i = 0; i < BUFFER_BUCKETS; i++)
-	init_list(&buffer_table[i]);
-    for(i = 0; i < (NR_BUFFERS - 1); i++)
-	buffer_pool[i].link.next_free = &buffer_pool[i+1];
-    buffer_pool[i].link.next_free = NULL;
-    bh_free_list = buffer_pool;
+    if(nr_buffers + BUFS_PER_PAGE > max_buffers)
+	return FALSE;
+#ifndef TEST
+    if(kernel->free_page_count() < BUFFER_RESERVE_PAGES)
+	return FALSE;
+#endif
+    bp = malloc(sizeof(struct buf_page));
+    if(bp == NULL)
+	return FALSE;
+    bp->data = alloc_page();
+    if(bp->data == NULL)
+    {
+	free(bp);
+	return FALSE;
+    }
+    for(i = 0; i < BUFS_PER_PAGE; i++)
+    {
+	struct buf_head *x = &bp->heads[i];
+	x->dev = NULL;
+	x->use_count = 0;
+	x->dirty = FALSE;
+	x->invalid = TRUE;
+#ifndef TEST
+	x->locked = FALSE;
+	x->locked_tasks = NULL;
+#endif
+	x->buf = (union buf_data *)(bp->data->mem + (i * FS_BLKSIZ));
+	x->link.next_free = bh_free_list;
+	bh_free_list = x;
+    }
+    bp->next = buffer_pages;
+    buffer_pages = bp;
+    nr_buffers += BUFS_PER_PAGE;
+    resize_hash_table();
+    return TRUE;
+}
+
+/* Write the buffer X to its device if it's dirty (and still valid). */
+static void
+write_dirty_buffer(struct buf_head *x)
+{
+    if(x->dirty && !x->invalid)
+    {
+	long result;
+	mark_clean(x);
+	result = FS_WRITE_BLOCKS(x->dev, x->blkno, &x->buf->data, 1);
+	if((result < 0)
+	   && !handle_device_error(x, F_WRITE, -result))
+	{
+	    kprintf("buffer_cache: Can't write block %d to device %s\n",
+		    x->blkno, x->dev->name);
+	}
+	dirty_accesses++;
+    }
 }
 
+/* Write back the dirty buffers of device DEV, coalescing runs of adjacent
+   blocks into single writes. If ALL is FALSE only runs containing a
+   buffer that has been dirty for at least FLUSH_AGE ticks are written.
+   This function MAY sleep. */
+static void
+flush_device(struct fs_device *dev, bool all)
+{
+    struct buf_head *run[FLUSH_MAX_BLOCKS];
+    void *bufs[FLUSH_MAX_BLOCKS];
+    struct buf_head *x;
+    u_long now = CURRENT_TICKS;
+#ifndef TEST
+    wait(&flush_lock);
+#endif
+    FORBID();
+    x = dev->dirty_list;
+    while(x != NULL)
+    {
+	int count = 0, i;
+	bool old = all;
+	blkno start = x->blkno;
+	long result;
+	while((x != NULL) && (x->blkno == start + count)
+	      && (count < FLUSH_MAX_BLOCKS))
+	{
+	    if((now - x->dirty_time) >= FLUSH_AGE)
+		old = TRUE;
+	    run[count++] = x;
+	    x = x->dirty_next;
+	}
+	if(!old)
+	    continue;
+	for(i = 0; i < count; i++)
+	{
+	    /* Hold a reference so the buffer can't be evicted while
+	       the write is in progress. If the device can write from
+	       the buffers themselves a change made while the write is
+	       in progress just marks the buffer dirty again. */
+	    run[i]->use_count++;
+	    if(dev->write_blocks_v != NULL)
+		bufs[i] = &run[i]->buf->data;
+	    else
+		memcpy(&flush_buf[i], &run[i]->buf->data, FS_BLKSIZ);
+	    mark_clean(run[i]);
+	}
+	PERMIT();
+	if(dev->write_blocks_v != NULL)
+	    result = FS_WRITE_BLOCKS_V(dev, start, bufs, count);
+	else
+	    result = FS_WRITE_BLOCKS(dev, start, flush_buf, count);
+	FORBID();
+	flush_writes++;
+	flushed_blocks += count;
+	if(result < 0)
+	{
+	    for(i = 0; i < count; i++)
+	    {
+		if(!run[i]->invalid)
+		    mark_dirty(run[i]);
+	    }
+	    PERMIT();
+	    if(!handle_device_error(run[0], F_WRITE, -result))
+		kprintf("buffer_cache: Can't write blocks %d-%d to device %s\n",
+			start, start + count - 1, dev->name);
+	    FORBID();
+	}
+	for(i = 0; i < count; i++)
+	    run[i]->use_count--;
+	if(result < 0)
+	    break;
+	/* The list may have changed while we slept, carry on from the
+	   first dirty block after this run. */
+	x = dev->dirty_list;
+	while((x != NULL) && (x->blkno < start + count))
+	    x = x->dirty_next;
+    }
+    PERMIT();
+#ifndef TEST
+    signal(&flush_lock);
+#endif
+}
+
+/* Write every dirty buffer of the device DEV, or of all devices if DEV
+   is NULL, back to disk. This function MAY sleep. */
 void
-kill_buffers(void)
+sync_buffers(struct fs_device *dev)
 {
-    int i;
-    for(i = 0; i < NR_BUFFERS; i++)
+    if(dev != NULL)
+    {
+	if(dev->dirty_count > 0)
+	    flush_device(dev, TRUE);
+    }
+    else
+    {
+	for(dev = device_list; dev != NULL; dev = dev->next)
+	{
+	    if(dev->dirty_count > 0)
+		flush_device(dev, TRUE);
+	}
+    }
+}
+
+#ifndef TEST
+/* The write-back task. Every FLUSH_INTERVAL ticks (or when woken by
+   wake_flusher()) it writes back the runs of buffers which have been
+   dirty for too long, or everything if too much of the cache is
+   dirty. When memory is short it also gives a page of buffers and the
+   older half of the unreferenced inodes back to the system. */
+static void
+flusher(void)
+{
+    while(1)
+    {
+	struct fs_device *dev;
+	bool all;
+	set_timer_sem(&flush_timer, FLUSH_INTERVAL);
+	kernel->add_timer(&flush_timer);
+	wait(&flush_timer.action.sem);
+	kernel->remove_timer(&flush_timer);
+	all = (total_dirty * 100) > (nr_buffers * FLUSH_DIRTY_RATIO);
+	for(dev = device_list; dev != NULL; dev = dev->next)
+	{
+	    if(dev->dirty_count > 0 && !dev->invalid)
+		flush_device(dev, all);
+	}
+	if(kernel->free_page_count() < BUFFER_RESERVE_PAGES)
+	{
+	    shrink_buffers();
+	    shrink_inodes(nr_inodes - (unused_inodes / 2));
+	}
+    }
+}
+#endif
+
+/* Ask for dirty buffers to be written back as soon as possible. Without
+   a flusher task (i.e. in the test build) they're written straight
+   away. */
+static void
+wake_flusher(void)
+{
+#ifndef TEST
+    if(flush_task != NULL)
+	signal(&flush_timer.action.sem);
+#else
+    static bool flushing;
+    if(!flushing)
     {
-	if(buffer_pool[i].dirty)
+	flushing = TRUE;
+	sync_buffers(NULL);
+	flushing = FALSE;
+    }
+#endif
+}
+
+/* Try to give back a page of buffers to the system. Only pages whose
+   buffers are all unreferenced can be freed; cached blocks in them are
+   written back (if necessary) and discarded. Returns TRUE if a page was
+   freed. This function MAY sleep. */
+static bool
+shrink_buffers(void)
+{
+    struct buf_page **ptr;
+    FORBID();
+again:
+    if(nr_buffers - BUFS_PER_PAGE < min_buffers)
+    {
+	PERMIT();
+	return FALSE;
+    }
+    for(ptr = &buffer_pages; *ptr != NULL; ptr = &(*ptr)->next)
+    {
+	struct buf_page *bp = *ptr;
+	int i;
+	for(i = 0; i < BUFS_PER_PAGE; i++)
+	{
+	    if(bp->heads[i].use_count != 0)
+		break;
+	}
+	if(i < BUFS_PER_PAGE)
+	    continue;
+	for(i = 0; i < BUFS_PER_PAGE; i++)
 	{
-	    FS_WRITE_BLOCKS(buffer_pool[i].dev, buffer_pool[i].blkno,
-			    &buffer_pool[i].buf.data, 1);
+	    struct buf_head *x = &bp->heads[i];
+	    if((x->dev != NULL) && x->dirty && !x->invalid)
+	    {
+		/* Write it back while it's still cached and referenced;
+		   anything may happen to the page while we sleep, so
+		   look at it again from scratch afterwards. */
+		x->use_count++;
+		write_dirty_buffer(x);
+		x->use_count--;
+		goto again;
+	    }
+	}
+	/* Every buffer is clean and unreferenced; nothing can sleep
+	   from here on, so the page can be taken apart safely. */
+	*ptr = bp->next;
+	for(i = 0; i < BUFS_PER_PAGE; i++)
+	{
+	    struct buf_head *x = &bp->heads[i], **fptr;
+	    if(x->dev != NULL)
+	    {
+		unhash_buffer(x);
+		mark_clean(x);
+		x->dev = NULL;
+		continue;
+	    }
+	    /* Not cached, so it must be on the free list. */
+	    fptr = &bh_free_list;
+	    while(*fptr != NULL)
+	    {
+		if(*fptr == x)
+		{
+		    *fptr = x->link.next_free;
+		    break;
+		}
+		fptr = &(*fptr)->link.next_free;
+	    }
 	}
+	nr_buffers -= BUFS_PER_PAGE;
+	free_page(bp->data);
+	free(bp);
+	resize_hash_table();
+	PERMIT();
+	return TRUE;
     }
+    PERMIT();
+    return FALSE;
+}
+
+/* Set the minimum and maximum number of blocks the buffer cache may hold,
+   shrinking it if it's currently bigger than MAX. Returns FALSE if the
+   limits are unusable. */
+bool
+set_buffer_limits(u_long min, u_long max)
+{
+    if(min < BUFS_PER_PAGE || max < min)
+    {
+	ERRNO = E_BADARG;
+	return FALSE;
+    }
+    min_buffers = round_to(min, BUFS_PER_PAGE);
+    max_buffers = max;
+    while(nr_buffers > max_buffers)
+    {
+	if(!shrink_buffers())
+	    break;
+    }
+    FORBID();
+    while(nr_buffers < min_buffers)
+    {
+	if(!grow_buffers())
+	    break;
+    }
+    PERMIT();
+    return TRUE;
+}
+
+void
+init_buffers(void)
+{
+    init_list(&buffer_lru);
+    bh_free_list = NULL;
+    buffer_pages = NULL;
+    buffer_table = NULL;
+    buffer_buckets = 0;
+    nr_buffers = 0;
+#ifndef TEST
+    max_buffers = ((kernel->free_page_count() / BUFFER_RAM_FRACTION)
+		   * BUFS_PER_PAGE);
+#else
+    max_buffers = 256;
+#endif
+    if(max_buffers < BUFFER_MIN)
+	max_buffers = BUFFER_MIN;
+    set_buffer_limits(BUFFER_MIN, max_buffers);
+    total_dirty = 0;
+#ifndef TEST
+    set_sem_clear(&flush_lock);
+    set_sem_clear(&ra_lock);
+    set_timer_sem(&flush_timer, FLUSH_INTERVAL);
+    flush_task = kernel->add_task(flusher, TASK_RUNNING, 0, "bflushd");
+#endif
+}
+
+void
+kill_buffers(void)
+{
+#ifndef TEST
+    if(flush_task != NULL)
+    {
+	kernel->kill_task(flush_task);
+	flush_task = NULL;
+    }
+#endif
+    sync_buffers(NULL);
 }
 
 /* This should be called in the middle of a forbid(). */
 static inline struct buf_head *
 find_buffer(struct fs_device *dev, blkno blk)
 {
-    struct buf_head *nxt, *x;
-    x = (struct buf_head *)buffer_table[BUFFER_HASH(blk)].head;
-    while((nxt = (struct buf_head *)x->link.node.succ) != NULL)
+    struct buf_head *x = buffer_table[BUFFER_HASH(blk)];
+    while(x != NULL)
     {
 	if((x->blkno == blk) && (x->dev == dev) && !x->invalid)
 	    return x;
-	x = nxt;
+	x = x->hash_next;
     }
     return NULL;
 }
 
-/* Try to move an unreferenced but cached buffer from the hash queues
-   to the free list of buffers. Returns TRUE if there *may* be a buffer
-   available (no guarantee), FALSE if there definitely isn't.
+/* Get a buffer onto the free list, either by growing the cache or by
+   evicting the least recently used unreferenced buffer. Clean buffers
+   are evicted in preference to dirty ones, which have to be written
+   first. Returns TRUE if there *may* be a buffer available (no
+   guarantee), FALSE if there definitely isn't.
    This function MAY sleep. */
 static bool
 make_free_buffer(void)
 {
-    /* Try to flush an unused buffer, otherwise we have to fail :-( */
-    struct buf_head *x;
-    int tries = 0;
+    struct buf_head *x, *nxt;
+    bool allow_dirty = FALSE;
     FORBID();
-    while(tries++ < BUFFER_BUCKETS)
+    if(grow_buffers())
     {
-	static int last_bucket;
-	struct buf_head *nxt;
-	last_bucket = (last_bucket + 1) % BUFFER_BUCKETS;
-	x = (struct buf_head *)buffer_table[last_bucket].tailpred;
+	PERMIT();
+	return TRUE;
+    }
+    do {
+	x = (struct buf_head *)buffer_lru.tailpred;
 	while((nxt = (struct buf_head *)x->link.node.pred) != NULL)
 	{
-	    if(x->use_count == 0)
+	    if((x->use_count == 0) && (allow_dirty || !x->dirty || x->invalid))
 	    {
-		remove_node(&x->link.node);
-		if(x->dirty)
-		{
-		    long result = FS_WRITE_BLOCKS(x->dev, x->blkno,
-						  &x->buf, 1);
-		    if((result < 0)
-		       || !handle_device_error(x, F_WRITE, -result))
-		    {
-			kprintf("buffer_cache: Can't write block %d to device %s\n",
-				x->blkno, x->dev->name);
-		    }
-		    dirty_accesses++;
-		}
+		unhash_buffer(x);
+		write_dirty_buffer(x);
+		mark_clean(x);
+		x->dev = NULL;
 		x->link.next_free = bh_free_list;
 		bh_free_list = x;
 		PERMIT();
@@ -107,7 +589,10 @@ make_free_buffer(void)
 	    }
 	    x = nxt;
 	}
-    }
+	/* Every unreferenced buffer is dirty; the flusher is falling
+	   behind. */
+	wake_flusher();
+    } while(!allow_dirty++);
     PERMIT();
     ERRNO = E_NOMEM;
     return FALSE;
@@ -140,7 +625,7 @@ again:
 	x->use_count++;
 	/* Move x to the head of the list to show it was recently used. */
 	remove_node(&x->link.node);
-	prepend_node(&buffer_table[BUFFER_HASH(blk)], &x->link.node);
+	prepend_node(&buffer_lru, &x->link.node);
 	cached_accesses++;
     }
     else
@@ -158,9 +643,9 @@ again:
 	    }
 	}
 	bh_free_list = x->link.next_free;
-	prepend_node(&buffer_table[BUFFER_HASH(blk)], &x->link.node);
 	x->dev = dev;
 	x->blkno = blk;
+	hash_buffer(x);
 	x->use_count = 1;
 	x->dirty = FALSE;
 	x->invalid = FALSE;
@@ -170,11 +655,14 @@ again:
 	   are synchronised. */
 	x->locked = TRUE;
 #endif
-	result = FS_READ_BLOCKS(dev, blk, &x->buf, 1);
+	result = FS_READ_BLOCKS(dev, blk, &x->buf->data, 1);
 	if((result < 0) && !handle_device_error(x, F_READ, -result))
 	{
-	    remove_node(&x->link.node);
+	    unhash_buffer(x);
+	    x->dev = NULL;
+	    x->use_count = 0;
 #ifndef TEST
+	    x->locked = FALSE;
 	    kernel->wake_up_task_list(&x->locked_tasks);
 #endif
 	    x->link.next_free = bh_free_list;
@@ -193,6 +681,103 @@ again:
     return x;
 }
 
+/* Read up to COUNT consecutive blocks starting at block BLK of device DEV
+   into the cache with a single device access, without returning them.
+   Reading stops at the first block which is already cached. This is
+   used to read ahead of sequential file accesses, no error is reported
+   if it fails. This function MAY sleep. */
+void
+bread_ahead(struct fs_device *dev, blkno blk, int count)
+{
+    struct buf_head *run[RA_MAX_BLOCKS];
+    int n = 0, i;
+    long result;
+    DB(("bread_ahead(`%s', %d, %d)\n", dev->name, blk, count));
+    /* Don't let read-ahead flush out too much of the cache. */
+    if(count > (int)(max_buffers / 4))
+	count = max_buffers / 4;
+    if(count > RA_MAX_BLOCKS)
+	count = RA_MAX_BLOCKS;
+    if((count <= 0) || !test_media(dev))
+	return;
+#ifndef TEST
+    wait(&ra_lock);
+#endif
+    FORBID();
+    while(n < count)
+    {
+	struct buf_head *x;
+	if(find_buffer(dev, blk + n) != NULL)
+	    break;
+	if((x = bh_free_list) == NULL)
+	{
+	    /* This may sleep, so check the block again afterwards. */
+	    if(!make_free_buffer())
+		break;
+	    continue;
+	}
+	bh_free_list = x->link.next_free;
+	x->dev = dev;
+	x->blkno = blk + n;
+	x->use_count = 1;
+	x->dirty = FALSE;
+	x->invalid = FALSE;
+#ifndef TEST
+	/* Anyone wanting the block will wait until it's been read. */
+	x->locked = TRUE;
+#endif
+	hash_buffer(x);
+	run[n++] = x;
+    }
+    if(n > 0)
+    {
+	bool vectored = (dev->read_blocks_v != NULL);
+	PERMIT();
+	if(vectored)
+	{
+	    /* Read straight into the buffers. */
+	    void *bufs[RA_MAX_BLOCKS];
+	    for(i = 0; i < n; i++)
+		bufs[i] = &run[i]->buf->data;
+	    result = FS_READ_BLOCKS_V(dev, blk, bufs, n);
+	}
+	else
+	    result = FS_READ_BLOCKS(dev, blk, ra_buf, n);
+	FORBID();
+	for(i = 0; i < n; i++)
+	{
+	    struct buf_head *x = run[i];
+	    if(result >= 0)
+	    {
+		if(!vectored)
+		    memcpy(&x->buf->data, &ra_buf[i], FS_BLKSIZ);
+		x->use_count--;
+	    }
+	    else
+	    {
+		unhash_buffer(x);
+		x->dev = NULL;
+		x->use_count = 0;
+		x->link.next_free = bh_free_list;
+		bh_free_list = x;
+	    }
+#ifndef TEST
+	    x->locked = FALSE;
+	    kernel->wake_up_task_list(&x->locked_tasks);
+#endif
+	}
+	if(result >= 0)
+	{
+	    readahead_blocks += n;
+	    readahead_reads++;
+	}
+    }
+    PERMIT();
+#ifndef TEST
+    signal(&ra_lock);
+#endif
+}
+
 /* Write the FS_BLKSIZ bytes at DATA to the block number BLK of device DEV
    in a way compatible with the buffer cache. Returns FALSE if an error
    occurred. */
@@ -221,7 +806,7 @@ again:
 	x->use_count++;
 	/* Move x to the head of the list to show it was recently used. */
 	remove_node(&x->link.node);
-	prepend_node(&buffer_table[BUFFER_HASH(blk)], &x->link.node);
+	prepend_node(&buffer_lru, &x->link.node);
 	cached_accesses++;
     }
     else
@@ -238,42 +823,169 @@ again:
 	    }
 	}
 	bh_free_list = x->link.next_free;
-	prepend_node(&buffer_table[BUFFER_HASH(blk)], &x->link.node);
 	x->dev = dev;
 	x->blkno = blk;
+	hash_buffer(x);
 	x->use_count = 1;
 	x->invalid = FALSE;
 #ifndef TEST
 	x->locked = FALSE;
 #endif
     }
-    memcpy(&x->buf, data, FS_BLKSIZ);
-    x->dirty = TRUE;
+    memcpy(&x->buf->data, data, FS_BLKSIZ);
+    mark_dirty(x);
     PERMIT();
     brelse(x);
     return TRUE;
 }
 
+/* Read COUNT blocks starting at block BLK of device DEV directly into
+   the memory at DATA, without reading them into the cache. Any blocks
+   which are already cached are copied from there, since they may have
+   been modified. Returns FALSE if an error occurred. This function MAY
+   sleep. */
+bool
+bread_direct(struct fs_device *dev, blkno blk, void *data, int count)
+{
+    long result;
+    int i;
+    DB(("bread_direct(`%s', %d, %d)\n", dev->name, blk, count));
+    if(!test_media(dev))
+	return FALSE;
+    result = FS_READ_BLOCKS(dev, blk, data, count);
+    if(result < 0)
+    {
+	ERRNO = -result;
+	return FALSE;
+    }
+    FORBID();
+    for(i = 0; i < count; i++)
+    {
+	struct buf_head *x;
+#ifndef TEST
+    again:
+#endif
+	x = find_buffer(dev, blk + i);
+	if(x != NULL)
+	{
+#ifndef TEST
+	    if(x->locked)
+	    {
+		kernel->sleep_in_task_list(&x->locked_tasks);
+		goto again;
+	    }
+#endif
+	    memcpy((u_char *)data + (i * FS_BLKSIZ), &x->buf->data,
+		   FS_BLKSIZ);
+	}
+    }
+    PERMIT();
+    direct_reads += count;
+    return TRUE;
+}
+
+/* Write the COUNT blocks at DATA to device DEV starting at block BLK,
+   bypassing the cache. Blocks which are cached are updated there instead
+   (and written back as usual) so that the cache never holds stale data.
+   Returns FALSE if an error occurred. This function MAY sleep. */
+bool
+bwrite_direct(struct fs_device *dev, blkno blk, const void *data, int count)
+{
+    int i = 0;
+    DB(("bwrite_direct(`%s', %d, %d)\n", dev->name, blk, count));
+    if(!test_media(dev))
+	return FALSE;
+    FORBID();
+    while(i < count)
+    {
+	struct buf_head *x;
+	int run;
+	long result;
+	x = find_buffer(dev, blk + i);
+	if(x != NULL)
+	{
+#ifndef TEST
+	    if(x->locked)
+	    {
+		kernel->sleep_in_task_list(&x->locked_tasks);
+		continue;
+	    }
+#endif
+	    memcpy(&x->buf->data, (const u_char *)data + (i * FS_BLKSIZ),
+		   FS_BLKSIZ);
+	    mark_dirty(x);
+	    i++;
+	    continue;
+	}
+	/* Write the run of uncached blocks starting here. */
+	run = 1;
+	while((i + run < count) && (find_buffer(dev, blk + i + run) == NULL))
+	    run++;
+	result = FS_WRITE_BLOCKS(dev, blk + i,
+				 (void *)((const u_char *)data
+					  + (i * FS_BLKSIZ)), run);
+	if(result < 0)
+	{
+	    PERMIT();
+	    ERRNO = -result;
+	    return FALSE;
+	}
+	direct_writes += run;
+	/* Another task may have read one of these blocks into the cache
+	   while we were writing, and even modified it. Either way its copy
+	   was read before the write finished so it may hold the old
+	   contents; replace them with what's now on the disk, otherwise a
+	   dirty copy would later be written back over the new data. */
+	while(run-- > 0)
+	{
+#ifndef TEST
+	again:
+#endif
+	    x = find_buffer(dev, blk + i);
+	    if(x != NULL)
+	    {
+#ifndef TEST
+		if(x->locked)
+		{
+		    kernel->sleep_in_task_list(&x->locked_tasks);
+		    goto again;
+		}
+#endif
+		memcpy(&x->buf->data, (const u_char *)data + (i * FS_BLKSIZ),
+		       FS_BLKSIZ);
+		/* It now matches the disk. */
+		mark_clean(x);
+	    }
+	    i++;
+	}
+    }
+    PERMIT();
+    return TRUE;
+}
+
 /* Mark that the contents of the buffer BH has been modified since it
    was returned from bread(). If WRITE-NOW is TRUE the contents of the
-   block will be written to its device immediately. */
+   block will be written to its device immediately, otherwise the flusher
+   task will write it back some time later. */
 void
 bdirty(struct buf_head *bh, bool write_now)
 {
     test_media(bh->dev);
     if(bh->invalid)
 	return;
-    bh->dirty = TRUE;
+    FORBID();
+    mark_dirty(bh);
     if(write_now)
     {
 	long result;
 	/* Have to clear this hear in case any other tasks come along and
 	   dirty the buffer while we're writing it. */
-	bh->dirty = FALSE;
-	result = FS_WRITE_BLOCKS(bh->dev, bh->blkno, &bh->buf.data, 1);
+	mark_clean(bh);
+	result = FS_WRITE_BLOCKS(bh->dev, bh->blkno, &bh->buf->data, 1);
 	if((result < 0) && !handle_device_error(bh, F_WRITE, -result))
-	    bh->dirty = TRUE;
+	    mark_dirty(bh);
     }
+    PERMIT();
 }
 
 /* Release your hold on the buffer BH. */
@@ -287,25 +999,19 @@ brelse(struct buf_head *bh)
 	if(bh->invalid)
 	{
 	    FORBID();
-	    remove_node(&bh->link.node);
+	    unhash_buffer(bh);
+	    mark_clean(bh);
+	    bh->dev = NULL;
+	    bh->use_count = 0;
 	    bh->link.next_free = bh_free_list;
 	    bh_free_list = bh;
 	    PERMIT();
 	    return;
 	}
     }
-#ifndef LAZY_WRITES
-    if(bh->dirty)
-    {
-	long result;
-	/* see bdirty() */
-	bh->dirty = FALSE;
-	result = FS_WRITE_BLOCKS(bh->dev, bh->blkno, &bh->buf.data, 1);
-	if((result < 0) && !handle_device_error(bh, F_WRITE, -result))
-	    bh->dirty = TRUE;
-    }
-#endif
     bh->use_count--;
+    if((total_dirty * 100) > (nr_buffers * FLUSH_DIRTY_RATIO))
+	wake_flusher();
 }
 
 /* Flush all cached blocks from the device DEV. If DONT-WRITE is TRUE
@@ -315,18 +1021,22 @@ brelse(struct buf_head *bh)
 void
 flush_device_cache(struct fs_device *dev, bool dont_write)
 {
-    int i;
+    struct buf_page *bp;
+    if(!dont_write)
+	flush_device(dev, TRUE);
     FORBID();
-    for(i = 0; i < NR_BUFFERS; i++)
+    for(bp = buffer_pages; bp != NULL; bp = bp->next)
     {
-	if(buffer_pool[i].dev == dev)
+	int i;
+	for(i = 0; i < BUFS_PER_PAGE; i++)
 	{
-	    buffer_pool[i].invalid = TRUE;
-	    if(buffer_pool[i].dirty && !dont_write)
+	    struct buf_head *x = &bp->heads[i];
+	    if(x->dev == dev)
 	    {
-		buffer_pool[i].dirty = FALSE;
-		FS_WRITE_BLOCKS(buffer_pool[i].dev, buffer_pool[i].blkno,
-			       &buffer_pool[i].buf.data, 1);
+		if(!dont_write)
+		    write_dirty_buffer(x);
+		mark_clean(x);
+		x->invalid = TRUE;
 	    }
 	}
     }
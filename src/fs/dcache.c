@@ -0,0 +1,169 @@
+/* dcache.c -- Directory name-lookup cache.
+
+   Remembers the result of looking up a name in a directory, whether
+   the name existed (and its inode number) or not, so that repeated
+   path lookups don't have to scan the directory's blocks. Entries are
+   keyed by device, directory inode number and name. */
+
+#include <vmm/fs.h>
+#include <vmm/string.h>
+#include <vmm/kernel.h>
+
+struct dcache_entry {
+    list_node_t node;			/* in the LRU list */
+    struct dcache_entry *hash_next;
+    struct fs_device *dev;		/* NULL if unused */
+    u_long dir;
+    u_long inum;			/* or DCACHE_NEGATIVE */
+    char name[NAME_MAX + 1];
+};
+
+static struct dcache_entry dcache_pool[NR_DCACHE];
+static struct dcache_entry *dcache_table[DCACHE_BUCKETS];
+static list_t dcache_lru;		/* MRU first */
+
+u_long dcache_hits, dcache_misses;
+
+static inline u_long
+dcache_hash(struct fs_device *dev, u_long dir, const char *name)
+{
+    u_long h = (u_long)dev + (dir * 31);
+    while(*name)
+	h = (h * 33) + (u_char)*name++;
+    return h % DCACHE_BUCKETS;
+}
+
+void
+init_dcache(void)
+{
+    int i;
+    init_list(&dcache_lru);
+    for(i = 0; i < DCACHE_BUCKETS; i++)
+	dcache_table[i] = NULL;
+    for(i = 0; i < NR_DCACHE; i++)
+    {
+	dcache_pool[i].dev = NULL;
+	append_node(&dcache_lru, &dcache_pool[i].node);
+    }
+}
+
+/* This should be called in the middle of a forbid(). */
+static struct dcache_entry *
+find_dcache(struct fs_device *dev, u_long dir, const char *name)
+{
+    struct dcache_entry *de = dcache_table[dcache_hash(dev, dir, name)];
+    while(de != NULL)
+    {
+	if((de->dev == dev) && (de->dir == dir) && !strcmp(de->name, name))
+	    return de;
+	de = de->hash_next;
+    }
+    return NULL;
+}
+
+/* Take the entry DE out of its hash chain and put it at the end of the
+   LRU list, ready for reuse. This should be called in the middle of a
+   forbid(). */
+static void
+drop_dcache(struct dcache_entry *de)
+{
+    struct dcache_entry **ptr;
+    if(de->dev == NULL)
+	return;
+    ptr = &dcache_table[dcache_hash(de->dev, de->dir, de->name)];
+    while(*ptr != NULL)
+    {
+	if(*ptr == de)
+	{
+	    *ptr = de->hash_next;
+	    break;
+	}
+	ptr = &(*ptr)->hash_next;
+    }
+    de->dev = NULL;
+    remove_node(&de->node);
+    append_node(&dcache_lru, &de->node);
+}
+
+/* Look for NAME in the directory whose inode number is DIR on device DEV.
+   Returns TRUE if the cache knows the answer, in which case *INUMP is set
+   to the inode number of NAME or DCACHE_NEGATIVE if NAME doesn't exist. */
+bool
+dcache_lookup(struct fs_device *dev, u_long dir, const char *name,
+	      u_long *inump)
+{
+    struct dcache_entry *de;
+    FORBID();
+    de = find_dcache(dev, dir, name);
+    if(de == NULL)
+    {
+	dcache_misses++;
+	PERMIT();
+	return FALSE;
+    }
+    remove_node(&de->node);
+    prepend_node(&dcache_lru, &de->node);
+    *inump = de->inum;
+    dcache_hits++;
+    PERMIT();
+    return TRUE;
+}
+
+/* Record that NAME in directory DIR of device DEV refers to inode INUM,
+   or if INUM is DCACHE_NEGATIVE that it doesn't exist. */
+void
+dcache_enter(struct fs_device *dev, u_long dir, const char *name,
+	     u_long inum)
+{
+    struct dcache_entry *de;
+    u_long h;
+    if(strlen(name) > NAME_MAX)
+	return;
+    FORBID();
+    de = find_dcache(dev, dir, name);
+    if(de == NULL)
+    {
+	/* Reuse the least recently used entry. */
+	de = (struct dcache_entry *)dcache_lru.tailpred;
+	drop_dcache(de);
+	de->dev = dev;
+	de->dir = dir;
+	strcpy(de->name, name);
+	h = dcache_hash(dev, dir, name);
+	de->hash_next = dcache_table[h];
+	dcache_table[h] = de;
+    }
+    de->inum = inum;
+    remove_node(&de->node);
+    prepend_node(&dcache_lru, &de->node);
+    PERMIT();
+}
+
+/* Forget anything cached about the contents of directory DIR of device
+   DEV; called when its inode is freed. */
+void
+dcache_invalidate_dir(struct fs_device *dev, u_long dir)
+{
+    int i;
+    FORBID();
+    for(i = 0; i < NR_DCACHE; i++)
+    {
+	if((dcache_pool[i].dev == dev) && (dcache_pool[i].dir == dir))
+	    drop_dcache(&dcache_pool[i]);
+    }
+    PERMIT();
+}
+
+/* Forget everything cached about device DEV. */
+void
+dcache_invalidate_device(struct fs_device *dev)
+{
+    int i;
+    FORBID();
+    for(i = 0; i < NR_DCACHE; i++)
+    {
+	if(dcache_pool[i].dev == dev)
+	    drop_dcache(&dcache_pool[i]);
+    }
+    PERMIT();
+}
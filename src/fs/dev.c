@@ -36,7 +36,13 @@ alloc_device(void)
     FORBID();
     dev = dev_free_list;
     if(dev != NULL)
+    {
 	dev_free_list = dev->next;
+	/* Optional, so drivers that don't know about them needn't
+	   set them. */
+	dev->read_blocks_v = NULL;
+	dev->write_blocks_v = NULL;
+    }
     PERMIT();
     return dev;
 }
@@ -73,6 +79,10 @@ bool
 add_device(struct fs_device *dev)
 {
     dev->root = NULL;
+    dev->dirty_list = NULL;
+    dev->dirty_count = 0;
+    dev->free_map = NULL;
+    dev->group_free = NULL;
     dev->use_count = 1;
     dev->invalid = TRUE;
     FORBID();
@@ -112,6 +122,8 @@ release_device(struct fs_device *dev)
     if(--dev->use_count <= 0)
     {
 	/* Last one out turn off the light.. */
+	if(!dev->invalid)
+	    sync_buffers(dev);
 	invalidate_device(dev);
 	kprintf("fs: Device `%s' has been discarded.\n", dev->name);
 	free_device(dev);
@@ -159,8 +171,13 @@ read_meta_data(struct fs_device *dev)
 	ERRNO = -result;
 	return FALSE;
     }
-    if((tmp_bb.magic != FS_BOOT_MAGIC)
-       && (tmp_bb.magic != FS_NOBOOT_MAGIC))
+    if((tmp_bb.magic == FS_BOOT_MAGIC_V2)
+       || (tmp_bb.magic == FS_NOBOOT_MAGIC_V2))
+	dev->version = FS_VERSION_2;
+    else if((tmp_bb.magic == FS_BOOT_MAGIC)
+	    || (tmp_bb.magic == FS_NOBOOT_MAGIC))
+	dev->version = FS_VERSION_1;
+    else
     {
 	kprintf("fs: Warning bad magic number on device `%s'\n", dev->name);
 	ERRNO = E_BADMAGIC;
@@ -186,6 +203,8 @@ invalidate_device(struct fs_device *dev)
 	dev->invalid = TRUE;
 	flush_device_cache(dev, TRUE);
 	invalidate_device_inodes(dev);
+	dcache_invalidate_device(dev);
+	discard_free_map(dev);
     }
 }
 
@@ -23,23 +23,34 @@ static struct dir_entry_blk tmp_dir_blk;
 #define MAX_SYMLINK_DEPTH 8
 
 /* Return an inode pointing at the file called NAME in the directory
-   DIR, or NULL if no such file exists.
+   DIR, or NULL if no such file exists. The name cache is consulted
+   first, the result of scanning the directory is added to it.
    Note that the position of DIR on exiting this function is undefined. */
 static struct core_inode *
 find_file_entry(struct file *dir, const char *name)
 {
     long tmp;
     size_t dir_len = dir->inode->inode.size;
+    u_long inum;
     if(!F_IS_DIR(dir))
     {
 	ERRNO = E_NOTDIR;
 	return NULL;
     }
+    if(dcache_lookup(dir->inode->dev, dir->inode->inum, name, &inum))
+    {
+	if(inum == DCACHE_NEGATIVE)
+	{
+	    ERRNO = E_NOEXIST;
+	    return NULL;
+	}
+	return make_inode(dir->inode->dev, inum);
+    }
     seek_file(dir, 0, SEEK_ABS);
     while(dir_len > 0)
     {
 	size_t i;
-	tmp = read_file(&tmp_dir_blk, max(dir_len, FS_BLKSIZ), dir);
+	tmp = read_file(&tmp_dir_blk, min(dir_len, FS_BLKSIZ), dir);
 	if(tmp < 0)
 	    return NULL;
 	for(i = 0; i < (tmp / sizeof(struct dir_entry)); i++)
@@ -47,12 +58,14 @@ find_file_entry(struct file *dir, const char *name)
 	    if((tmp_dir_blk.entries[i].name[0] != 0)
 	       && !strcmp(name, tmp_dir_blk.entries[i].name))
 	    {
-		return make_inode(dir->inode->dev,
-				  tmp_dir_blk.entries[i].inum);
+		inum = tmp_dir_blk.entries[i].inum;
+		dcache_enter(dir->inode->dev, dir->inode->inum, name, inum);
+		return make_inode(dir->inode->dev, inum);
 	    }
 	}
 	dir_len -= tmp;
     }
+    dcache_enter(dir->inode->dev, dir->inode->inum, name, DCACHE_NEGATIVE);
     ERRNO = E_NOEXIST;
     return NULL;
 }
@@ -76,7 +89,7 @@ create_file_entry(struct file *dir, const char *name, long inum)
     while(dir_len > 0)
     {
 	size_t i;
-	tmp = read_file(&tmp_dir_blk, max(dir_len, FS_BLKSIZ), dir);
+	tmp = read_file(&tmp_dir_blk, min(dir_len, FS_BLKSIZ), dir);
 	if(tmp < 0)
 	    return tmp;
 	for(i = 0; i < (tmp / sizeof(struct dir_entry)); i++)
@@ -99,6 +112,7 @@ create_file_entry(struct file *dir, const char *name, long inum)
     tmp_entry.inum = inum;
     if(write_file(&tmp_entry, sizeof(tmp_entry), dir) < 0)
 	return FALSE;
+    dcache_enter(dir->inode->dev, dir->inode->inum, name, inum);
     return TRUE;
 }
 
@@ -120,7 +134,7 @@ delete_file_entry(struct file *dir, const char *name)
     while(dir_len > 0)
     {
 	size_t i;
-	tmp = read_file(&tmp_dir_blk, max(dir_len, FS_BLKSIZ), dir);
+	tmp = read_file(&tmp_dir_blk, min(dir_len, FS_BLKSIZ), dir);
 	if(tmp < 0)
 	    return tmp;
 	for(i = 0; i < (tmp / sizeof(struct dir_entry)); i++)
@@ -134,6 +148,8 @@ delete_file_entry(struct file *dir, const char *name)
 		tmp_dir_blk.entries[i].inum = 0;
 		if(write_file(&tmp_dir_blk.entries[i], sizeof(struct dir_entry), dir) < 0)
 		    return -1;
+		dcache_enter(dir->inode->dev, dir->inode->inum, name,
+			     DCACHE_NEGATIVE);
 		return inum;
 	    }
 	}
@@ -255,7 +271,7 @@ directory_empty_p(struct file *dir)
     while(dir_len > 0)
     {
 	size_t i;
-	tmp = read_file(&tmp_dir_blk, max(dir_len, FS_BLKSIZ), dir);
+	tmp = read_file(&tmp_dir_blk, min(dir_len, FS_BLKSIZ), dir);
 	if(tmp < 0)
 	    return FALSE;
 	for(i = 0; i < (tmp / sizeof(struct dir_entry)); i++)
@@ -443,6 +459,11 @@ create_file(const char *name, u_long attr)
 		if(tmp != NULL)
 		{
 		    memset(&tmp->inode, 0, sizeof(struct inode));
+		    if(dir->inode->dev->version >= FS_VERSION_2)
+			attr |= ATTR_EXTENTS;
+		    tmp->inode.attr = attr & ATTR_EXTENTS;
+		    tmp->nr_extents = 0;
+		    tmp->last_extent.length = 0;
 		    tmp->inode.modtime = current_time();
 		    tmp->dirty = TRUE;
 		    file = make_file(tmp);
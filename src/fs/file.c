@@ -57,6 +57,9 @@ make_file(struct core_inode *inode)
     file->inode = dup_inode(inode);
     file->mode = F_READ | F_WRITE;
     file->pos = 0;
+    file->ra_next = 0;
+    file->ra_end = 0;
+    file->ra_window = 0;
     return file;
 }
 
@@ -133,8 +136,77 @@ seek_file(struct file *file, u_long arg, int type)
 	return file->pos = new_pos;
 }
 
+/* Called by read_file() each time it moves on to a new logical block BLK
+   of FILE. If the file is being read sequentially the blocks following
+   BLK are read into the buffer-cache ahead of time, each physically
+   contiguous run of them with a single device access. The read-ahead
+   window grows while the file continues to be read sequentially and is
+   dropped as soon as it isn't. */
+static void
+read_ahead(struct file *file, blkno blk)
+{
+    struct core_inode *inode = file->inode;
+    blkno last, lblk, run_start = 0;
+    int run_len = 0;
+    if(blk != file->ra_next)
+    {
+	/* Random access. */
+	file->ra_next = blk + 1;
+	file->ra_end = 0;
+	file->ra_window = 0;
+	return;
+    }
+    file->ra_next = blk + 1;
+    /* Wait until the reader is half way through the blocks already
+       read ahead before reading any more. */
+    if(file->ra_end > blk + (file->ra_window / 2))
+	return;
+    if(file->ra_window == 0)
+	file->ra_window = RA_MIN_BLOCKS;
+    else if(file->ra_window < RA_MAX_BLOCKS)
+	file->ra_window *= 2;
+    lblk = max(blk + 1, file->ra_end);
+    last = min(blk + 1 + file->ra_window,
+	       (inode->inode.size + FS_BLKSIZ - 1) / FS_BLKSIZ);
+    for(; lblk < last; lblk++)
+    {
+	blkno phys = get_data_blkno(inode, lblk, FALSE);
+	if((run_len > 0) && (phys == run_start + run_len))
+	{
+	    run_len++;
+	    continue;
+	}
+	if(run_len > 0)
+	    bread_ahead(inode->dev, run_start, run_len);
+	run_start = phys;
+	run_len = (phys != 0) ? 1 : 0;
+    }
+    if(run_len > 0)
+	bread_ahead(inode->dev, run_start, run_len);
+    file->ra_end = last;
+}
+
+/* Find how many of the COUNT logical blocks of INODE starting at BLK are
+   stored contiguously, setting *PHYSP to the physical block of the first.
+   If CREATE is TRUE missing blocks are allocated. Returns zero if BLK
+   isn't mapped or an error occurs. */
+static int
+map_block_run(struct core_inode *inode, blkno blk, int count, blkno *physp,
+	      bool create)
+{
+    blkno phys = get_data_blkno(inode, blk, create);
+    int n = 1;
+    if(phys == 0)
+	return 0;
+    while((n < count) && (get_data_blkno(inode, blk + n, create) == phys + n))
+	n++;
+    *physp = phys;
+    return n;
+}
+
 /* Read LEN bytes from FILE into BUF. Either the number of bytes actually
-   read, or a negative error code is returned. */
+   read, or a negative error code is returned. If FILE was opened with
+   F_DIRECT whole blocks are read straight into BUF, not via the cache. */
 long
 read_file(void *buf, size_t len, struct file *file)
 {
@@ -156,6 +228,26 @@ read_file(void *buf, size_t len, struct file *file)
 	if(file->pos + this_read > file->inode->inode.size)
 	    this_read = file->inode->inode.size - file->pos;
 	DB(("read_file: this_read=%d pos=%d\n", this_read, file->pos));
+	if((file->mode & F_DIRECT) && (this_read == FS_BLKSIZ))
+	{
+	    blkno phys;
+	    int count = min(len, file->inode->inode.size - file->pos) / FS_BLKSIZ;
+	    count = map_block_run(file->inode, file->pos / FS_BLKSIZ,
+				  min(count, DIRECT_MAX_BLOCKS), &phys, FALSE);
+	    if(count > 0)
+	    {
+		if(!bread_direct(file->inode->dev, phys, buf, count))
+		    return (actual > 0) ? actual : -ERRNO;
+		buf += count * FS_BLKSIZ;
+		len -= count * FS_BLKSIZ;
+		actual += count * FS_BLKSIZ;
+		file->pos += count * FS_BLKSIZ;
+		continue;
+	    }
+	    /* Otherwise it's sparse or an error; handled below. */
+	}
+	else if((file->pos / FS_BLKSIZ) + 1 != file->ra_next)
+	    read_ahead(file, file->pos / FS_BLKSIZ);
 	blk = get_data_block(file->inode, file->pos / FS_BLKSIZ, FALSE);
 	if(blk == NULL)
 	{
@@ -171,7 +263,7 @@ read_file(void *buf, size_t len, struct file *file)
 	}
 	else
 	{
-	    memcpy(buf, &blk->buf.data[file->pos % FS_BLKSIZ], this_read);
+	    memcpy(buf, &blk->buf->data[file->pos % FS_BLKSIZ], this_read);
 	    brelse(blk);
 	}
 	buf += this_read;
@@ -184,7 +276,9 @@ read_file(void *buf, size_t len, struct file *file)
 }
 
 /* Write LEN bytes from BUF to FILE. Either the number of bytes actually
-   written, or a negative error code is returned. */
+   written, or a negative error code is returned. If FILE was opened with
+   F_DIRECT whole blocks are written straight from BUF, not via the
+   cache. */
 long
 write_file(const void *buf, size_t len, struct file *file)
 {
@@ -200,7 +294,18 @@ write_file(const void *buf, size_t len, struct file *file)
     while(len > 0)
     {
 	long this_write = min(len, FS_BLKSIZ - (file->pos % FS_BLKSIZ));
-	if(this_write == FS_BLKSIZ)
+	if((file->mode & F_DIRECT) && (this_write == FS_BLKSIZ))
+	{
+	    blkno phys;
+	    int count = map_block_run(file->inode, file->pos / FS_BLKSIZ,
+				      min(len / FS_BLKSIZ, DIRECT_MAX_BLOCKS),
+				      &phys, TRUE);
+	    if((count == 0)
+	       || !bwrite_direct(file->inode->dev, phys, buf, count))
+		goto error;
+	    this_write = count * FS_BLKSIZ;
+	}
+	else if(this_write == FS_BLKSIZ)
 	{
 	    /* A whole block; use bwrite() to save unnecessary block
 	       reads. */
@@ -214,7 +319,7 @@ write_file(const void *buf, size_t len, struct file *file)
 						  file->pos / FS_BLKSIZ, TRUE);
 	    if(blk != NULL)
 	    {
-		memcpy(&blk->buf.data[file->pos % FS_BLKSIZ], buf, this_write);
+		memcpy(&blk->buf->data[file->pos % FS_BLKSIZ], buf, this_write);
 		bdirty(blk, FALSE);
 		brelse(blk);
 	    }
@@ -263,20 +368,20 @@ delete_indirect_blocks(struct core_inode *inode, blkno blk, int depth)
     }
     for(i = 0; i < PTRS_PER_INDIRECT; i++)
     {
-	if(ind_blk->buf.ind.data[i] != 0)
+	if(ind_blk->buf->ind.data[i] != 0)
 	{
 	    if(depth == 0)
-		free_block(inode->dev, ind_blk->buf.ind.data[i]);
+		free_block(inode->dev, ind_blk->buf->ind.data[i]);
 	    else
 	    {
-		if(!delete_indirect_blocks(inode, ind_blk->buf.ind.data[i],
+		if(!delete_indirect_blocks(inode, ind_blk->buf->ind.data[i],
 					   depth - 1))
 		{
 		    rc = FALSE;
 		    break;
 		}
 	    }
-	    ind_blk->buf.ind.data[i] = 0;
+	    ind_blk->buf->ind.data[i] = 0;
 	    bdirty(ind_blk, FALSE);
 	}
     }
@@ -298,6 +403,9 @@ delete_inode_data(struct core_inode *inode)
 	ERRNO = E_INVALID;
 	return FALSE;
     }
+    /* This leaves DATA cleared, so the rest is a no-op for extents. */
+    if((inode->inode.attr & ATTR_EXTENTS) && !delete_extents(inode))
+	return FALSE;
     for(i = 0; i < SINGLE_INDIRECT; i++)
     {
 	if(inode->inode.data[i] != 0)
@@ -361,6 +469,88 @@ set_file_size(struct file *file, size_t size)
     return TRUE;
 }
 
+/* Make sure that the first SIZE bytes of FILE have data blocks allocated
+   to them, extending the file if it's shorter than SIZE. As far as
+   possible the new blocks are taken from a single free run of the device,
+   so that the file is stored contiguously. If FLAGS contains PREALLOC_ZERO
+   the new blocks are filled with zeros, otherwise their contents are
+   whatever was on the disk. Returns FALSE if an error occurs. */
+bool
+preallocate_file(struct file *file, size_t size, u_long flags)
+{
+    static blk zero_blks[PREALLOC_ZERO_BLOCKS];
+    struct core_inode *inode;
+    blkno i, last, count = 0, run_start = 0;
+    int run_len = 0;
+    if(file == NULL)
+    {
+	ERRNO = E_BADARG;
+	return FALSE;
+    }
+    if(!(file->mode & F_WRITE))
+    {
+	ERRNO = E_PERM;
+	return FALSE;
+    }
+    if(!test_media(file->inode->dev))
+	return FALSE;
+    inode = file->inode;
+    if(inode->invalid)
+    {
+	ERRNO = E_INVALID;
+	return FALSE;
+    }
+    last = (size + FS_BLKSIZ - 1) / FS_BLKSIZ;
+    for(i = 0; i < last; i++)
+    {
+	if(get_data_blkno(inode, i, FALSE) == 0)
+	{
+	    if(ERRNO != E_NOEXIST)
+		return FALSE;
+	    count++;
+	}
+    }
+    if(count > 0)
+    {
+	/* Leave room for any indirect blocks as well. */
+	plan_allocation(inode->dev, count + (count / PTRS_PER_INDIRECT) + 3);
+	for(i = 0; i < last; i++)
+	{
+	    blkno blk;
+	    if(get_data_blkno(inode, i, FALSE) != 0)
+		continue;
+	    blk = get_data_blkno(inode, i, TRUE);
+	    if(blk == 0)
+		return FALSE;
+	    if(!(flags & PREALLOC_ZERO))
+		continue;
+	    /* Zero the new blocks in physically contiguous runs, straight
+	       to the disk so that the cache isn't flooded with them. */
+	    if((run_len > 0) && (blk == run_start + run_len)
+	       && (run_len < PREALLOC_ZERO_BLOCKS))
+	    {
+		run_len++;
+		continue;
+	    }
+	    if((run_len > 0)
+	       && !bwrite_direct(inode->dev, run_start, zero_blks, run_len))
+		return FALSE;
+	    run_start = blk;
+	    run_len = 1;
+	}
+	if((run_len > 0)
+	   && !bwrite_direct(inode->dev, run_start, zero_blks, run_len))
+	    return FALSE;
+    }
+    if(size > inode->inode.size)
+    {
+	inode->inode.size = size;
+	inode->inode.modtime = current_time();
+	inode->dirty = TRUE;
+    }
+    return write_inode(inode);
+}
+
 bool
 set_file_modes(const char *name, u_long mode)
 {
@@ -19,6 +19,7 @@
 #ifndef TEST
 # define current_time kernel->current_time
 # define expand_time kernel->expand_time
+# define strtoul kernel->strtoul
 # define SHELL sh->shell
 #else
 # define SHELL shell
@@ -446,8 +447,76 @@ cmd_bufstats(struct shell *sh, __attribute__ ((unused)) int argc,
 {
     SHELL->printf(sh, "  Total block accesses: %-8d\n"
 		  "       Cached accesses: %-8d\n"
-		  "Discarded dirty blocks: %-8d\n",
-		  total_accessed, cached_accesses, dirty_accesses);
+		  "Discarded dirty blocks: %-8d\n"
+		  "         Cached blocks: %d (min %d, max %d)\n"
+		  "          Hash buckets: %-8d\n"
+		  "          Dirty blocks: %-8d\n"
+		  "        Flushed blocks: %d in %d writes\n"
+		  "     Read-ahead blocks: %d in %d reads\n"
+		  "       Name cache hits: %d (%d misses)\n"
+		  "         Cached inodes: %d (%d unused, max %d)\n"
+		  "      Direct transfers: %d blocks read, %d written\n",
+		  total_accessed, cached_accesses, dirty_accesses,
+		  nr_buffers, min_buffers, max_buffers, buffer_buckets,
+		  total_dirty, flushed_blocks, flush_writes,
+		  readahead_blocks, readahead_reads,
+		  dcache_hits, dcache_misses,
+		  nr_inodes, unused_inodes, max_inodes,
+		  direct_reads, direct_writes);
+    return RC_OK;
+}
+
+#define DOC_sync "sync [DEVICE-NAME]\n\
+Write all modified blocks in the buffer-cache back to their devices, or\n\
+only those of the device called DEVICE-NAME."
+int
+cmd_sync(struct shell *sh, int argc, char **argv)
+{
+    if(argc == 1)
+    {
+	struct fs_device *dev;
+	char *tmp = strchr(argv[0], ':');
+	if(tmp != NULL)
+	    *tmp = 0;
+	dev = get_device(argv[0]);
+	if(dev == NULL)
+	{
+	    SHELL->printf(sh, "Can't find device, %s:\n", argv[0]);
+	    return RC_FAIL;
+	}
+	sync_buffers(dev);
+	release_device(dev);
+    }
+    else if(argc == 0)
+	sync_buffers(NULL);
+    else
+	return SHELL->arg_error(sh);
+    return RC_OK;
+}
+
+#define DOC_bufsize "bufsize [MAX-BLOCKS [MIN-BLOCKS]]\n\
+Set the maximum (and optionally the minimum) number of blocks the\n\
+buffer-cache may hold. With no arguments prints the current limits."
+int
+cmd_bufsize(struct shell *sh, int argc, char **argv)
+{
+    u_long max, min = min_buffers;
+    if(argc == 0)
+    {
+	SHELL->printf(sh, "%d blocks cached, min %d, max %d\n",
+		      nr_buffers, min_buffers, max_buffers);
+	return RC_OK;
+    }
+    if(argc > 2)
+	return SHELL->arg_error(sh);
+    max = strtoul(argv[0], NULL, 0);
+    if(argc == 2)
+	min = strtoul(argv[1], NULL, 0);
+    if(!set_buffer_limits(min, max))
+    {
+	SHELL->perror(sh, "bufsize");
+	return RC_FAIL;
+    }
     return RC_OK;
 }
 
@@ -509,13 +578,20 @@ cmd_umount(struct shell *sh, int argc, char **argv)
 }
 
 
-#define DOC_mkfs "mkfs [-hd PARTITION-NAME [RESERVED-BLOCKS]]\n\
+#define DOC_mkfs "mkfs [-2] [-hd PARTITION-NAME [RESERVED-BLOCKS]]\n\
 Create a new file system structure on the hard-disk partition called\n\
-PARTITION-NAME."
+PARTITION-NAME. With the `-2' option a version 2 file system is made,\n\
+whose files are stored as extents."
 int
 cmd_mkfs(struct shell *sh, int argc, char **argv)
 {
     int rc = 0;
+    int version = FS_VERSION_1;
+    if(argc >= 1 && !strcmp("-2", argv[0]))
+    {
+	version = FS_VERSION_2;
+	argc--; argv++;
+    }
     if(argc >= 2)
     {
 	if(!strcmp("-hd", argv[0]))
@@ -533,8 +609,8 @@ cmd_mkfs(struct shell *sh, int argc, char **argv)
 		    rc = RC_FAIL;
 		}
 		if(argc > 2)
-		    reserved = kernel->strtoul(argv[2], NULL, 0);
-		if(!hd->mkfs_partition(p, reserved))
+		    reserved = strtoul(argv[2], NULL, 0);
+		if(!hd->mkfs_partition(p, reserved, version))
 		    rc = RC_FAIL;
 		kernel->close_module((struct module *)hd);
 	    }
@@ -551,6 +627,7 @@ struct shell_cmds fs_cmds =
     0,
     { CMD(cp), CMD(type), CMD(ls), CMD(cd), CMD(ln), CMD(mkdir),
       CMD(rm), CMD(rmdir), CMD(mv), CMD(devinfo), CMD(bufstats),
+      CMD(bufsize), CMD(sync),
 #ifdef TEST
       CMD(ucp),
 #else
@@ -13,7 +13,8 @@ struct fs_module fs_module = {
 
     /* Filesystem functions. */
     create_file, open_file, close_file, read_file, write_file, seek_file,
-    dup_file, truncate_file, set_file_size, make_link, remove_link,
+    dup_file, truncate_file, set_file_size, preallocate_file, make_link,
+    remove_link,
     set_file_modes, make_directory, remove_directory, get_current_dir,
     swap_current_dir, make_symlink, mkfs,
 
@@ -40,6 +41,7 @@ fs_init(void)
 #endif
     init_devices();
     init_buffers();
+    init_dcache();
     init_inodes();
     init_files();
     add_fs_commands();
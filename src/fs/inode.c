@@ -8,48 +8,139 @@
 
 #ifndef TEST
 #define kprintf kernel->printf
+#define malloc kernel->malloc
+#define free kernel->free
+#else
+#include <stdlib.h>
 #endif
 
 
 /* In-core inode handling. */
 
-static struct core_inode inode_pool[NR_INODES];
-static struct core_inode *inode_free_list;
-static struct core_inode *inode_open_list;
+/* Every in-core inode is in the hash table. Those with no references
+   are also kept in INODE-LRU (most recently used first), they're only
+   reused or freed when the cache is full or memory is short. */
+static struct core_inode *inode_table[INODE_BUCKETS];
+static list_t inode_lru;
+
+#define INODE_HASH(dev, inum) (((u_long)(dev) + (inum)) & (INODE_BUCKETS - 1))
+
+/* Number of in-core inodes, and the number of them with no references. */
+u_long nr_inodes, max_inodes, unused_inodes;
 
 void
 init_inodes(void)
 {
     int i;
-    for(i = 0; i < (NR_INODES - 1); i++)
-	inode_pool[i].next = &inode_pool[i+1];
-    inode_pool[i].next = 0;
-    inode_free_list = inode_pool;
-    inode_open_list = NULL;
+    for(i = 0; i < INODE_BUCKETS; i++)
+	inode_table[i] = NULL;
+    init_list(&inode_lru);
+    nr_inodes = unused_inodes = 0;
+#ifndef TEST
+    max_inodes = kernel->free_page_count() / INODE_RAM_FRACTION;
+#else
+    max_inodes = 0;
+#endif
+    if(max_inodes < INODE_MIN)
+	max_inodes = INODE_MIN;
 }
 
 void
 kill_inodes(void)
 {
     struct core_inode *inode;
+    int i;
     FORBID();
-    inode = inode_open_list;
-    while(inode != NULL)
+    for(i = 0; i < INODE_BUCKETS; i++)
     {
-	if(!inode->invalid)
-	    write_inode(inode);
-	inode = inode->next;
+	for(inode = inode_table[i]; inode != NULL; inode = inode->hash_next)
+	{
+	    if(!inode->invalid)
+		write_inode(inode);
+	}
     }
     PERMIT();
 }
 
+/* This should be called in the middle of a forbid(). */
+static void
+unhash_inode(struct core_inode *inode)
+{
+    struct core_inode **x = &inode_table[INODE_HASH(inode->dev, inode->inum)];
+    while(*x != inode)
+	x = &(*x)->hash_next;
+    *x = inode->hash_next;
+}
+
+/* Throw away the unreferenced in-core inode INODE. This should be called
+   in the middle of a forbid(). */
+static void
+discard_inode(struct core_inode *inode)
+{
+    remove_node(&inode->node);
+    unused_inodes--;
+    unhash_inode(inode);
+    nr_inodes--;
+    free(inode);
+}
+
+/* Free unreferenced in-core inodes, least recently used first, until
+   there are no more than TARGET in-core inodes or none of them are
+   unreferenced. */
+void
+shrink_inodes(u_long target)
+{
+    FORBID();
+    while((nr_inodes > target) && !list_empty_p(&inode_lru))
+	discard_inode((struct core_inode *)inode_lru.tailpred);
+    PERMIT();
+}
+
+/* Return an in-core inode that isn't in use, either the least recently
+   used unreferenced inode or a newly allocated one. This should be called
+   in the middle of a forbid(). */
+static struct core_inode *
+get_free_inode(void)
+{
+    struct core_inode *inode;
+    if(nr_inodes < max_inodes
+#ifndef TEST
+       && kernel->free_page_count() >= BUFFER_RESERVE_PAGES
+#endif
+       )
+    {
+	inode = malloc(sizeof(struct core_inode));
+	if(inode != NULL)
+	{
+	    nr_inodes++;
+	    return inode;
+	}
+    }
+    if(!list_empty_p(&inode_lru))
+    {
+	inode = (struct core_inode *)inode_lru.tailpred;
+	remove_node(&inode->node);
+	unused_inodes--;
+	unhash_inode(inode);
+	return inode;
+    }
+    /* Every cached inode is in use; exceed the limit rather than fail. */
+    inode = malloc(sizeof(struct core_inode));
+    if(inode != NULL)
+	nr_inodes++;
+    else
+	ERRNO = E_NOMEM;
+    return inode;
+}
+
 /* Return an inode structure containing inode number INUM on device
    DEV, or NULL for an error. */
 struct core_inode *
 make_inode(struct fs_device *dev, u_long inum)
 {
     struct core_inode *inode;
-    DB(("make_inode: dev=%s inum=%d inode=%p\n", dev->name, inum, inode));
+    u_long hash = INODE_HASH(dev, inum);
+    DB(("make_inode: dev=%s inum=%d\n", dev->name, inum));
     if(!test_media(dev))
 	return NULL;
     FORBID();
@@ -57,7 +148,7 @@ make_inode(struct fs_device *dev, u_long inum)
 #ifndef TEST
 again:
 #endif
-    inode = inode_open_list;
+    inode = inode_table[hash];
     while(inode != NULL)
     {
 	if((inode->inum == inum) && (inode->dev == dev))
@@ -71,7 +162,13 @@ again:
 		    goto again;
 		}
 #endif
-		inode->use_count++;
+		if(inode->use_count++ == 0)
+		{
+		    /* Reclaim it from the unused list. */
+		    remove_node(&inode->node);
+		    unused_inodes--;
+		    dev->use_count++;
+		}
 		PERMIT();
 		DB(("make_inode: got cached inode, %p\n", inode));
 		return inode;
@@ -80,38 +177,39 @@ again:
 	       there may be a valid one further down the list, otherwise
 	       we'll just create a fresh one. */
 	}
-	inode = inode->next;
+	inode = inode->hash_next;
     }
-    inode = inode_free_list;
+    inode = get_free_inode();
     if(inode == NULL)
     {
-	ERRNO = E_NOMEM;
 	PERMIT();
 	return NULL;
     }
-    DB(("make_inode: got inode from free_list, %p free_list=%p", inode,
-	inode_free_list));
-    inode_free_list = inode->next;
-    inode->next = inode_open_list;
-    inode_open_list = inode;
+    DB(("make_inode: got free inode, %p\n", inode));
+    inode->hash_next = inode_table[hash];
+    inode_table[hash] = inode;
     inode->use_count = 1;
     inode->dev = dev;
     inode->inum = inum;
+    inode->dirty = FALSE;
     inode->invalid = FALSE;
+    inode->nr_extents = -1;
+    inode->last_extent.length = 0;
     dev->use_count++;
 #ifndef TEST
     inode->locked = TRUE;
+    inode->locked_tasks = NULL;
 #endif
     if(!read_inode(inode))
     {
 	DB(("make_inode: couldn't read_inode()\n"));
-	inode_open_list = inode->next;
-	inode->next = inode_free_list;
-	inode_free_list = inode;
+	unhash_inode(inode);
+	nr_inodes--;
 	release_device(dev);
 #ifndef TEST
 	kernel->wake_up_task_list(&inode->locked_tasks);
 #endif
+	free(inode);
 	inode = NULL;
     }
     else
@@ -138,7 +236,8 @@ dup_inode(struct core_inode *inode)
 
 /* Say that one person has finished with INODE. It's contents will be
    written to disk if modified and if no other references to INODE
-   exist it will be freed. */
+   exist it will be put on the list of unused inodes, where it stays
+   until its memory is needed. */
 void
 close_inode(struct core_inode *inode)
 {
@@ -146,55 +245,75 @@ close_inode(struct core_inode *inode)
 	return;
     if(!inode->invalid)
 	write_inode(inode);
+    FORBID();
     if(--inode->use_count == 0)
     {
-	struct core_inode **x;
-	FORBID();
-	x = &inode_open_list;
-	while(*x != inode)
-	    x = &(*x)->next;
-	*x = (*x)->next;
-	PERMIT();
+	struct fs_device *dev = inode->dev;
 
-	/* Only deallocate the inode on disk when no one has it open. */
-	if(!inode->invalid && inode->inode.nlinks == 0)
+	if(inode->invalid || inode->inode.nlinks == 0)
 	{
-	    delete_inode_data(inode);
-	    free_inode(inode->dev, inode->inum);
+	    /* Not worth keeping. Take it out of the cache first so that
+	       no one can find it while its data is being deleted. */
+	    unhash_inode(inode);
+	    /* Only deallocate the inode on disk when no one has it open. */
+	    if(!inode->invalid)
+	    {
+		delete_inode_data(inode);
+		free_inode(dev, inode->inum);
+	    }
+	    nr_inodes--;
+	    free(inode);
+	}
+	else
+	{
+	    prepend_node(&inode_lru, &inode->node);
+	    unused_inodes++;
+	    /* Trim the cache back to its limit if it was exceeded while
+	       every inode was referenced. */
+	    if(nr_inodes > max_inodes)
+		discard_inode((struct core_inode *)inode_lru.tailpred);
 	}
-
-	release_device(inode->dev);
-	FORBID();
-	inode->next = inode_free_list;
-	inode_free_list = inode;
 	PERMIT();
+	release_device(dev);
     }
+    else
+	PERMIT();
 }
 
 /* For every inode in memory pointing at device DEV, set its `invalid'
-   flag to TRUE. Returns TRUE if no inodes point at this device, FALSE
-   otherwise. */
+   flag to TRUE; those that aren't referenced are discarded. Returns
+   TRUE if no inodes point at this device, FALSE otherwise. */
 bool
 invalidate_device_inodes(struct fs_device *dev)
 {
     bool status = TRUE;
-    struct core_inode *inode;
+    struct core_inode *inode, *next;
+    int i;
     FORBID();
-    inode = inode_open_list;
-    while(inode != NULL)
+    for(i = 0; i < INODE_BUCKETS; i++)
     {
-	if(inode->dev == dev)
+	inode = inode_table[i];
+	while(inode != NULL)
 	{
-	    inode->invalid = TRUE;
-	    status = FALSE;
+	    next = inode->hash_next;
+	    if(inode->dev == dev)
+	    {
+		if(inode->use_count == 0)
+		    discard_inode(inode);
+		else
+		{
+		    inode->invalid = TRUE;
+		    status = FALSE;
+		}
+	    }
+	    inode = next;
 	}
-	inode = inode->next;
     }
     PERMIT();
     return status;
 }
 
-
+
 /* On-disk inode handling. */
 
 /* Return the inode number of a free inode. Or -1 if an error occurred. */
@@ -204,10 +323,12 @@ alloc_inode(struct fs_device *dev)
     return bmap_alloc(dev, dev->sup.inode_bitmap, dev->sup.num_inodes);
 }
 
-/* Free an inode allocated by alloc_inode(). */
+/* Free an inode allocated by alloc_inode(). Any cached names in it (if
+   it was a directory) are forgotten. */
 bool
 free_inode(struct fs_device *dev, u_long inum)
 {
+    dcache_invalidate_dir(dev, inum);
     return bmap_free(dev, dev->sup.inode_bitmap, inum);
 }
 
@@ -227,7 +348,7 @@ read_inode(struct core_inode *inode)
     if(buf == NULL)
 	return FALSE;
     memcpy(&inode->inode,
-	   &(buf->buf.inodes.inodes[inode->inum % INODES_PER_BLOCK]),
+	   &(buf->buf->inodes.inodes[inode->inum % INODES_PER_BLOCK]),
 	   sizeof(struct inode));
     inode->dirty = FALSE;
     brelse(buf);
@@ -251,10 +372,10 @@ write_inode(struct core_inode *inode)
 				     + inode->dev->sup.inodes);
 	if(buf == NULL)
 	    return FALSE;
-	memcpy(&(buf->buf.inodes.inodes[inode->inum % INODES_PER_BLOCK]),
+	memcpy(&(buf->buf->inodes.inodes[inode->inum % INODES_PER_BLOCK]),
 	       &inode->inode,
 	       sizeof(struct inode));
-	bdirty(buf, TRUE);
+	bdirty(buf, FALSE);
 	brelse(buf);
 	inode->dirty = FALSE;
     }
@@ -299,7 +420,7 @@ get_inode_blk(struct core_inode *inode, int offset, bool create, bool clr)
     buf = bread(inode->dev, blk);
     if(buf && clr && created)
     {
-	memset(&buf->buf.data, 0, FS_BLKSIZ);
+	memset(&buf->buf->data, 0, FS_BLKSIZ);
 	bdirty(buf, FALSE);
     }
     return buf;
@@ -310,17 +431,18 @@ static blkno
 get_indirect_blkno(struct core_inode *inode, struct buf_head *ind_buf,
 		   int offset, bool create, bool *created)
 {
-    blkno blk = ind_buf->buf.ind.data[offset];
+    blkno blk = ind_buf->buf->ind.data[offset];
     if(blk == 0)
     {
 	if(create)
 	{
 	    blk = alloc_block(inode->dev,
-			      (offset > 0) ? ind_buf->buf.ind.data[offset-1] : 0);
+			      (offset > 0) ? ind_buf->buf->ind.data[offset-1]
+			      : ind_buf->blkno);
 	    if(blk != 0)
 	    {
-		ind_buf->buf.ind.data[offset] = blk;
-		bdirty(ind_buf, TRUE);
+		ind_buf->buf->ind.data[offset] = blk;
+		bdirty(ind_buf, FALSE);
 		if(created)
 		    *created = TRUE;
 	    }
@@ -347,12 +469,306 @@ get_indirect_blk(struct core_inode *inode, struct buf_head *ind_buf,
     buf = bread(inode->dev, blk);
     if(buf && clr && created)
     {
-	memset(&buf->buf.data, 0, FS_BLKSIZ);
+	memset(&buf->buf->data, 0, FS_BLKSIZ);
 	bdirty(buf, FALSE);
     }
     return buf;
 }
 
+
+/* Extent-mapped inodes. */
+
+#define INODE_EXTENT(inode, i) (((struct extent *)(inode)->inode.data) + (i))
+
+/* Return a pointer to extent number I of INODE, or NULL. If the extent
+   lives in an extent block its buffer is stored in *BUFP, the caller must
+   release it with put_extent() or brelse(); otherwise *BUFP is set to
+   NULL. If CREATE is TRUE a missing extent block is allocated. */
+static struct extent *
+get_extent(struct core_inode *inode, int i, struct buf_head **bufp,
+	   bool create)
+{
+    struct buf_head *buf;
+    blkno *blkp;
+    *bufp = NULL;
+    if(i < INODE_EXTENTS)
+	return INODE_EXTENT(inode, i);
+    i -= INODE_EXTENTS;
+    blkp = &inode->inode.data[SINGLE_INDIRECT + (i / EXTENTS_PER_BLOCK)];
+    if(*blkp == 0)
+    {
+	if(!create)
+	{
+	    ERRNO = E_NOEXIST;
+	    return NULL;
+	}
+	*blkp = alloc_block(inode->dev,
+			    ((blkp > &inode->inode.data[SINGLE_INDIRECT])
+			     ? blkp[-1] : 0));
+	if(*blkp == 0)
+	    return NULL;
+	inode->dirty = TRUE;
+	buf = bread(inode->dev, *blkp);
+	if(buf == NULL)
+	    return NULL;
+	memset(&buf->buf->data, 0, FS_BLKSIZ);
+	bdirty(buf, FALSE);
+    }
+    else
+    {
+	buf = bread(inode->dev, *blkp);
+	if(buf == NULL)
+	    return NULL;
+    }
+    *bufp = buf;
+    return &buf->buf->extents.ext[i % EXTENTS_PER_BLOCK];
+}
+
+/* Finish modifying an extent of INODE got from get_extent(), BUF is the
+   buffer it returned. */
+static inline void
+put_extent(struct core_inode *inode, struct buf_head *buf)
+{
+    if(buf != NULL)
+    {
+	bdirty(buf, FALSE);
+	brelse(buf);
+    }
+    else
+	inode->dirty = TRUE;
+}
+
+/* Return the number of extents in INODE, or -1 if an error occurs. */
+static int
+count_extents(struct core_inode *inode)
+{
+    if(inode->nr_extents < 0)
+    {
+	struct buf_head *buf;
+	struct extent *e;
+	int i;
+	for(i = 0; i < (int)MAX_EXTENTS; i++)
+	{
+	    u_long length;
+	    e = get_extent(inode, i, &buf, FALSE);
+	    if(e == NULL)
+	    {
+		if(inode->inode.data[SINGLE_INDIRECT + ((i - INODE_EXTENTS)
+							/ EXTENTS_PER_BLOCK)])
+		    return -1;
+		break;
+	    }
+	    length = e->length;
+	    if(buf != NULL)
+		brelse(buf);
+	    if(length == 0)
+		break;
+	}
+	inode->nr_extents = i;
+    }
+    return inode->nr_extents;
+}
+
+/* Remove extent number I of the N extents of INODE, moving the following
+   extents down one. */
+static bool
+remove_extent(struct core_inode *inode, int i, int n)
+{
+    struct buf_head *buf;
+    struct extent *e, tmp;
+    for(; i < n; i++)
+    {
+	if(i + 1 < n)
+	{
+	    e = get_extent(inode, i + 1, &buf, FALSE);
+	    if(e == NULL)
+		return FALSE;
+	    tmp = *e;
+	    if(buf != NULL)
+		brelse(buf);
+	}
+	else
+	    tmp.logical = tmp.physical = tmp.length = 0;
+	e = get_extent(inode, i, &buf, FALSE);
+	if(e == NULL)
+	    return FALSE;
+	*e = tmp;
+	put_extent(inode, buf);
+    }
+    inode->nr_extents--;
+    return TRUE;
+}
+
+/* The equivalent of get_data_blkno() for an inode with the ATTR_EXTENTS
+   attribute. A new block which is contiguous with the extent before or
+   after it (on the disk as well as in the file) is added to that extent,
+   if it joins the two they're merged. Otherwise a new extent is inserted;
+   when an inode already has MAX_EXTENTS extents this fails with the
+   error E_TOOFRAG. */
+static blkno
+get_extent_blkno(struct core_inode *inode, blkno blk, bool create)
+{
+    struct buf_head *buf;
+    struct extent *e, prev, next;
+    bool join_prev, join_next;
+    blkno new;
+    int i, n;
+    /* Most accesses fall in the same extent as the last one. */
+    if((blk >= inode->last_extent.logical)
+       && ((blk - inode->last_extent.logical) < inode->last_extent.length))
+	return inode->last_extent.physical + (blk - inode->last_extent.logical);
+    n = count_extents(inode);
+    if(n < 0)
+	return 0;
+    prev.length = 0;
+    for(i = 0; i < n; i++)
+    {
+	e = get_extent(inode, i, &buf, FALSE);
+	if(e == NULL)
+	    return 0;
+	if(e->logical > blk)
+	{
+	    if(buf != NULL)
+		brelse(buf);
+	    break;
+	}
+	prev = *e;
+	if(buf != NULL)
+	    brelse(buf);
+	if((blk - prev.logical) < prev.length)
+	{
+	    inode->last_extent = prev;
+	    return prev.physical + (blk - prev.logical);
+	}
+    }
+    /* BLK isn't mapped; I is where its extent would go and PREV is the
+       extent before that (if PREV.LENGTH is non-zero). */
+    if(!create)
+    {
+	ERRNO = E_NOEXIST;
+	return 0;
+    }
+    new = alloc_block(inode->dev, ((prev.length != 0)
+				   ? prev.physical + (blk - prev.logical) - 1
+				   : 0));
+    if(new == 0)
+	return 0;
+    next.length = 0;
+    if(i < n)
+    {
+	e = get_extent(inode, i, &buf, FALSE);
+	if(e == NULL)
+	    goto error;
+	next = *e;
+	if(buf != NULL)
+	    brelse(buf);
+    }
+    join_prev = ((prev.length != 0) && (blk == prev.logical + prev.length)
+		 && (new == prev.physical + prev.length));
+    join_next = ((next.length != 0) && (blk + 1 == next.logical)
+		 && (new + 1 == next.physical));
+    if(join_prev)
+    {
+	/* Filling the gap between two extents makes them one. */
+	if(join_next && !remove_extent(inode, i, n))
+	    goto error;
+	e = get_extent(inode, i - 1, &buf, FALSE);
+	if(e == NULL)
+	    goto error;
+	e->length += 1 + (join_next ? next.length : 0);
+	inode->last_extent = *e;
+	put_extent(inode, buf);
+	return new;
+    }
+    if(join_next)
+    {
+	e = get_extent(inode, i, &buf, FALSE);
+	if(e == NULL)
+	    goto error;
+	e->logical--;
+	e->physical--;
+	e->length++;
+	inode->last_extent = *e;
+	put_extent(inode, buf);
+	return new;
+    }
+    if(n == (int)MAX_EXTENTS)
+    {
+	ERRNO = E_TOOFRAG;
+	goto error;
+    }
+    /* Move the following extents up one to make room. */
+    for(; n > i; n--)
+    {
+	struct extent tmp;
+	e = get_extent(inode, n - 1, &buf, FALSE);
+	if(e == NULL)
+	    goto error;
+	tmp = *e;
+	if(buf != NULL)
+	    brelse(buf);
+	e = get_extent(inode, n, &buf, TRUE);
+	if(e == NULL)
+	    goto error;
+	*e = tmp;
+	put_extent(inode, buf);
+    }
+    e = get_extent(inode, i, &buf, TRUE);
+    if(e == NULL)
+	goto error;
+    e->logical = blk;
+    e->physical = new;
+    e->length = 1;
+    inode->last_extent = *e;
+    put_extent(inode, buf);
+    inode->nr_extents++;
+    return new;
+
+error:
+    free_block(inode->dev, new);
+    return 0;
+}
+
+/* Free all the data blocks and extent blocks of the extent-mapped inode
+   INODE. */
+bool
+delete_extents(struct core_inode *inode)
+{
+    struct buf_head *buf;
+    struct extent *e;
+    bool rc = TRUE;
+    int i, n = count_extents(inode);
+    if(n < 0)
+	return FALSE;
+    for(i = 0; i < n; i++)
+    {
+	u_long j;
+	e = get_extent(inode, i, &buf, FALSE);
+	if(e == NULL)
+	{
+	    rc = FALSE;
+	    break;
+	}
+	for(j = 0; j < e->length; j++)
+	    free_block(inode->dev, e->physical + j);
+	if(buf != NULL)
+	    brelse(buf);
+    }
+    if(rc)
+    {
+	for(i = SINGLE_INDIRECT; i < SINGLE_INDIRECT + EXTENT_BLOCKS; i++)
+	{
+	    if(inode->inode.data[i] != 0)
+		free_block(inode->dev, inode->inode.data[i]);
+	}
+	memset(inode->inode.data, 0, sizeof(inode->inode.data));
+	inode->nr_extents = 0;
+	inode->last_extent.length = 0;
+	inode->dirty = TRUE;
+    }
+    return rc;
+}
+
 /* Returns the data block corresponding to logical block BLK of the file
    linked to FILE. Or NULL if an error occurs. If CREATE is TRUE the block
    (and indirect links to it) will be created if they don't already exist.
@@ -368,6 +784,8 @@ get_data_blkno(struct core_inode *inode, blkno blk, bool create)
 	ERRNO = E_INVALID;
 	return 0;
     }
+    if(inode->inode.attr & ATTR_EXTENTS)
+	return get_extent_blkno(inode, blk, create);
     if(blk < SINGLE_INDIRECT)
 	return get_inode_blkno(inode, blk, create, NULL);
     blk -= SINGLE_INDIRECT;
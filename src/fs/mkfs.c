@@ -22,9 +22,10 @@
 
    BLOCKS is the total number of blocks in the device. RESERVED is the
    number of blocks to leave free between the boot block and the first
-   inode block. */
+   inode block. VERSION is FS_VERSION_1 for the original format, or
+   FS_VERSION_2 for one whose files are mapped by extents. */
 bool
-mkfs(struct fs_device *dev, u_long blocks, u_long reserved)
+mkfs(struct fs_device *dev, u_long blocks, u_long reserved, int version)
 {
     long result;
     int tmp;
@@ -105,7 +106,17 @@ mkfs(struct fs_device *dev, u_long blocks, u_long reserved)
 	    TMP_INODE_BLK->inodes[0].modtime = current_time();
 	    TMP_INODE_BLK->inodes[0].size = sizeof(struct dir_entry) * 2;
 	    TMP_INODE_BLK->inodes[0].nlinks = 2;
-	    TMP_INODE_BLK->inodes[0].data[0] = sup.data;
+	    if(version >= FS_VERSION_2)
+	    {
+		struct extent *ext;
+		ext = (struct extent *)TMP_INODE_BLK->inodes[0].data;
+		TMP_INODE_BLK->inodes[0].attr |= ATTR_EXTENTS;
+		ext[0].logical = 0;
+		ext[0].physical = sup.data;
+		ext[0].length = 1;
+	    }
+	    else
+		TMP_INODE_BLK->inodes[0].data[0] = sup.data;
 	}
 	result = FS_WRITE_BLOCKS(dev, block, TMP_INODE_BLK, 1);
 	if(result < 0)
@@ -177,7 +188,8 @@ mkfs(struct fs_device *dev, u_long blocks, u_long reserved)
 	return FALSE;
     }
     memcpy(&TMP_BOOT_BLK->sup, &sup, sizeof(sup));
-    TMP_BOOT_BLK->magic = FS_BOOT_MAGIC;
+    TMP_BOOT_BLK->magic = ((version >= FS_VERSION_2)
+			   ? FS_BOOT_MAGIC_V2 : FS_BOOT_MAGIC);
     memcpy(&TMP_BOOT_BLK->boot_code, bootsect_code,
         sizeof(TMP_BOOT_BLK->boot_code)); 
     result = FS_WRITE_BLOCKS(dev, BOOT_BLK, TMP_BOOT_BLK, 1);
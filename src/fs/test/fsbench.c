@@ -0,0 +1,344 @@
+/* fsbench.c -- Time some file system workloads on the test device.
+
+   Makes a new file system on the device image, then runs each workload
+   in turn printing how many operations per second it managed, how many
+   blocks it read and wrote on the device and the buffer-cache hit ratio
+   while it ran. */
+
+#include <vmm/fs.h>
+#include <vmm/errno.h>
+#include <vmm/string.h>
+#include <vmm/shell.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+struct shell_module *shell = &shell_module;
+
+/* Parameters of the workloads, these can be changed from the command
+   line. */
+static u_long file_blocks = 4096;	/* size of the big file */
+static u_long random_ops = 2000;	/* random reads and writes */
+static u_long small_files = 500;	/* files created and deleted */
+static u_long files_per_dir = 100;	/* files in each directory */
+static u_long path_depth = 16;		/* directories in the deep path */
+static u_long lookups = 5000;		/* opens of the deep path */
+static u_long dir_entries = 500;	/* entries in the big directory */
+
+#define CHUNK (8 * FS_BLKSIZ)
+static u_char chunk[CHUNK];
+
+static struct fs_device *dev;
+
+/* The state of the counters when a workload started. */
+static struct timeval start_time;
+static u_long start_accessed, start_cached;
+static u_long start_reads, start_writes, start_blocks_read,
+    start_blocks_written;
+
+static void
+start_bench(void)
+{
+    start_accessed = total_accessed;
+    start_cached = cached_accesses;
+    start_reads = dev_reads;
+    start_writes = dev_writes;
+    start_blocks_read = dev_blocks_read;
+    start_blocks_written = dev_blocks_written;
+    gettimeofday(&start_time, NULL);
+}
+
+/* Print the results of the workload called NAME which did OPS
+   operations. Dirty blocks are written back first so that they're
+   counted against the workload that made them. */
+static void
+end_bench(const char *name, u_long ops)
+{
+    struct timeval end_time;
+    double secs;
+    u_long accessed, cached;
+    sync_buffers(NULL);
+    gettimeofday(&end_time, NULL);
+    secs = ((end_time.tv_sec - start_time.tv_sec)
+	    + (end_time.tv_usec - start_time.tv_usec) / 1000000.0);
+    accessed = total_accessed - start_accessed;
+    cached = cached_accesses - start_cached;
+    printf("%-12s %8lu %10.0f %8lu/%-6lu %8lu/%-6lu %5.1f%%\n",
+	   name, ops, (secs > 0) ? (ops / secs) : 0.0,
+	   dev_blocks_read - start_blocks_read, dev_reads - start_reads,
+	   dev_blocks_written - start_blocks_written,
+	   dev_writes - start_writes,
+	   accessed ? (100.0 * cached / accessed) : 0.0);
+}
+
+/* Write back and discard everything cached for the device: its
+   buffers, directory lookups and unreferenced inodes, so the next
+   workload starts cold. */
+static void
+empty_cache(void)
+{
+    sync_buffers(NULL);
+    dcache_invalidate_device(dev);
+    shrink_inodes(0);
+    flush_device_cache(dev, FALSE);
+}
+
+static void
+fail(const char *what)
+{
+    fprintf(stderr, "fsbench: %s failed: %s\n", what, error_string(ERRNO));
+    exit(10);
+}
+
+static void
+seq_write(void)
+{
+    struct file *fh;
+    u_long i;
+    start_bench();
+    fh = open_file("tst:big", F_READ | F_WRITE | F_CREATE | F_TRUNCATE);
+    if(fh == NULL)
+	fail("open");
+    for(i = 0; i < file_blocks / 8; i++)
+    {
+	memset(chunk, i, CHUNK);
+	if(write_file(chunk, CHUNK, fh) != CHUNK)
+	    fail("write");
+    }
+    close_file(fh);
+    end_bench("seq-write", i);
+}
+
+static void
+seq_read(void)
+{
+    struct file *fh;
+    u_long i;
+    empty_cache();
+    start_bench();
+    fh = open_file("tst:big", F_READ);
+    if(fh == NULL)
+	fail("open");
+    for(i = 0; i < file_blocks / 8; i++)
+    {
+	if(read_file(chunk, CHUNK, fh) != CHUNK)
+	    fail("read");
+    }
+    close_file(fh);
+    end_bench("seq-read", i);
+}
+
+static void
+random_io(bool writing)
+{
+    struct file *fh;
+    u_long i;
+    empty_cache();
+    srand(1);
+    start_bench();
+    fh = open_file("tst:big", F_READ | F_WRITE);
+    if(fh == NULL)
+	fail("open");
+    for(i = 0; i < random_ops; i++)
+    {
+	u_long pos = (rand() % (file_blocks / 8)) * CHUNK;
+	if(seek_file(fh, pos, SEEK_ABS) < 0)
+	    fail("seek");
+	if(writing)
+	{
+	    if(write_file(chunk, CHUNK, fh) != CHUNK)
+		fail("write");
+	}
+	else if(read_file(chunk, CHUNK, fh) != CHUNK)
+	    fail("read");
+    }
+    close_file(fh);
+    end_bench(writing ? "rand-write" : "rand-read", i);
+}
+
+/* Create SMALL-FILES one-block files, FILES-PER-DIR in each directory,
+   then delete them all again. */
+static void
+small_file_churn(void)
+{
+    char name[64];
+    u_long i;
+    empty_cache();
+    start_bench();
+    for(i = 0; i < small_files; i++)
+    {
+	struct file *fh;
+	if((i % files_per_dir) == 0)
+	{
+	    sprintf(name, "tst:small%lu", i / files_per_dir);
+	    if(!make_directory(name, 0))
+		fail("mkdir");
+	}
+	sprintf(name, "tst:small%lu/f%lu", i / files_per_dir, i);
+	fh = open_file(name, F_READ | F_WRITE | F_CREATE);
+	if(fh == NULL)
+	    fail("create");
+	if(write_file(chunk, FS_BLKSIZ, fh) != FS_BLKSIZ)
+	    fail("write");
+	close_file(fh);
+    }
+    for(i = 0; i < small_files; i++)
+    {
+	sprintf(name, "tst:small%lu/f%lu", i / files_per_dir, i);
+	if(!remove_link(name))
+	    fail("delete");
+	if(((i + 1) % files_per_dir) == 0 || (i + 1) == small_files)
+	{
+	    sprintf(name, "tst:small%lu", i / files_per_dir);
+	    if(!remove_directory(name))
+		fail("rmdir");
+	}
+    }
+    end_bench("small-files", small_files * 2);
+}
+
+/* Make a PATH-DEPTH deep chain of directories then open a file at the
+   bottom LOOKUPS times. */
+static void
+deep_lookup(void)
+{
+    char path[FS_BLKSIZ], *ptr;
+    struct file *fh;
+    u_long i;
+    strcpy(path, "tst:");
+    ptr = path + 4;
+    for(i = 0; i < path_depth; i++)
+    {
+	sprintf(ptr, "d%lu", i);
+	if(!make_directory(path, 0))
+	    fail("mkdir");
+	ptr += strlen(ptr);
+	*ptr++ = '/';
+    }
+    strcpy(ptr, "leaf");
+    fh = open_file(path, F_READ | F_WRITE | F_CREATE);
+    if(fh == NULL)
+	fail("create");
+    close_file(fh);
+    empty_cache();
+    start_bench();
+    for(i = 0; i < lookups; i++)
+    {
+	fh = open_file(path, F_READ);
+	if(fh == NULL)
+	    fail("open");
+	close_file(fh);
+    }
+    end_bench("deep-lookup", i);
+}
+
+/* Grow one directory to DIR-ENTRIES entries, then look up each entry. */
+static void
+dir_growth(void)
+{
+    char name[64];
+    u_long i;
+    empty_cache();
+    start_bench();
+    if(!make_directory("tst:bigdir", 0))
+	fail("mkdir");
+    for(i = 0; i < dir_entries; i++)
+    {
+	struct file *fh;
+	sprintf(name, "tst:bigdir/e%lu", i);
+	fh = open_file(name, F_READ | F_WRITE | F_CREATE);
+	if(fh == NULL)
+	    fail("create");
+	close_file(fh);
+    }
+    for(i = 0; i < dir_entries; i++)
+    {
+	struct file *fh;
+	sprintf(name, "tst:bigdir/e%lu", (i * 7) % dir_entries);
+	fh = open_file(name, F_READ);
+	if(fh == NULL)
+	    fail("open");
+	close_file(fh);
+    }
+    end_bench("dir-growth", dir_entries * 2);
+}
+
+int
+main(int argc, char **argv)
+{
+    char *prog_name = *argv;
+    char *file = "test_dev.image";
+    int version = FS_VERSION_1;
+    u_long cache = 0;
+    argc--; argv++;
+    while(argc > 0)
+    {
+	if((**argv == '-') && (argv[0][1] != '2') && (argc < 2))
+	    goto usage;
+	if(!strcmp(*argv, "-f"))
+	    file = *++argv, argc--;
+	else if(!strcmp(*argv, "-2"))
+	    version = FS_VERSION_2;
+	else if(!strcmp(*argv, "-c"))
+	    cache = atol(*++argv), argc--;
+	else if(!strcmp(*argv, "-s"))
+	    file_blocks = atol(*++argv), argc--;
+	else if(!strcmp(*argv, "-r"))
+	    random_ops = atol(*++argv), argc--;
+	else if(!strcmp(*argv, "-n"))
+	    small_files = atol(*++argv), argc--;
+	else if(!strcmp(*argv, "-p"))
+	    files_per_dir = atol(*++argv), argc--;
+	else if(!strcmp(*argv, "-d"))
+	    path_depth = atol(*++argv), argc--;
+	else if(!strcmp(*argv, "-l"))
+	    lookups = atol(*++argv), argc--;
+	else if(!strcmp(*argv, "-e"))
+	    dir_entries = atol(*++argv), argc--;
+	else
+	{
+	usage:
+	    fprintf(stderr, "usage: %s [-f DEVICE-IMAGE] [-2] [-c CACHE-BLOCKS] "
+		    "[-s FILE-BLOCKS]\n\t[-r RANDOM-OPS] [-n SMALL-FILES] "
+		    "[-p FILES-PER-DIR]\n\t[-d PATH-DEPTH] [-l LOOKUPS] "
+		    "[-e DIR-ENTRIES]\n", prog_name);
+	    return 1;
+	}
+	argc--; argv++;
+    }
+    if(file_blocks < 8)
+	file_blocks = 8;
+    if(files_per_dir == 0)
+	files_per_dir = 1;
+    if(!shell_init() || !fs_init())
+	return 5;
+    if(!open_test_dev(file, TRUE, 0, version))
+	return 5;
+    if((cache > 0) && !set_buffer_limits(min(BUFFER_MIN, cache), cache))
+    {
+	fprintf(stderr, "fsbench: can't cache %lu blocks: %s\n",
+		cache, error_string(ERRNO));
+	return 1;
+    }
+    dev = get_device("tst");
+    if(dev == NULL)
+	return 5;
+    printf("Version %d file system, %lu blocks cached at most\n\n",
+	   version, max_buffers);
+    printf("%-12s %8s %10s %15s %15s %6s\n", "workload", "ops", "ops/sec",
+	   "blocks/reads", "blocks/writes", "hits");
+
+    seq_write();
+    seq_read();
+    random_io(FALSE);
+    random_io(TRUE);
+    small_file_churn();
+    deep_lookup();
+    dir_growth();
+
+    release_device(dev);
+    close_test_dev();
+    fs_kill();
+    return 0;
+}
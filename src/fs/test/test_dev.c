@@ -11,6 +11,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 
@@ -22,10 +23,17 @@ size_t dev_size;
 
 static long dev_read_blocks(void *unused, blkno blk, void *buf, int count);
 static long dev_write_blocks(void *unused, blkno blk, void *buf, int count);
+static long dev_read_blocks_v(void *unused, blkno blk, void **bufs,
+			      int count);
+static long dev_write_blocks_v(void *unused, blkno blk, void **bufs,
+			       int count);
 static long dev_test_media(void *unused);
 
 static struct fs_device *test_dev;
 
+/* Counts of device accesses and the number of blocks they transferred. */
+u_long dev_reads, dev_writes, dev_blocks_read, dev_blocks_written;
+
 /* So we can simulate removing and inserting disks. */
 static bool no_disk, disk_changed;
 
@@ -52,7 +60,7 @@ cmd_newdisk(struct shell *sh, int argc, char **argv)
 }
 
 bool
-open_test_dev(const char *file, bool make_fs, u_long reserved)
+open_test_dev(const char *file, bool make_fs, u_long reserved, int version)
 {
     struct stat stat_buf;
     dev_fd = open(file, O_RDWR);
@@ -73,6 +81,8 @@ open_test_dev(const char *file, bool make_fs, u_long reserved)
     test_dev->name = "tst";
     test_dev->read_blocks = dev_read_blocks;
     test_dev->write_blocks = dev_write_blocks;
+    test_dev->read_blocks_v = dev_read_blocks_v;
+    test_dev->write_blocks_v = dev_write_blocks_v;
     test_dev->test_media = dev_test_media;
     if(fstat(dev_fd, &stat_buf))
     {
@@ -93,7 +103,7 @@ open_test_dev(const char *file, bool make_fs, u_long reserved)
         dev_start = 512;
     }
 
-    if(!make_fs || mkfs(test_dev, dev_size, reserved))
+    if(!make_fs || mkfs(test_dev, dev_size, reserved, version))
     {
 	add_device(test_dev);
 	shell->add_command("nodisk", cmd_nodisk, DOC_nodisk);
@@ -139,6 +149,8 @@ dev_read_blocks(void *unused, blkno blk, void *buf, int count)
     }
     if(actual < FS_BLKSIZ)
 	return -E_IO;
+    dev_reads++;
+    dev_blocks_read += count;
     return actual;
 }
 
@@ -165,9 +177,68 @@ dev_write_blocks(void *unused, blkno blk, void *buf, int count)
     }
     if(actual < FS_BLKSIZ)
 	return -E_IO;
+    dev_writes++;
+    dev_blocks_written += count;
     return actual;
 }
 
+/* Transfer COUNT blocks from BLK to or from the buffers BUFS with a
+   single readv() or writev(). */
+static long
+dev_rw_blocks_v(blkno blk, void **bufs, int count, bool writing)
+{
+    struct iovec iov[count];
+    long actual;
+    int i;
+    if(no_disk)
+	return -E_NODISK;
+    for(i = 0; i < count; i++)
+    {
+	iov[i].iov_base = bufs[i];
+	iov[i].iov_len = FS_BLKSIZ;
+    }
+    if(lseek(dev_fd, dev_start + (blk * FS_BLKSIZ), SEEK_SET) < 0)
+    {
+	perror("rw_blocks_v:lseek");
+	abort();
+    }
+    actual = writing ? writev(dev_fd, iov, count) : readv(dev_fd, iov, count);
+    if(actual < 0)
+    {
+	if(errno == EIO)
+	    return -E_IO;
+	else if(errno == ENOSPC)
+	    return -E_NOSPC;
+	perror("rw_blocks_v");
+	abort();
+    }
+    if(actual < count * FS_BLKSIZ)
+	return -E_IO;
+    if(writing)
+    {
+	dev_writes++;
+	dev_blocks_written += count;
+    }
+    else
+    {
+	dev_reads++;
+	dev_blocks_read += count;
+    }
+    return actual;
+}
+
+static long
+dev_read_blocks_v(void *unused, blkno blk, void **bufs, int count)
+{
+    return dev_rw_blocks_v(blk, bufs, count, FALSE);
+}
+
+static long
+dev_write_blocks_v(void *unused, blkno blk, void **bufs, int count)
+{
+    return dev_rw_blocks_v(blk, bufs, count, TRUE);
+}
+
 static long
 dev_test_media(void *unused)
 {
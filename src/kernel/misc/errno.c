@@ -31,9 +31,10 @@ const char *error_table[] = {
     "Object in use.",
     "Not a symbolic link.",
     "Too many symbolic links encountered.",
+    "File is too fragmented.",
 };
 
-int max_err = E_MAXLINKS;
+int max_err = E_TOOFRAG;
 
 /* Return a string describing the error ERRNO. */
 const char *
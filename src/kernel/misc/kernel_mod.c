@@ -25,9 +25,9 @@ struct kernel_module kernel_module =
     find_module, open_module, close_module, expunge_module,
 
     /* mm functions */
-    alloc_page, alloc_pages_64, free_page, free_pages, map_page, set_pte,
-    get_pte, read_page_mapping, lin_to_phys, put_pd_val, get_pd_val,
-    check_area,
+    alloc_page, alloc_pages_64, free_page, free_pages, free_page_count,
+    map_page, set_pte, get_pte, read_page_mapping, lin_to_phys, put_pd_val,
+    get_pd_val, check_area,
 
     /* kernel malloc */
     malloc, calloc, free, realloc, valloc,
@@ -12,11 +12,10 @@
 void
 page_exception_handler(struct trap_regs *regs)
 {
-    static int nest_count;
     u_long page_phys_addr = get_cr2() & PAGE_MASK;
     u_long page_offset = get_cr2() & PAGE_OFFSET_MASK;
     u_long pte;
-    if(++nest_count > 1)
+    if(++current_task->pfl_nest > 1)
     {
 	kprintf("Nested page fault!\n");
 	cli();hlt();
@@ -43,11 +42,19 @@ page_exception_handler(struct trap_regs *regs)
 	}
 	else
 	{
-	    /* From a level zero task. Eek. Actually this shouldn't ever
-	       happen unless we start setting the WP bit on 486s.. */
-	    kprintf("Level 0 page protection violation; addr=%#0lx ec=%#0x\n",
-		    page_phys_addr | page_offset, regs->error_code);
-	    dump_regs(regs, TRUE);
+	    /* From a level zero task. This only happens once the WP bit
+	       is set on 486s (the vm module does this to share pages);
+	       the task's pfl_handler() may be able to fix writes to its
+	       read-only user pages. */
+	    if(!(((pte & (PTE_USER | PTE_READ_WRITE)) == PTE_USER)
+		 && current_task->pfl_handler
+		 && current_task->pfl_handler(regs, page_phys_addr
+					      | page_offset)))
+	    {
+		kprintf("Level 0 page protection violation; addr=%#0lx ec=%#0x\n",
+			page_phys_addr | page_offset, regs->error_code);
+		dump_regs(regs, TRUE);
+	    }
 	}
     }
     else
@@ -69,7 +76,13 @@ page_exception_handler(struct trap_regs *regs)
 	       and map it into the hole. */
 	    if(current_task->pfl_handler)
 	    {
-		current_task->pfl_handler(regs, page_phys_addr | page_offset);
+		if(!current_task->pfl_handler(regs, page_phys_addr
+					      | page_offset))
+		{
+		    kprintf("Can't map not-present page; addr=%#0lx ec=%#0x\n",
+			    page_phys_addr | page_offset, regs->error_code);
+		    dump_regs(regs, TRUE);
+		}
 	    }
 	    else
 	    {
@@ -82,5 +95,5 @@ page_exception_handler(struct trap_regs *regs)
 	    }
 	}
     }
-    nest_count--;
+    current_task->pfl_nest--;
 }
@@ -6,6 +6,9 @@
 #include <vmm/string.h>
 #include <vmm/kernel.h>
 #include <vmm/shell.h>
+#include <vmm/tasks.h>
+#include <vmm/cookie_jar.h>
+#include <vmm/bits.h>
 
 page_dir *logical_kernel_pd;		/* Initialised in init_mm() */
 
@@ -388,11 +391,87 @@ init_mm(void)
     kernel_brk = (u_char *)logical_top_of_kernel;
 }
 
+/* Totals for describe_mm() of the memory used by virtual machines. */
+struct vm_page_counts {
+    struct shell *sh;
+    u_char *frame_map;		/* Bit set for each shared frame seen. */
+    u_long map_frames;
+    u_long private, mapped, frames, swapped;
+};
+
+/* If TASK is a virtual machine print the number of pages it owns, the
+   number it shares with other vm's (those marked PTE_COW) and the number
+   in the swap file (PTE_SWAPPED), adding them to the totals in ARG. */
+static void
+count_vm_pages(struct task *task, void *arg)
+{
+    struct vm_page_counts *c = arg;
+    page_dir *pd = task->page_dir;
+    u_long private = 0, shared = 0, swapped = 0, i, j;
+    if((task->flags & TASK_VM) == 0)
+	return;
+    for(i = 0; i < PAGE_DIR_OFFSET(KERNEL_BASE_ADDR); i++)
+    {
+	page_table *pt;
+	if((pd[i] & PTE_PRESENT) == 0)
+	    continue;
+	pt = TO_LOGICAL(PTE_GET_ADDR(pd[i]), page_table *);
+	for(j = 0; j < PAGE_ENTRIES; j++)
+	{
+	    u_long pte = pt[j], addr = (i * PAGE_TABLE_BYTES) + (j * PAGE_SIZE);
+	    u_long frame = PTE_GET_ADDR(pte) / PAGE_SIZE;
+	    /* With A20 disabled the first 64K is mapped again at 1M,
+	       don't count it twice. */
+	    if((addr >= 0x100000) && (addr < 0x110000)
+	       && ((pte & PTE_FREEABLE) == 0)
+	       && (PTE_GET_ADDR(get_pte(pd, addr - 0x100000))
+		   == PTE_GET_ADDR(pte)))
+		continue;
+	    if((pte & PTE_PRESENT) == 0)
+	    {
+		if(pte & PTE_SWAPPED)
+		    swapped++;
+	    }
+	    else if(pte & PTE_FREEABLE)
+		private++;
+	    else if(pte & PTE_COW)
+	    {
+		shared++;
+		if((frame < c->map_frames) && !test_bit(c->frame_map, frame))
+		{
+		    set_bit(c->frame_map, frame);
+		    c->frames++;
+		}
+	    }
+	}
+    }
+    c->private += private;
+    c->mapped += shared;
+    c->swapped += swapped;
+    c->sh->shell->printf(c->sh, "  %-16s Private: %d  Shared: %d  Swapped: %d\n",
+			 (task->name != NULL) ? task->name : "",
+			 private * 4, shared * 4, swapped * 4);
+}
+
 void
 describe_mm(struct shell *sh)
 {
+    struct vm_page_counts counts;
     sh->shell->printf(sh, "Total: %d  Used: %d  Free: %d\n",
 		      (available_pages + used_pages) * 4,
 		      used_pages * 4, available_pages * 4);
     sh->shell->printf(sh, "Kernel break: %#x\n", kernel_sbrk(0));
+    memset(&counts, 0, sizeof(counts));
+    counts.sh = sh;
+    counts.map_frames = cookie.total_mem / (PAGE_SIZE / 1024);
+    counts.frame_map = calloc((counts.map_frames + 7) / 8, 1);
+    if(counts.frame_map == NULL)
+	return;
+    sh->shell->printf(sh, "Virtual machines:\n");
+    map_tasks(count_vm_pages, &counts);
+    sh->shell->printf(sh, "VM total: Private: %d  Shared: %d in %d  "
+		      "Saved: %d  Swapped: %d\n", counts.private * 4,
+		      counts.mapped * 4, counts.frames * 4,
+		      (counts.mapped - counts.frames) * 4, counts.swapped * 4);
+    free(counts.frame_map);
 }
@@ -115,7 +115,7 @@ load_module(const char *name)
         }
         kprintf("Loading `%s.module'\n", name);
         ksprintf(name_buf, "/lib/%s.module", name);
-        fh = fs->open(name_buf, F_READ);
+        fh = fs->open(name_buf, F_READ | F_DIRECT);
         if(fh == NULL) {
                 kprintf("Cant open `%s' for reading\n", name_buf);
                 goto error;
@@ -135,6 +135,8 @@ create_tss(struct task *task, void (*code)(void))
 	    task->tss.gs = KERNEL_DATA; 
 	    task->tss.trace = 0;
 	    task->tss.bitmap = sizeof(struct tss);	/* Null I/O bitmap */
+	    memset(task->tss.int_redirect, 0xff,	/* All INTs trap */
+		   sizeof(task->tss.int_redirect));
 	    task->tss.esp = (u_long)task->stack + 4092;
 	    task->tss.ss = KERNEL_DATA;
 	    task->tss.cr3 = TO_PHYSICAL(task->page_dir);
@@ -306,3 +308,20 @@ describe_tasks(struct shell *sh)
     }
     sti();
 }
+
+/* Call FUNC with each existing task and ARG. Interrupts are masked while
+   this happens. */
+void
+map_tasks(void (*func)(struct task *task, void *arg), void *arg)
+{
+    int i;
+    u_long flags;
+    save_flags(flags);
+    cli();
+    for(i = 0; i < MAX_TASKS; i++)
+    {
+	if(TaskArray[i].pid != 0)
+	    func(&TaskArray[i], arg);
+    }
+    load_flags(flags);
+}
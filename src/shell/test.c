@@ -22,6 +22,7 @@ main(int argc, char **argv)
 	char *file = "test_dev.image";
 	bool mkfs = FALSE;
 	u_long reserved = 0;
+	int version = FS_VERSION_1;
 	argc--; argv++;
 	while(argc > 0)
 	{
@@ -39,6 +40,9 @@ main(int argc, char **argv)
 		case 'm':
 		    mkfs = TRUE;
 		    break;
+		case '2':
+		    version = FS_VERSION_2;
+		    break;
 		case 'r':
 		    if(argc >= 2)
 		    {
@@ -47,7 +51,7 @@ main(int argc, char **argv)
 		    }
 		    break;
 		case '?':
-		    fprintf(stderr, "usage: %s [-f DEVICE-IMAGE] [-m [-r RESERVED-BLOCKS]]\n", prog_name);
+		    fprintf(stderr, "usage: %s [-f DEVICE-IMAGE] [-m [-2] [-r RESERVED-BLOCKS]]\n", prog_name);
 		    return 1;
 		default:
 		    fprintf(stderr, "test_fs: unknown option: %s", *argv);
@@ -58,7 +62,7 @@ main(int argc, char **argv)
 	}
 	fs_init();
 	add_fs_commands();
-	if(!open_test_dev(file, mkfs, reserved))
+	if(!open_test_dev(file, mkfs, reserved, version))
 	    return 5;
 #endif /* TEST_FS */
 	init_shell_struct(&test_shell);
@@ -99,7 +99,7 @@ int main(int argc, char *argv[])
         // skip the mbr
         fseek(sys_file, is_file ? 512 : 0, SEEK_SET);
         fread(&bpb, 1, FS_BLKSIZ, sys_file);
-        if(bpb.magic != FS_BOOT_MAGIC) {
+        if(bpb.magic != FS_BOOT_MAGIC && bpb.magic != FS_BOOT_MAGIC_V2) {
                 fprintf(stderr, "%s:bad magic number\n", argv[3]);
                 fclose(sys_file);
                 return 1;
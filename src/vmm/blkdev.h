@@ -4,6 +4,20 @@
    type of the device struct and BLKDEV_NAME to a string naming the
    device.
 
+   Pending requests are kept in a blkqueue_t. This is sorted by device
+   and block number and requests are taken from it in one direction only
+   (C-LOOK), starting from wherever the last request left the heads; a
+   request that has been overtaken too many times is taken next whatever
+   its position so that a stream of requests to one area of the disk
+   can't starve the others. When a request is queued that continues (or
+   is continued by) a queued request with the same command the two are
+   merged into a chain, which the driver transfers with a single
+   multi-sector command.
+
+   A driver may also accept asynchronous transfers (see <vmm/blkio.h>)
+   by expanding ASYNC_IO_FUN; these are given requests from a fixed pool
+   and complete by calling back their submitter instead of waking it.
+
    John Harper. */
 
 #ifndef __VMM_BLKDEV_H
@@ -11,8 +25,9 @@
 
 #include <vmm/lists.h>
 #include <vmm/tasks.h>
+#include <vmm/blkio.h>
 
-typedef struct {
+typedef struct blkreq {
     list_node_t node;
     BLKDEV_TYPE *dev;			/* Device to access */
     char *buf;				/* Block being read/written */
@@ -23,11 +38,197 @@ typedef struct {
     char retries;			/* Times we tried to do this command */
     bool completed;			/* TRUE when request has finished */
     struct semaphore sem;		/* Task locked on this request. */
+    struct blkreq *merge_next;		/* Next request in the merge chain */
+    struct blkreq *merge_tail;		/* Last request in the chain */
+    u_long merge_blocks;		/* Blocks in the whole chain */
+    u_long deadline;			/* Queue dispatch count to start by */
+    blkio_t *io;			/* Async transfer this is doing */
+    void (*done)(struct blkreq *req);	/* If non-null called, not SEM */
 } blkreq_t;
 
+/* Requests waiting for a controller. Any access to this structure must
+   only take place with interrupts masked. */
+typedef struct {
+    list_t reqs;			/* Sorted by device then block */
+    list_t retries;			/* Requests to restart before others */
+    BLKDEV_TYPE *pos_dev;		/* Where the last request left off */
+    u_long pos_block;
+    u_long dispatched;			/* Number of requests dispatched */
+    u_long max_blocks;			/* Largest chain to build, 0 = none */
+} blkqueue_t;
+
+/* The number of later requests that may be dispatched before a queued
+   request, after that it's taken next regardless of the elevator. */
+#define BLKQ_MAX_OVERTAKE 16
+
+/* Initialise the queue Q; merge chains will be at most MAX-BLOCKS long
+   (zero disables merging). */
+static inline void
+blkq_init(blkqueue_t *q, u_long max_blocks)
+{
+    init_list(&q->reqs);
+    init_list(&q->retries);
+    q->pos_dev = NULL;
+    q->pos_block = 0;
+    q->dispatched = 0;
+    q->max_blocks = max_blocks;
+}
+
+/* Returns negative, zero or positive as the start of request A is
+   before, at or after DEV,BLOCK. */
+static inline int
+blkq_compare(blkreq_t *a, BLKDEV_TYPE *dev, u_long block)
+{
+    if(a->dev != dev)
+	return ((u_long)a->dev < (u_long)dev) ? -1 : 1;
+    if(a->block != block)
+	return (a->block < block) ? -1 : 1;
+    return 0;
+}
+
+/* Try to merge REQ with the queued request X, returning TRUE if it was
+   added to X's chain or X was added to its. */
+static inline bool
+blkq_merge(blkqueue_t *q, blkreq_t *x, blkreq_t *req)
+{
+    if(x->dev != req->dev || x->command != req->command
+       || x->merge_blocks + req->merge_blocks > q->max_blocks)
+	return FALSE;
+    if(x->merge_tail->block + x->merge_tail->nblocks == req->block)
+    {
+	x->merge_tail->merge_next = req;
+	x->merge_tail = req->merge_tail;
+	x->merge_blocks += req->merge_blocks;
+	return TRUE;
+    }
+    if(req->block + req->merge_blocks == x->block)
+    {
+	req->merge_tail->merge_next = x;
+	req->merge_tail = x->merge_tail;
+	req->merge_blocks += x->merge_blocks;
+	if((long)(x->deadline - req->deadline) < 0)
+	    req->deadline = x->deadline;
+	insert_node(&q->reqs, &req->node, x->node.pred);
+	remove_node(&x->node);
+	return TRUE;
+    }
+    return FALSE;
+}
+
+/* Add the request REQ to the queue Q, merging it with an adjacent
+   request if possible. REQ may already be the head of a chain of
+   requests for consecutive blocks, linked by their `merge_next' fields,
+   in which case the whole chain is queued. */
+static inline void
+blkq_add(blkqueue_t *q, blkreq_t *req)
+{
+    list_node_t *nxt, *x = q->reqs.head;
+    blkreq_t *r;
+    req->merge_tail = req;
+    req->merge_blocks = req->nblocks;
+    for(r = req->merge_next; r != NULL; r = r->merge_next)
+    {
+	req->merge_tail = r;
+	req->merge_blocks += r->nblocks;
+    }
+    req->deadline = q->dispatched + BLKQ_MAX_OVERTAKE;
+    while((nxt = x->succ) != NULL)
+    {
+	if(req->nblocks > 0 && blkq_merge(q, (blkreq_t *)x, req))
+	    return;
+	if(blkq_compare((blkreq_t *)x, req->dev, req->block) > 0)
+	{
+	    insert_node(&q->reqs, &req->node, x->pred);
+	    return;
+	}
+	x = nxt;
+    }
+    append_node(&q->reqs, &req->node);
+}
+
+/* Put REQ back on the queue Q to be restarted before anything else,
+   for example to retry it after an error. */
+static inline void
+blkq_requeue(blkqueue_t *q, blkreq_t *req)
+{
+    prepend_node(&q->retries, &req->node);
+}
+
+/* Remove and return the request that should be started next from the
+   queue Q, or NULL if it's empty. */
+static inline blkreq_t *
+blkq_next(blkqueue_t *q)
+{
+    blkreq_t *req = NULL, *late = NULL;
+    list_node_t *nxt, *x;
+    if(!list_empty_p(&q->retries))
+    {
+	req = (blkreq_t *)q->retries.head;
+	remove_node(&req->node);
+	return req;
+    }
+    x = q->reqs.head;
+    while((nxt = x->succ) != NULL)
+    {
+	blkreq_t *r = (blkreq_t *)x;
+	if((long)(q->dispatched - r->deadline) >= 0
+	   && (late == NULL || (long)(r->deadline - late->deadline) < 0))
+	    late = r;
+	if(req == NULL && blkq_compare(r, q->pos_dev, q->pos_block) >= 0)
+	    req = r;
+	x = nxt;
+    }
+    if(late != NULL)
+	req = late;
+    else if(req == NULL)
+    {
+	/* Nothing after the heads, go back to the start. */
+	if(list_empty_p(&q->reqs))
+	    return NULL;
+	req = (blkreq_t *)q->reqs.head;
+    }
+    remove_node(&req->node);
+    q->pos_dev = req->dev;
+    q->pos_block = req->block + req->merge_blocks;
+    q->dispatched++;
+    return req;
+}
+
+/* Returns the number of blocks left to transfer in REQ and the requests
+   merged after it. */
+static inline u_long
+blkq_chain_blocks(blkreq_t *req)
+{
+    u_long total = 0;
+    while(req != NULL)
+    {
+	total += req->nblocks;
+	req = req->merge_next;
+    }
+    return total;
+}
+
+/* Mark REQ as completed with result RESULT and wake whoever is waiting
+   for it. Interrupts must be masked. */
+static inline void
+blkreq_complete(blkreq_t *req, int result)
+{
+    req->completed = TRUE;
+    req->result = result;
+    if(req->done != NULL)
+	req->done(req);
+    else
+	signal(&req->sem);
+}
+
 /* Called when the current request is completed. RESULT is the value to
-   stash in the request. This can be called from an interrupt or the
-   normal kernel context.
+   stash in the request and in any requests merged after it. This can be
+   called from an interrupt or the normal kernel context.
+
+   next_merged_request() is called when the current request has been
+   transferred but the requests merged after it haven't; it completes the
+   current request and makes the next in its chain current, returning
+   FALSE if there wasn't one.
 
    The macro argument CUR-REQ-VAR should be the name of the variable used
    by the driver to store its current request. */
@@ -42,12 +243,35 @@ end_request(int result)						\
     cli();							\
     if(cur_req_var != NULL)					\
     {								\
-	cur_req_var->completed = TRUE;				\
-	cur_req_var->result = result;				\
-	signal(&cur_req_var->sem);				\
+	blkreq_t *req = cur_req_var;				\
 	cur_req_var = NULL;					\
+	do {							\
+	    blkreq_t *next = req->merge_next;			\
+	    blkreq_complete(req, result);			\
+	    req = next;						\
+	} while(req != NULL);					\
     }								\
     load_flags(flags);						\
+}								\
+								\
+static inline bool						\
+next_merged_request(void)					\
+{								\
+    u_long flags;						\
+    blkreq_t *req;						\
+    save_flags(flags);						\
+    cli();							\
+    req = cur_req_var;						\
+    if(req == NULL || req->merge_next == NULL)			\
+    {								\
+	load_flags(flags);					\
+	return FALSE;						\
+    }								\
+    cur_req_var = req->merge_next;				\
+    cur_req_var->retries = 0;					\
+    blkreq_complete(req, 0);					\
+    load_flags(flags);						\
+    return TRUE;						\
 }
 
 /* Invoke REQ then wait for it to complete.
@@ -63,11 +287,84 @@ sync_request(blkreq_t *req)					\
     set_sem_blocked(&req->sem);					\
     req->completed = FALSE;					\
     req->retries = 0;						\
+    req->merge_next = NULL;					\
+    req->done = NULL;						\
     do_req_fun(req);						\
     wait(&req->sem);						\
     return req->result == 0;					\
 }
 
+/* Transfer the COUNT buffers in BUFS, each PER-BUF blocks long, to or
+   from the consecutive blocks of device DEV starting at BLOCK, using
+   COMMAND. The buffers are given one request each and each run of at
+   most MAX-CHAIN blocks is queued as a single chain, so it's done with
+   one device command; returns TRUE if all of them succeeded. If no
+   memory is available the buffers are transferred one at a time.
+
+   This needs sync_request() to have been defined. The macro argument
+   DO-REQ-FUN names the function used to invoke the next request. */
+
+#define SYNC_VECTOR_FUN(do_req_fun)				\
+static bool							\
+sync_vector(BLKDEV_TYPE *dev, int command, u_long block,	\
+	    void **bufs, int count, int per_buf, u_long max_chain)	\
+{								\
+    blkreq_t *reqs = kernel->malloc(sizeof(blkreq_t) * count);	\
+    bool ok = TRUE;						\
+    int i;							\
+    DB((BLKDEV_NAME ":sync_vector: block=%d count=%d\n",	\
+	block, count));						\
+    if(reqs == NULL)						\
+    {								\
+	blkreq_t req;						\
+	for(i = 0; ok && (i < count); i++)			\
+	{							\
+	    req.dev = dev;					\
+	    req.command = command;				\
+	    req.buf = bufs[i];					\
+	    req.block = block + i * per_buf;			\
+	    req.nblocks = per_buf;				\
+	    ok = sync_request(&req);				\
+	}							\
+	return ok;						\
+    }								\
+    for(i = 0; i < count; i++)					\
+    {								\
+	reqs[i].dev = dev;					\
+	reqs[i].command = command;				\
+	reqs[i].buf = bufs[i];					\
+	reqs[i].block = block + i * per_buf;			\
+	reqs[i].nblocks = per_buf;				\
+	reqs[i].merge_next = NULL;				\
+	reqs[i].done = NULL;					\
+	reqs[i].completed = FALSE;				\
+	reqs[i].retries = 0;					\
+	set_sem_blocked(&reqs[i].sem);				\
+    }								\
+    i = 0;							\
+    while(i < count)						\
+    {								\
+	int start = i;						\
+	u_long blocks = per_buf;				\
+	while((i + 1 < count) && (blocks + per_buf <= max_chain))	\
+	{							\
+	    reqs[i].merge_next = &reqs[i + 1];			\
+	    blocks += per_buf;					\
+	    i++;						\
+	}							\
+	i++;							\
+	do_req_fun(&reqs[start]);				\
+    }								\
+    for(i = 0; i < count; i++)					\
+    {								\
+	wait(&reqs[i].sem);					\
+	if(reqs[i].result != 0)					\
+	    ok = FALSE;						\
+    }								\
+    kernel->free(reqs);						\
+    return ok;							\
+}
+
 /* Invoke REQ.
 
    The macro argument DO-REQ-FUN names the function used to invoke the
@@ -81,6 +378,90 @@ async_request(blkreq_t *req)					\
     set_sem_blocked(&req->sem);					\
     req->completed = FALSE;					\
     req->retries = 0;						\
+    req->merge_next = NULL;					\
+    req->done = NULL;						\
+    do_req_fun(req);						\
+}
+
+/* The number of asynchronous transfers each driver can have queued,
+   submitting any more waits until one of these has finished. */
+#define BLKIO_MAX_PENDING 32
+
+/* Defines the functions for accepting asynchronous transfers:
+
+   blkio_init() must be called once when the driver initialises.
+
+   async_io() queues the transfer IO to the device DEV, using COMMAND
+   and starting at BLOCK of the device (IO's own block number is
+   usually relative to a partition), and returns immediately (unless
+   all BLKIO_MAX_PENDING requests are in use, then it first sleeps
+   until one is free). When the transfer finishes blkio_complete() is
+   called on IO.
+
+   The macro argument DO-REQ-FUN names the function used to invoke the
+   next request. */
+
+#define ASYNC_IO_FUN(do_req_fun)				\
+static blkreq_t blkio_reqs[BLKIO_MAX_PENDING];			\
+static blkreq_t *blkio_free_reqs;				\
+static struct semaphore blkio_free_sem;				\
+								\
+static void							\
+blkio_init(void)						\
+{								\
+    int i;							\
+    blkio_free_reqs = NULL;					\
+    for(i = 0; i < BLKIO_MAX_PENDING; i++)			\
+    {								\
+	blkio_reqs[i].merge_next = blkio_free_reqs;		\
+	blkio_free_reqs = &blkio_reqs[i];			\
+    }								\
+    set_sem_blocked(&blkio_free_sem);				\
+}								\
+								\
+/* Called with interrupts masked when REQ has finished. */	\
+static void							\
+blkio_done(blkreq_t *req)					\
+{								\
+    blkio_t *io = req->io;					\
+    req->merge_next = blkio_free_reqs;				\
+    blkio_free_reqs = req;					\
+    signal(&blkio_free_sem);					\
+    blkio_complete(io, req->result);				\
+}								\
+								\
+static void							\
+async_io(BLKDEV_TYPE *dev, int command, u_long block, blkio_t *io) \
+{								\
+    blkreq_t *req;						\
+    u_long flags;						\
+    DB((BLKDEV_NAME ":async_io: block=%d count=%d\n",		\
+	block, io->nblocks));					\
+    io->completed = FALSE;					\
+    while(1)							\
+    {								\
+	save_flags(flags);					\
+	cli();							\
+	req = blkio_free_reqs;					\
+	if(req != NULL)						\
+	{							\
+	    blkio_free_reqs = req->merge_next;			\
+	    load_flags(flags);					\
+	    break;						\
+	}							\
+	load_flags(flags);					\
+	wait(&blkio_free_sem);					\
+    }								\
+    req->dev = dev;						\
+    req->command = command;					\
+    req->buf = io->buf;						\
+    req->block = block;						\
+    req->nblocks = io->nblocks;					\
+    req->completed = FALSE;					\
+    req->retries = 0;						\
+    req->merge_next = NULL;					\
+    req->io = io;						\
+    req->done = blkio_done;					\
     do_req_fun(req);						\
 }
 
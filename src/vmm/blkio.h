@@ -0,0 +1,49 @@
+/* blkio.h -- Asynchronous block transfers.
+
+   A blkio_t describes one transfer submitted to a block device without
+   waiting for it to finish. The caller owns the structure and must keep
+   it (and its buffer) valid until the transfer has completed; any
+   number of transfers may be in flight at once.
+
+   John Harper. */
+
+#ifndef __VMM_BLKIO_H
+#define __VMM_BLKIO_H
+
+#include <vmm/types.h>
+#include <vmm/tasks.h>
+
+typedef struct blkio {
+    /* Filled in by the caller. */
+    bool write;				/* TRUE to write, FALSE to read */
+    void *buf;				/* Data to transfer */
+    u_long block;			/* First block to transfer */
+    int nblocks;			/* Number of blocks */
+
+    /* When the transfer finishes, if CALLBACK is non-null it's called
+       with interrupts masked, usually from the device's interrupt
+       handler, so it mustn't sleep. Then if SEM is non-null it's
+       signalled. */
+    void (*callback)(struct blkio *io);
+    struct semaphore *sem;
+    void *data;				/* For the caller's use */
+
+    /* Set by the device. */
+    int result;				/* Zero if the transfer succeeded */
+    volatile bool completed;		/* TRUE when the transfer has ended */
+} blkio_t;
+
+/* Mark IO as finished with result RESULT and notify its submitter. Can
+   be called from an interrupt; interrupts should be masked. */
+static inline void
+blkio_complete(blkio_t *io, int result)
+{
+    io->result = result;
+    io->completed = TRUE;
+    if(io->callback != NULL)
+	io->callback(io);
+    if(io->sem != NULL)
+	signal(io->sem);
+}
+
+#endif /* __VMM_BLKIO_H */
@@ -32,6 +32,10 @@ struct cpu_fpu {
 	u_int32	flags __PACK__ ;	/* feature flags */
 };
 
+/* Bits in cpu_fpu.flags (CPUID function 1, EDX). */
+#define CPU_FEAT_FPU	0x00000001	/* FPU on chip */
+#define CPU_FEAT_VME	0x00000002	/* Virtual-8086 mode extensions */
+
 struct cookie_jar {
 	u_int16	total_mem;	/* Total memory in K */
 	struct cpu_fpu proc;	/* Processor Information */
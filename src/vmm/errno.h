@@ -37,6 +37,7 @@ extern int vmm_errno;
 #define E_INUSE		19	/* Object is being referenced. */
 #define E_NOTLINK	20	/* Object isn't a symbolic link. */
 #define E_MAXLINKS	21	/* Too many symbolic links. */
+#define E_TOOFRAG	22	/* File has too many extents. */
 
 extern const char *error_string(int err);
 extern const char *error_table[];
@@ -1,5 +1,6 @@
 #include <vmm/types.h>
 #include <vmm/kernel.h>
+#include <vmm/blkio.h>
 
 
 
@@ -89,6 +90,7 @@ extern bool floppy_mount_partition(void);
 extern bool floppy_mkfs_partition(void);
 
 extern long floppy_force_seek(fd_dev_t *fd, u_long cyl);
+extern bool floppy_submit_io(fd_dev_t *fd, blkio_t *io);
 
 extern bool add_floppy_commands(void);
 extern void remove_floppy_commands(void);
@@ -104,5 +106,6 @@ struct fd_module {
     bool (*floppy_mount_partition)(void);
     bool (*floppy_mkfs_partition)(void);
     long (*floppy_force_seek)(fd_dev_t *fd, u_long cyl);
+    bool (*floppy_submit_io)(fd_dev_t *fd, blkio_t *io);
 };
 
@@ -68,6 +68,14 @@ struct boot_blk {
 #define FS_BOOT_MAGIC   0xAA554d57
 #define FS_NOBOOT_MAGIC 0x00004d57
 
+/* Version 2 file systems create files whose data is mapped by extents
+   (see ATTR_EXTENTS), they're marked by these magic numbers. */
+#define FS_BOOT_MAGIC_V2   0xAA554d58
+#define FS_NOBOOT_MAGIC_V2 0x00004d58
+
+#define FS_VERSION_1 1
+#define FS_VERSION_2 2
+
 /* An inode as stored on disk. */
 struct inode {
     u_long attr;
@@ -85,6 +93,7 @@ struct inode {
 #define ATTR_MODE_MASK	0x000000ff
 #define ATTR_DIRECTORY	0x00010000
 #define ATTR_SYMLINK	0x00020000
+#define ATTR_EXTENTS	0x00040000	/* DATA holds extents, not blocks */
 
 #define SINGLE_INDIRECT 9
 #define DOUBLE_INDIRECT 10
@@ -103,28 +112,66 @@ struct indirect_blk {
     blkno data[PTRS_PER_INDIRECT];
 };
 
+/* A run of LENGTH blocks of a file, starting at logical block LOGICAL,
+   stored contiguously from block PHYSICAL of the device. */
+struct extent {
+    blkno logical;
+    blkno physical;
+    u_long length;
+};
+
+/* In an inode with the ATTR_EXTENTS attribute the first INODE_EXTENTS
+   extents are stored in data[0->8], data[9->11] point to up to
+   EXTENT_BLOCKS blocks of further extents. Extents are sorted by their
+   logical block and the first with a zero length marks the end. */
+#define INODE_EXTENTS 3
+#define EXTENT_BLOCKS 3
+#define EXTENTS_PER_BLOCK (FS_BLKSIZ / sizeof(struct extent))
+#define MAX_EXTENTS (INODE_EXTENTS + (EXTENT_BLOCKS * EXTENTS_PER_BLOCK))
+
+struct extent_blk {
+    struct extent ext[EXTENTS_PER_BLOCK];
+    char pad[FS_BLKSIZ - (EXTENTS_PER_BLOCK * sizeof(struct extent))];
+};
+
 /* An inode as stored in memory. */
 struct core_inode {
-    struct core_inode *next;
+    list_node_t node;			/* in the unused list, if unreferenced */
+    struct core_inode *hash_next;
     int use_count;
     struct fs_device *dev;
     struct inode inode;
     u_long inum;
     bool dirty;
     bool invalid;
+    /* For extent-mapped inodes: the number of extents (or -1 if not
+       yet counted) and the last extent that a block was found in. */
+    int nr_extents;
+    struct extent last_extent;
 #ifndef TEST
     bool locked;
     struct task_list *locked_tasks;
 #endif
 };
-#define NR_INODES 30
 
-/* A file handle. */
+/* The in-core inode cache. It may hold up to one inode for every
+   INODE_RAM_FRACTION free pages at initialisation, never less than
+   INODE_MIN; more are allocated if all of them are in use. */
+#define INODE_MIN 32
+#define INODE_RAM_FRACTION 4
+#define INODE_BUCKETS 128
+
+/* A file handle. The RA- fields track sequential reading: RA-NEXT is
+   the logical block expected to be read next, RA-END the first block
+   not yet read ahead and RA-WINDOW the current read-ahead size. */
 struct file {
     struct file *next;
     struct core_inode *inode;
     u_long mode;
     u_long pos;
+    blkno ra_next;
+    blkno ra_end;
+    u_long ra_window;
 };
 #define NR_FILES 50
 
@@ -135,6 +182,7 @@ struct file {
 #define F_TRUNCATE	8	/* Truncate the file to zero bytes. */
 #define F_ALLOW_DIR	16	/* Allow the opening of directories. */
 #define F_DONT_LINK	32	/* Don't follow symlinks. */
+#define F_DIRECT	64	/* Transfer whole blocks without caching. */
 
 /* Operations on file handles. */
 #define F_ATTR(f)	((f)->inode->inode.attr)
@@ -149,6 +197,9 @@ struct file {
 #define F_WRITEABLE(f)	(!(F_ATTR(f) & ATTR_NO_WRITE))
 #define F_EXECABLE(f)	((F_ATTR(f) & ATTR_EXEC))
 
+/* FLAGS arguments to preallocate_file(). */
+#define PREALLOC_ZERO	1	/* Fill the new blocks with zeros. */
+
 /* TYPE arguments to seek_file(). */
 #define SEEK_ABS	0	/* N bytes from the start of the file. */
 #define SEEK_REL	1	/* N bytes from the current position. */
@@ -170,16 +221,39 @@ struct dir_entry_blk {
     char pad[FS_BLKSIZ - (DIR_ENTRIES_PER_BLOCK * sizeof(struct dir_entry))];
 };
 
+/* Size of the directory name-lookup cache. */
+#define NR_DCACHE 256
+#define DCACHE_BUCKETS 64
+
+/* The inode number recorded for names known not to exist. */
+#define DCACHE_NEGATIVE 0xffffffff
+
 
-/* One buffer in the buffer cache. Currently a limited number of buffers
-   are allocated statically, none dynamically. */
+/* The data of one block in the buffer cache. Buffer data lives in pages
+   from alloc_page(), BUFS_PER_PAGE blocks to each page. */
+union buf_data {
+    blk data;
+    struct boot_blk boot;
+    struct inode_blk inodes;
+    struct dir_entry_blk dir;
+    struct indirect_blk ind;
+    struct extent_blk extents;
+    u_long bmap[FS_BLKSIZ / 4];
+};
+
+/* One buffer in the buffer cache. Buffers are allocated a page's worth
+   at a time as the cache grows and freed again when it shrinks. LINK is
+   the buffer's node in the global LRU list while it's cached. */
 struct buf_head {
     union {
 	list_node_t node;
 	struct buf_head *next_free;
     } link;
+    struct buf_head *hash_next;
+    struct buf_head *dirty_next;	/* in dev->dirty_list, by blkno */
     struct fs_device *dev;
     blkno blkno;
+    u_long dirty_time;			/* ticks when first dirtied */
     short use_count;
     bool dirty;
     bool invalid;
@@ -187,21 +261,37 @@ struct buf_head {
     bool locked;
     struct task_list *locked_tasks;
 #endif
-    union {
-	blk data;
-	struct boot_blk boot;
-	struct inode_blk inodes;
-	struct dir_entry_blk dir;
-	struct indirect_blk ind;
-	u_long bmap[FS_BLKSIZ / 4];
-    } buf;
+    union buf_data *buf;
 };
 
-#define NR_BUFFERS 20
-#define BUFFER_BUCKETS 4
-#define BUFFER_HASH(blkno) ((blkno) % BUFFER_BUCKETS)
+/* Limits on the size of the buffer cache, in blocks. The actual maximum
+   is set at run time from the amount of free memory (one block in
+   BUFFER_RAM_FRACTION) and may be changed with the `bufsize' command. */
+#define BUFFER_MIN 20
+#define BUFFER_RAM_FRACTION 8
+#define BUFFER_RESERVE_PAGES 64
+
+/* Dirty buffers are written back by the flusher task every FLUSH_INTERVAL
+   ticks once they've been dirty for FLUSH_AGE ticks, or straight away
+   when more than FLUSH_DIRTY_RATIO percent of the cache is dirty. Runs
+   of up to FLUSH_MAX_BLOCKS adjacent blocks are written in one go. */
+#define FLUSH_INTERVAL 1024
+#define FLUSH_AGE (5 * 1024)
+#define FLUSH_DIRTY_RATIO 25
+#define FLUSH_MAX_BLOCKS 16
+
+/* The read-ahead window of a file being read sequentially starts at
+   RA_MIN_BLOCKS and doubles each time it's used up, to RA_MAX_BLOCKS. */
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 32
+
+/* Files opened with F_DIRECT transfer at most this many blocks with each
+   device access. */
+#define DIRECT_MAX_BLOCKS 64
+
+/* preallocate_file() zeros new blocks at most this many at a time. */
+#define PREALLOC_ZERO_BLOCKS 16
 
-
 /* A device which the file system can access, there's a list of these
    somewhere. NAME is the device identifier. READ-BLOCK and WRITE-BLOCK
    are used to access the device. TEST-MEDIA is needed by devices with
@@ -218,6 +308,16 @@ struct fs_device {
     long (*read_blocks)(void *user_data, blkno block, void *buf, int count);
     long (*write_blocks)(void *user_data, blkno block, void *buf, int count);
 
+    /* Vectored versions of the above, these transfer the COUNT blocks
+       starting at BLOCK to or from the COUNT separate FS_BLKSIZ sized
+       buffers in BUFS, preferably with a single device command. They
+       needn't be defined; alloc_device() sets them to NULL and the
+       buffer cache then copies through a contiguous buffer instead. */
+    long (*read_blocks_v)(void *user_data, blkno block, void **bufs,
+			  int count);
+    long (*write_blocks_v)(void *user_data, blkno block, void **bufs,
+			   int count);
+
     /* Devices with removable media (i.e. floppys) should define this
        function, when called it returns E_NODISK if no disk is in the
        drive, E_DISKCHANGE if a new disk was inserted since it was
@@ -235,6 +335,13 @@ struct fs_device {
     struct fs_device *next;
     struct super_data sup;	/* read from the boot block */
     struct core_inode *root;	/* may be NULL if device is invalid */
+    int version;		/* FS_VERSION_1 or FS_VERSION_2 */
+    struct buf_head *dirty_list; /* dirty buffers, sorted by block */
+    u_long dirty_count;		/* number of buffers in DIRTY-LIST */
+    u_char *free_map;		/* in-memory copy of the data bitmap */
+    u_long *group_free;		/* free blocks in each bitmap block */
+    u_long free_blocks;		/* total free blocks in FREE-MAP */
+    blkno alloc_cursor;		/* where the next search starts */
     int use_count;		/* number of live references */
     bool read_only;		/* TRUE for write-protected devices */
     bool invalid;		/* TRUE when device is invalid */
@@ -248,6 +355,12 @@ struct fs_device {
 #define FS_WRITE_BLOCKS(dev, blk, buf, count) \
     ((dev)->write_blocks((dev)->user_data, blk, buf, count))
 
+#define FS_READ_BLOCKS_V(dev, blk, bufs, count) \
+    ((dev)->read_blocks_v((dev)->user_data, blk, bufs, count))
+
+#define FS_WRITE_BLOCKS_V(dev, blk, bufs, count) \
+    ((dev)->write_blocks_v((dev)->user_data, blk, bufs, count))
+
 
 struct fs_module {
     struct module base;
@@ -269,6 +382,7 @@ struct fs_module {
     struct file *(*dup)(struct file *f);
     bool (*truncate)(struct file *f);
     bool (*set_file_size)(struct file *f, size_t size);
+    bool (*preallocate)(struct file *f, size_t size, u_long flags);
     bool (*make_link)(const char *name, struct file *src);
     bool (*remove_link)(const char *name);
     bool (*set_file_mode)(const char *name, u_long modes);
@@ -277,7 +391,8 @@ struct fs_module {
     struct file *(*get_current_dir)(void);
     struct file *(*swap_current_dir)(struct file *dir);
     bool (*make_symlink)(const char *name, const char *link);
-    bool (*mkfs)(struct fs_device *dev, u_long blocks, u_long reserved);
+    bool (*mkfs)(struct fs_device *dev, u_long blocks, u_long reserved,
+		 int version);
 
     /* Buffer-cache functions. */
     struct buf_head *(*bread)(struct fs_device *dev, blkno blk);
@@ -325,13 +440,17 @@ extern bool validate_device(struct fs_device *dev);
 /* from bitmap.c */
 extern blkno bmap_alloc(struct fs_device *dev, blkno bmap_start, u_long bmap_len);
 extern bool bmap_free(struct fs_device *dev, blkno bmap_start, u_long bit);
+extern void discard_free_map(struct fs_device *dev);
+extern void plan_allocation(struct fs_device *dev, u_long count);
 extern blkno alloc_block(struct fs_device *dev, blkno locality);
 extern bool free_block(struct fs_device *dev, blkno blk);
 extern u_long used_blocks(struct fs_device *dev);
 
 /* from inode.c */
+extern u_long nr_inodes, max_inodes, unused_inodes;
 extern void init_inodes(void);
 extern void kill_inodes(void);
+extern void shrink_inodes(u_long target);
 extern struct core_inode *make_inode(struct fs_device *dev, u_long inum);
 extern struct core_inode *dup_inode(struct core_inode *inode);
 extern void close_inode(struct core_inode *inode);
@@ -341,6 +460,7 @@ extern bool free_inode(struct fs_device *dev, u_long inum);
 extern bool read_inode(struct core_inode *inode);
 extern bool write_inode(struct core_inode *inode);
 extern blkno get_data_blkno(struct core_inode *inode, blkno blk, bool create);
+extern bool delete_extents(struct core_inode *inode);
 extern struct buf_head *get_data_block(struct core_inode *inode, blkno blk, bool create);
 
 /* from fs_mod.c */
@@ -363,6 +483,7 @@ extern long write_file(const void *buf, size_t len, struct file *file);
 extern bool delete_inode_data(struct core_inode *inode);
 extern bool truncate_file(struct file *file);
 extern bool set_file_size(struct file *file, size_t size);
+extern bool preallocate_file(struct file *file, size_t size, u_long flags);
 extern bool set_file_modes(const char *name, u_long mode);
 
 /* from dir.c */
@@ -380,19 +501,41 @@ extern bool remove_directory(const char *name);
 extern struct file *get_current_dir(void);
 extern struct file *swap_current_dir(struct file *dir);
 
+/* from dcache.c */
+extern u_long dcache_hits, dcache_misses;
+extern void init_dcache(void);
+extern bool dcache_lookup(struct fs_device *dev, u_long dir, const char *name,
+			  u_long *inump);
+extern void dcache_enter(struct fs_device *dev, u_long dir, const char *name,
+			 u_long inum);
+extern void dcache_invalidate_dir(struct fs_device *dev, u_long dir);
+extern void dcache_invalidate_device(struct fs_device *dev);
+
 /* from buffer.c */
 extern u_long total_accessed, cached_accesses, dirty_accesses;
+extern u_long nr_buffers, min_buffers, max_buffers, buffer_buckets;
+extern u_long total_dirty, flushed_blocks, flush_writes;
+extern u_long readahead_blocks, readahead_reads;
+extern u_long direct_reads, direct_writes;
 extern void init_buffers(void);
 extern void kill_buffers(void);
 extern struct buf_head *bread(struct fs_device *dev, blkno blk);
+extern void bread_ahead(struct fs_device *dev, blkno blk, int count);
 extern bool bwrite(struct fs_device *dev, blkno blk, const void *data);
+extern bool bread_direct(struct fs_device *dev, blkno blk, void *data,
+			 int count);
+extern bool bwrite_direct(struct fs_device *dev, blkno blk, const void *data,
+			  int count);
 extern void bdirty(struct buf_head *bh, bool write_now);
 extern void brelse(struct buf_head *bh);
 extern void flush_device_cache(struct fs_device *dev, bool dont_write);
+extern bool set_buffer_limits(u_long min, u_long max);
+extern void sync_buffers(struct fs_device *dev);
 extern bool test_media(struct fs_device *dev);
 
 /* from mkfs.c */
-extern bool mkfs(struct fs_device *dev, u_long blocks, u_long reserved);
+extern bool mkfs(struct fs_device *dev, u_long blocks, u_long reserved,
+		 int version);
 
 /* from lib.c */
 extern int fs_putc(u_char c, struct file *fh);
@@ -404,8 +547,10 @@ extern int fs_fprintf(struct file *fh, const char *fmt, ...);
 
 #ifdef TEST
   /* from test_dev.c */
-  extern bool open_test_dev(const char *file, bool mkfs, u_long reserved);
+  extern bool open_test_dev(const char *file, bool mkfs, u_long reserved,
+			    int version);
   extern void close_test_dev(void);
+  extern u_long dev_reads, dev_writes, dev_blocks_read, dev_blocks_written;
 
   /* from ../shell/test.c */
   extern struct shell_module *shell;
@@ -7,6 +7,7 @@
 #include <vmm/types.h>
 #include <vmm/module.h>
 #include <vmm/fs.h>
+#include <vmm/blkio.h>
 
 #define PARTN_NAME_MAX 8
 
@@ -27,6 +28,15 @@ typedef struct hd_dev {
 			int count);
     bool (*write_blocks)(struct hd_dev *hd, void *buf, u_long block,
 			 int count);
+    /* Optional. Transfer COUNT buffers BUFS, each PER-BUF blocks long,
+       to or from the consecutive blocks from BLOCK. */
+    bool (*read_blocks_v)(struct hd_dev *hd, void **bufs, u_long block,
+			  int count, int per_buf);
+    bool (*write_blocks_v)(struct hd_dev *hd, void **bufs, u_long block,
+			   int count, int per_buf);
+    /* Optional. Start the transfer IO at the block BLOCK of the disk
+       and return without waiting for it. */
+    bool (*submit_io)(struct hd_dev *hd, blkio_t *io, u_long block);
 } hd_dev_t;
 
 struct hd_module {
@@ -40,7 +50,12 @@ struct hd_module {
     bool (*write_blocks)(hd_partition_t *p, void *buf, u_long block,
 			 int count);
     bool (*mount_partition)(hd_partition_t *p, bool read_only);
-    bool (*mkfs_partition)(hd_partition_t *p, u_long reserved);
+    bool (*mkfs_partition)(hd_partition_t *p, u_long reserved, int version);
+    bool (*read_blocks_v)(hd_partition_t *p, void **bufs, u_long block,
+			  int count, int per_buf);
+    bool (*write_blocks_v)(hd_partition_t *p, void **bufs, u_long block,
+			   int count, int per_buf);
+    bool (*submit_io)(hd_partition_t *p, blkio_t *io);
 };
 
 
@@ -51,6 +66,11 @@ struct hd_module {
 /* from ide.c */
 extern bool ide_read_blocks(hd_dev_t *hd, void *buf, u_long block, int count);
 extern bool ide_write_blocks(hd_dev_t *hd, void *buf, u_long block, int count);
+extern bool ide_read_blocks_v(hd_dev_t *hd, void **bufs, u_long block,
+			      int count, int per_buf);
+extern bool ide_write_blocks_v(hd_dev_t *hd, void **bufs, u_long block,
+			       int count, int per_buf);
+extern bool ide_submit_io(hd_dev_t *hd, blkio_t *io, u_long block);
 extern void ide_init(void);
 
 /* from generic.c */
@@ -62,8 +82,14 @@ extern bool hd_add_dev(hd_dev_t *hd);
 extern bool hd_remove_dev(hd_dev_t *hd);
 extern bool hd_read_blocks(hd_partition_t *p, void *buf, u_long block, int count);
 extern bool hd_write_blocks(hd_partition_t *p, void *buf, u_long block, int count);
+extern bool hd_read_blocks_v(hd_partition_t *p, void **bufs, u_long block,
+			     int count, int per_buf);
+extern bool hd_write_blocks_v(hd_partition_t *p, void **bufs, u_long block,
+			      int count, int per_buf);
+extern bool hd_submit_io(hd_partition_t *p, blkio_t *io);
 extern bool hd_mount_partition(hd_partition_t *p, bool read_only);
-extern bool hd_mkfs_partition(hd_partition_t *p, u_long reserved);
+extern bool hd_mkfs_partition(hd_partition_t *p, u_long reserved,
+			      int version);
 
 /* from hd_mod.c */
 extern struct hd_module hd_module;
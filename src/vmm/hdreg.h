@@ -4,6 +4,8 @@
 #ifndef _VMM_HDREG_H
 #define _VMM_HDREG_H
 
+#include <vmm/types.h>
+
 
 /* I/O ports. These are for the first controller, the other one can be
    accessed at 0x170-0x177. */
@@ -69,19 +71,57 @@
 #define HD_CMD_READMULT		0xC4	/* Read multiple. */
 #define HD_CMD_WRITEMULT	0xC5	/* Write multiple. */
 #define HD_CMD_SETMULT		0xC6	/* Set multiple mode. */
+#define HD_CMD_READDMA		0xC8	/* Read DMA (w/ retry). */
+#define HD_CMD_WRITEDMA		0xCA	/* Write DMA (w/ retry). */
 #define HD_CMD_IDENTIFY		0xEC	/* Identify drive. */
 #define HD_CMD_SETFEATURES	0xEF	/* Set features. */
 
+/* HD_FEATURE values for HD_CMD_SETFEATURES. */
+#define HD_FEAT_XFER_MODE	0x03	/* Set transfer mode from NSECTOR. */
+#define HD_XFER_MWDMA		0x20	/* OR'd with the multiword mode. */
+
 #define ATA_IDENT_DEVICETYPE   0
 #define ATA_IDENT_CYLINDERS    2
 #define ATA_IDENT_HEADS        6
 #define ATA_IDENT_SECTORS      12
 #define ATA_IDENT_SERIAL       20
 #define ATA_IDENT_MODEL        54
+#define ATA_IDENT_MAX_MULTIPLE 94
 #define ATA_IDENT_CAPABILITIES 98
 #define ATA_IDENT_FIELDVALID   106
 #define ATA_IDENT_MAX_LBA      120
+#define ATA_IDENT_MWDMA        126
 #define ATA_IDENT_COMMANDSETS  164
+#define ATA_IDENT_UDMA         176
 #define ATA_IDENT_MAX_LBA_EXT  200
 
+
+/* PCI bus-master IDE (SFF-8038i, as on the Intel PIIX). These are
+   offsets from the I/O base in BAR4 of the controller, the registers
+   of the primary channel come first. */
+
+#define BM_COMMAND	0		/* Command, see bits below. */
+#define BM_STATUS	2		/* Status, see bits below. */
+#define BM_PRD		4		/* Physical address of PRD table. */
+
+/* BM_COMMAND bits. */
+#define BM_CMD_START	0x01		/* Start/stop the transfer. */
+#define BM_CMD_READ	0x08		/* Transfer is device to memory. */
+
+/* BM_STATUS bits. */
+#define BM_STAT_ACTIVE	0x01		/* Transfer in progress. */
+#define BM_STAT_ERR	0x02		/* Bus error, write 1 to clear. */
+#define BM_STAT_INTR	0x04		/* Drive interrupted, write 1 to clear. */
+
+/* One entry in the Physical Region Descriptor table describing the
+   memory for a DMA transfer. A region mustn't cross a 64K boundary;
+   the table mustn't cross one either. */
+struct ide_prd {
+    u_long addr;			/* Physical address, even */
+    u_short count;			/* Bytes, 0 means 64K */
+    u_short flags;
+};
+
+#define PRD_EOT		0x8000		/* Last entry in the table. */
+
 #endif /* _VMM_HDREG_H */
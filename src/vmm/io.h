@@ -41,14 +41,14 @@ static inline u_long
 inl(u_short port)
 {
     u_long res;
-    asm volatile ("inl %w1,%l0" : "=a" (res) : "d" (port));
+    asm volatile ("inl %w1,%0" : "=a" (res) : "d" (port));
     return res;
 }
 
 static inline void
 outl(u_long value, u_short port)
 {
-    asm volatile ("outl %l0,%w1" : : "a" (value), "d" (port));
+    asm volatile ("outl %0,%w1" : : "a" (value), "d" (port));
 }
 
 
@@ -39,6 +39,7 @@ struct kernel_module
     page *(*alloc_pages_64)(u_long n);
     void (*free_page)(page *page);
     void (*free_pages)(page *page, u_long n);
+    u_long (*free_page_count)(void);
     void (*map_page)(page_dir *pd, page *p, u_long addr, int flags);
     void (*set_pte)(page_dir *pd, u_long addr, u_long pte);
     u_long (*get_pte)(page_dir *pd, u_long addr);
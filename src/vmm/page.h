@@ -41,6 +41,8 @@ typedef union _page {
 
 /* System-defined bits in the PTE_AVAIL field. */
 #define PTE_FREEABLE	0x00000200	/* Page may be freed. */
+#define PTE_COW		0x00000400	/* Shared, copy before writing. */
+#define PTE_SWAPPED	0x00000800	/* Not present, in swap slot ADDR. */
 
 #define PTE_GET_ADDR(x)	((x) & PTE_ADDR)
 
@@ -4,6 +4,7 @@
 #include <vmm/types.h>
 #include <vmm/kernel.h>
 #include <vmm/lists.h>
+#include <vmm/blkio.h>
 
 #define RD_CMD_READ	1
 #define RD_CMD_WRITE	2
@@ -25,6 +26,7 @@ extern bool ramdisk_remove_dev(void);
 
 extern long ramdisk_read_blocks(rd_dev_t *fd, void *buf, u_long block, int count);
 extern long ramdisk_write_blocks(rd_dev_t *fd, void *buf, u_long block, int count);
+extern bool ramdisk_submit_io(rd_dev_t *rd, blkio_t *io);
 extern long ramdisk_test_media(void *f);
 extern bool ramdisk_mount_disk(rd_dev_t *rd);
 extern bool ramdisk_mkfs_disk(rd_dev_t *rd, u_long reserved);
@@ -49,6 +51,7 @@ struct ramdisk_module {
     bool (*delete_ramdisk)(rd_dev_t *rd);
 
     bool (*add_commands)(void);
+    bool (*ramdisk_submit_io)(rd_dev_t *rd, blkio_t *io);
 };
 
 extern struct ramdisk_module ramdisk_module;
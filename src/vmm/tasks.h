@@ -39,6 +39,10 @@ struct tss {
 	unsigned short	gs, __gsh;
 	unsigned short	ldt, __ldth;
 	unsigned short	trace, bitmap;
+	/* With CR4.VME set, a clear bit in this map makes `INT n' in
+	   V86 mode vector through the real-mode IVT without trapping.
+	   It has to sit directly below the I/O bitmap. */
+	unsigned char	int_redirect[32];
 	/* I/O bitmap follows.. */
 };
 
@@ -84,6 +88,10 @@ struct task {
     void (*gpe_handler)(struct trap_regs *regs);
     bool (*pfl_handler)(struct trap_regs *regs, u_long lin_addr);
 
+    /* Page faults being handled by this task. The pfl_handler may sleep
+       so this can't be global. */
+    int pfl_nest;
+
     /* Available for use by the `owner' of the task. In virtual machines
        this always points to the task's `struct vm'. */
     void *user_data;
@@ -128,6 +136,7 @@ extern struct task *find_task_by_pid(u_long pid);
 
 struct shell;
 extern void describe_tasks(struct shell *sh);
+extern void map_tasks(void (*func)(struct task *task, void *arg), void *arg);
 
 #endif /* KERNEL */
 
@@ -43,6 +43,15 @@ struct io_handler {
     u_short low_port, high_port;
     u_long (*in)(struct vm *vm, u_short port, int size);
     void (*out)(struct vm *vm, u_short port, int size, u_long val);
+    /* Optional, used by `REP INS' and `REP OUTS'. Transfer up to COUNT
+       elements of SIZE bytes between PORT and the buffer BUF in the
+       virtual machine's address space, returning the number actually
+       transferred. Returning zero makes the caller fall back to IN or
+       OUT for the next element. */
+    u_long (*in_string)(struct vm *vm, u_short port, int size, u_long count,
+			void *buf);
+    u_long (*out_string)(struct vm *vm, u_short port, int size,
+			 u_long count, void *buf);
 };
 
 struct arpl_handler {
@@ -58,6 +67,31 @@ struct vm_kill_handler {
 };
 
 
+/* An instruction which trapped and was decoded by the vm's fault
+   handlers, kept so that the next trap at the same address needn't decode
+   it again. See fault.c. */
+struct vm_insn {
+    u_long addr;			/* Linear address of first byte */
+    u_long code[2], mask[2];		/* Its first LEN bytes */
+    u_short prefixes;			/* PFX_ bits */
+    u_char opcode, opcode2;		/* OPCODE2 follows 0x0f or 0xf3 */
+    u_char imm;				/* Port or vector number */
+    u_char len;
+    u_char type;			/* INSN_ type, or zero if unused */
+};
+
+#define VM_INSN_CACHE	16		/* Must be a power of two */
+
+
+/* A virtual device installed in a vm by the `vmvxd' command, ARGV[0] is
+   the name of its module. Recorded so that clones of the vm can be given
+   the same devices. */
+struct vm_vxd {
+    struct vm_vxd *next;
+    int argc;
+    char **argv;
+};
+
 /* Virtual machines. */
 
 struct vm {
@@ -69,15 +103,46 @@ struct vm {
     bool hlted;
     bool nmi_sts;
     bool a20_state;
+
+    /* When TRUE the vm runs with CR4.VME set: the hardware keeps the
+       virtual interrupt flag in EFLAGS_VIF of the vm's own eflags and
+       CLI, STI, PUSHF and POPF only trap when an interrupt is waiting
+       (EFLAGS_VIP). Whenever the vm enters vm_gpe_handler() its VIF is
+       copied into VIRTUAL_EFLAGS, and copied back on the way out. */
+    bool vme;
     u_long himem_ptes[16];
     void *slots[32];
     struct cookie_jar hardware;
+
+    /* The I/O port dispatch table, see get_io_handler(). Each entry
+       of IO_TABLE covers 256 ports; it is either the global table for
+       those ports or (if its bit in IO_PRIVATE is set) an array owned
+       by this vm. The table is rebuilt whenever IO_GEN is out of date. */
+    struct io_handler **io_table[256];
+    u_long io_private[256 / 32];
+    u_long io_gen;
+
+    /* Recently trapped instructions, indexed by a hash of their
+       linear address. */
+    struct vm_insn insn_cache[VM_INSN_CACHE];
+
+    /* The devices installed in this vm, in order. */
+    struct vm_vxd *vxd_list;
+
+    /* The next vm in VM_LIST. */
+    struct vm *next;
 };
 
 #define GET_TASK_VM(task) ((struct vm *)((task)->user_data))
 
+/* The vm86 registers of VM, saved at the top of its task's level 0 stack
+   when it last entered the kernel. */
+#define VM_FRAME(vm) (((struct vm86_regs *)(vm)->task->tss.esp0) - 1)
+
 #define EFLAGS_RF	0x00010000
 #define EFLAGS_VM	0x00020000
+#define EFLAGS_VIF	0x00080000
+#define EFLAGS_VIP	0x00100000
 #define FLAGS_NT	0x8000
 #define FLAGS_IOPL	0x7000
 #define FLAGS_DF	0x0400
@@ -86,6 +151,12 @@ struct vm {
 #define FLAGS_CF	0x0001
 #define USER_EFLAGS	0x00000cff
 
+/* Bit in CR4 enabling Virtual-8086 mode extensions. */
+#define CR4_VME		0x00000001
+
+/* Bit in CR0 making ring 0 writes honour read-only pages (486 and up). */
+#define CR0_WP		0x00010000
+
 #define STC(regs)	((regs)->eflags |= FLAGS_CF)
 #define CLC(regs)	((regs)->eflags &= ~FLAGS_CF)
 
@@ -121,6 +192,9 @@ struct vm_module {
     void (*free_vm_slot)(int slot);
     void (*set_gate_a20)(struct vm *vm, bool state);
     void (*simulate_int)(struct vm *vm, struct trap_regs *regs, int type);
+    struct vm *(*clone_vm)(struct vm *template, const char *name);
+    bool (*save_vm)(struct vm *vm, const char *file);
+    struct vm *(*restore_vm)(const char *file, const char *name);
 };
 
 extern struct vm_module vm_module;
@@ -128,6 +202,21 @@ extern struct vm_module vm_module;
 struct vxd_module {
     struct module vxd_base;
     bool (*create_vxd)(struct vm *vm, int argc, char **argv);
+
+    /* If non-null, called after the device has been created in the
+       clone TO of the vm FROM to copy the state of FROM's device. */
+    void (*clone_vxd)(struct vm *from, struct vm *to);
+
+    /* If non-null, called when VM is saved to a file. Returns a block
+       of memory (from kernel->malloc(), freed by the caller) holding the
+       state of VM's device and sets *LENP to its length, or returns NULL
+       if the state can't be saved. */
+    void *(*save_vxd)(struct vm *vm, size_t *lenp);
+
+    /* If non-null, called after the device has been created in a vm
+       restored from a file to give it the state returned by save_vxd().
+       Returns FALSE if DATA isn't valid. */
+    bool (*restore_vxd)(struct vm *vm, const void *data, size_t len);
 };
 
 
@@ -139,6 +228,7 @@ struct vxd_module {
 struct shell;
 
 /* from vmach.c */
+extern struct vm *vm_list;
 extern struct io_handler *global_io;
 extern bool verbose_io;
 extern bool init_vm(void);
@@ -158,6 +248,36 @@ extern int alloc_vm_slot(void);
 extern void free_vm_slot(int slot);
 extern void set_gate_a20(struct vm *vm, bool state);
 
+/* from cow.c */
+extern bool cow_enabled;
+extern bool init_cow(void);
+extern u_long share_pte(u_long *ptep);
+extern bool break_cow(struct vm *vm, u_long addr);
+extern bool map_zero_page(struct vm *vm, u_long addr, u_long pte);
+extern void set_vm_pte(struct vm *vm, u_long addr, u_long pte);
+extern void release_cow_pages(struct vm *vm);
+
+/* from swap.c */
+extern page *alloc_vm_page(void);
+extern bool swap_in(struct vm *vm, u_long addr);
+extern bool pin_vm_memory(struct vm *vm, u_long addr, size_t len,
+			  bool writing);
+extern bool lock_vm_memory(struct vm *vm);
+extern void unlock_vm_memory(void);
+extern void release_swap_slots(struct vm *vm);
+extern bool start_swap(const char *name, u_long kbytes);
+extern void describe_swap(struct shell *sh);
+
+/* from clone.c */
+extern bool add_vm_vxd(struct vm *vm, int argc, char **argv);
+extern void free_vm_vxds(struct vm *vm);
+extern void load_vm_regs(struct vm *vm, struct vm86_regs *regs);
+extern struct vm *clone_vm(struct vm *template, const char *name);
+
+/* from save.c */
+extern bool save_vm(struct vm *vm, const char *file);
+extern struct vm *restore_vm(const char *file, const char *name);
+
 /* from fault.c */
 extern void set_bios_handler(void (*bh)(struct vm *, u_char));
 extern void simulate_vm_int(struct vm *vm, struct trap_regs *regs, int vector);